@@ -0,0 +1,251 @@
+/* jdupes action for block-level deduplication of partly identical files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "act_dedupeblocks.h"
+
+#ifdef HAVE_DEDUPE_BLOCKS
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Use built-in static dedupe header if requested */
+#ifdef STATIC_DEDUPE_H
+ #include "linux-dedupe-static.h"
+#else
+ #include <linux/fs.h>
+#endif /* STATIC_DEDUPE_H */
+#ifndef FILE_DEDUPE_RANGE_SAME
+ #include "linux-dedupe-static.h"
+#endif /* FILE_DEDUPE_RANGE_SAME */
+#include <sys/ioctl.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "chunkcmp.h"
+#include "filehash.h"
+#include "rawio.h"
+
+/* Large files such as VM images and database snapshots are often mostly but
+ * not entirely identical, so whole-file matching never finds them. Every
+ * large file is split into fixed, aligned blocks and each block's hash is
+ * looked up in an index of all blocks seen so far on the same device. Runs
+ * of consecutive matching blocks become one FIDEDUPERANGE request; the
+ * kernel compares the data itself, so a hash collision can never cause
+ * damage. Blocks of zeroes are left alone since they are usually holes or
+ * preallocated space. Fixed blocks are used rather than content-defined
+ * chunks because the kernel can only share data at the same offset within
+ * a filesystem block, which data shifted by arbitrary amounts never has. */
+
+#define KERNEL_DEDUP_MAX_SIZE 16777216
+
+/* Index entry: the first place a block with this hash was seen */
+struct blockref {
+  uint64_t hash;
+  uint32_t file;        /* Index into the candidate list plus one; 0 = unused */
+  uint32_t block;
+};
+
+static struct blockref *table;
+static size_t table_mask;
+static file_t **cand;
+static struct file_dedupe_range *fdr;
+static int src_fd = -1;
+static uint32_t src_file = UINT32_MAX;
+static uintmax_t total_bytes, total_ranges;
+
+
+/* Biggest files first so that they become the sources, grouped by device */
+static int sort_candidates(const void *p1, const void *p2)
+{
+  const file_t * const f1 = *(const file_t * const *)p1;
+  const file_t * const f2 = *(const file_t * const *)p2;
+
+  if (f1->device != f2->device) return (f1->device < f2->device) ? -1 : 1;
+  if (f1->size != f2->size) return (f1->size > f2->size) ? -1 : 1;
+  if (f1->inode != f2->inode) return (f1->inode < f2->inode) ? -1 : 1;
+  return 0;
+}
+
+
+/* Find the index slot for a hash: either its first entry or an empty slot */
+static struct blockref *find_block(const uint64_t hash)
+{
+  size_t i = (size_t)hash & table_mask;
+
+  while (table[i].file != 0 && table[i].hash != hash) i = (i + 1) & table_mask;
+  return &table[i];
+}
+
+
+/* Share a run of identical blocks; returns 0 or an error number. A range
+ * that the kernel finds to be different is not an error, just not shared */
+static int dedupe_run(const uint32_t src, const uint32_t src_block, const int dest_fd, const uint32_t dest_block, const uint32_t blocks, uintmax_t * const restrict bytes)
+{
+  uint64_t done = 0;
+  const uint64_t len = (uint64_t)blocks * DEDUPE_BLOCK_SIZE;
+
+  if (src_file != src) {
+    if (src_fd != -1) close(src_fd);
+    src_file = src;
+    src_fd = open(cand[src]->d_name, O_RDONLY);
+  }
+  if (src_fd == -1) return errno;
+
+  while (done < len) {
+    fdr->src_offset = (uint64_t)src_block * DEDUPE_BLOCK_SIZE + done;
+    fdr->src_length = (len - done <= KERNEL_DEDUP_MAX_SIZE) ? len - done : KERNEL_DEDUP_MAX_SIZE;
+    fdr->info[0].dest_fd = dest_fd;
+    fdr->info[0].dest_offset = (uint64_t)dest_block * DEDUPE_BLOCK_SIZE + done;
+    fdr->info[0].status = FILE_DEDUPE_RANGE_SAME;
+    fdr->info[0].bytes_deduped = 0;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) return errno;
+    if (fdr->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) break;
+    if (fdr->info[0].status < 0) return -fdr->info[0].status;
+    *bytes += fdr->info[0].bytes_deduped;
+    done += fdr->src_length;
+  }
+  return 0;
+}
+
+
+/* Index one file's blocks and share those already seen in another file */
+static void dedupe_file(const uint32_t idx, void * const restrict buf, const void * const restrict zero)
+{
+  file_t * const file = cand[idx];
+  const uint32_t blocks = (uint32_t)(file->size / DEDUPE_BLOCK_SIZE);
+  uint32_t run_src = 0, run_src_block = 0, run_dest_block = 0, run_len = 0, ranges = 0;
+  uintmax_t bytes = 0;
+  int fd, err = 0;
+
+  fd = rawio_open(file->d_name);
+  if (fd == -1) {
+    fprintf(stderr, "dedupe: open failed (skipping): %s\n", file->d_name);
+    exit_status = EXIT_FAILURE;
+    return;
+  }
+  rawio_advise(fd, file->device, 0, file->size);
+
+  for (uint32_t b = 0; b <= blocks && err == 0; b++) {
+    struct blockref *ref = NULL;
+    uint64_t hash[2];
+
+    /* The final pass only flushes the last run */
+    if (b < blocks) {
+      if (rawio_read(fd, buf, DEDUPE_BLOCK_SIZE, (off_t)b * DEDUPE_BLOCK_SIZE) != DEDUPE_BLOCK_SIZE) {
+        fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, file->d_name, 1);
+        exit_status = EXIT_FAILURE;
+        break;
+      }
+      if (!chunk_equal(buf, zero, DEDUPE_BLOCK_SIZE) && hash_block(hash_algo, buf, DEDUPE_BLOCK_SIZE, hash) == 0) {
+        ref = find_block(hash[0]);
+        if (ref->file == 0) {
+          ref->hash = hash[0];
+          ref->file = idx + 1;
+          ref->block = b;
+          ref = NULL;
+        } else if (ref->file == idx + 1) ref = NULL;
+      }
+    }
+
+    /* Extend the current run if this block continues it */
+    if (ref != NULL && run_len != 0 && ref->file - 1 == run_src
+        && ref->block == run_src_block + run_len && b == run_dest_block + run_len) {
+      run_len++;
+      continue;
+    }
+    if (run_len != 0) {
+      const uintmax_t before = bytes;
+
+      err = dedupe_run(run_src, run_src_block, fd, run_dest_block, run_len, &bytes);
+      if (bytes != before) ranges++;
+      run_len = 0;
+    }
+    if (ref != NULL) {
+      run_src = ref->file - 1;
+      run_src_block = ref->block;
+      run_dest_block = b;
+      run_len = 1;
+    }
+  }
+  close(fd);
+
+  if (err != 0) {
+    printf("  -XX-> %s\n", file->d_name);
+    fprintf(stderr, "error: %s (%d)\n", strerror(err), err);
+    exit_status = EXIT_FAILURE;
+  }
+  if (ranges != 0) {
+    printf("  ====> %s (%" PRIuMAX " KiB in %u ranges)\n", file->d_name, bytes >> 10, ranges);
+    total_bytes += bytes;
+    total_ranges += ranges;
+  }
+  return;
+}
+
+
+void dedupeblocks(file_t * restrict files)
+{
+  file_t *curfile;
+  void *buf, *zero;
+  size_t count = 0, i, start;
+
+  LOUD(fprintf(stderr, "\ndedupeblocks: %p\n", files);)
+
+  for (curfile = files; curfile; curfile = curfile->next)
+    if (curfile->size >= DEDUPE_BLOCK_MIN_FILE) count++;
+  if (count < 2) goto done;
+  cand = (file_t **)malloc(sizeof(file_t *) * count);
+  fdr = (struct file_dedupe_range *)calloc(1, sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+  buf = calloc(1, DEDUPE_BLOCK_SIZE);
+  zero = calloc(1, DEDUPE_BLOCK_SIZE);
+  if (unlikely(cand == NULL || fdr == NULL || buf == NULL || zero == NULL)) jc_oom("dedupeblocks()");
+  fdr->dest_count = 1;
+
+  count = 0;
+  for (curfile = files; curfile; curfile = curfile->next)
+    if (curfile->size >= DEDUPE_BLOCK_MIN_FILE) cand[count++] = curfile;
+  qsort(cand, count, sizeof(file_t *), sort_candidates);
+
+  /* Blocks can only be shared within one filesystem */
+  for (start = 0; start < count; start = i) {
+    size_t blocks = 0, size = 1024;
+    size_t end;
+
+    for (end = start; end < count && cand[end]->device == cand[start]->device; end++)
+      blocks += (size_t)(cand[end]->size / DEDUPE_BLOCK_SIZE);
+    while (size < blocks * 2) size <<= 1;
+    table = (struct blockref *)calloc(size, sizeof(struct blockref));
+    if (unlikely(table == NULL)) jc_oom("dedupeblocks() index");
+    table_mask = size - 1;
+    LOUD(fprintf(stderr, "dedupeblocks: device %" PRIuMAX ": %" PRIuMAX " files, %" PRIuMAX " blocks\n",
+          (uintmax_t)cand[start]->device, (uintmax_t)(end - start), (uintmax_t)blocks);)
+
+    for (i = start; i < end; i++) {
+      /* Hard links already share everything */
+      if (i > start && cand[i]->inode == cand[i - 1]->inode) continue;
+      dedupe_file((uint32_t)i, buf, zero);
+    }
+    free(table);
+    table = NULL;
+  }
+
+  if (src_fd != -1) close(src_fd);
+  src_fd = -1;
+  src_file = UINT32_MAX;
+  free(cand);
+  free(fdr);
+  free(buf);
+  free(zero);
+
+done:
+  if (!ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "Block-level deduplication done (%" PRIuMAX " KiB shared in %" PRIuMAX " ranges)\n", total_bytes >> 10, total_ranges);
+  return;
+}
+
+#endif /* HAVE_DEDUPE_BLOCKS */
@@ -0,0 +1,36 @@
+/* jdupes action for block-level deduplication of partly identical files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_DEDUPEBLOCKS_H
+#define ACT_DEDUPEBLOCKS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Block-level dedupe needs FIDEDUPERANGE, which only Linux has */
+#if defined ENABLE_DEDUPE && defined __linux__
+ #define HAVE_DEDUPE_BLOCKS 1
+#endif
+
+#ifdef HAVE_DEDUPE_BLOCKS
+/* Size of the blocks compared between files; must be a multiple of the
+ * filesystem block size since the kernel only dedupes whole blocks */
+ #ifndef DEDUPE_BLOCK_SIZE
+  #define DEDUPE_BLOCK_SIZE 131072
+ #endif
+/* Files smaller than this are not worth looking at block by block */
+ #ifndef DEDUPE_BLOCK_MIN_FILE
+  #define DEDUPE_BLOCK_MIN_FILE (DEDUPE_BLOCK_SIZE * 8)
+ #endif
+
+void dedupeblocks(file_t * restrict files);
+#endif /* HAVE_DEDUPE_BLOCKS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_DEDUPEBLOCKS_H */
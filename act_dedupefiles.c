@@ -13,7 +13,13 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
+
 #include "act_dedupefiles.h"
+#include "extents.h"
+#include "likely_unlikely.h"
 #include "libjodycode.h"
 
 #ifdef __linux__
@@ -49,117 +55,317 @@
 #error Dedupe is only supported on Linux and macOS
 #endif
 
-void dedupefiles(file_t * restrict files)
-{
 #ifdef __linux__
-  struct file_dedupe_range *fdr;
-  struct file_dedupe_range_info *fdri;
-  file_t *curfile, *curfile2, *dupefile;
-  int src_fd;
-  int err_twentytwo = 0, err_ninetyfive = 0;
-  uint64_t total_files = 0;
+/* Every duplicate in a set is passed to the kernel in one FIDEDUPERANGE call
+ * (as many as fit in the page-sized request) and independent sets are
+ * handled by a pool of threads. Results are printed by the main thread in
+ * the original set order, so the output is the same as a serial run. */
 
-  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+/* The kernel refuses requests larger than one page */
+ #define DEDUPE_MAX_DESTS ((4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info))
 
-  fdr = (struct file_dedupe_range *)calloc(1,
-        sizeof(struct file_dedupe_range)
-      + sizeof(struct file_dedupe_range_info) + 1);
-  fdr->dest_count = 1;
-  fdri = &fdr->info[0];
-  for (curfile = files; curfile; curfile = curfile->next) {
-    /* Skip all files that have no duplicates */
-    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
-    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+/* Result of deduplicating one destination file */
+enum dedupe_result { DD_OK, DD_LINKED, DD_OPEN_FAILED, DD_FAILED };
 
-    /* For each duplicate list head, handle the duplicates in the list */
-    curfile2 = curfile;
-    src_fd = open(curfile->d_name, O_RDONLY);
-    /* If an open fails, keep going down the dupe list until it is exhausted */
-    while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
-      fprintf(stderr, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
-      exit_status = EXIT_FAILURE;
-      curfile2 = curfile2->duplicates;
-      src_fd = open(curfile2->d_name, O_RDONLY);
-    }
-    if (src_fd == -1) continue;
-    printf("  [SRC] %s\n", curfile2->d_name);
-
-    /* Run dedupe for each set */
-    for (dupefile = curfile->duplicates; dupefile; dupefile = dupefile->duplicates) {
-      off_t remain;
-      int err;
-
-      /* Don't pass hard links to dedupe (GitHub issue #25) */
-      if (dupefile->device == curfile->device && dupefile->inode == curfile->inode) {
-        printf("  -==-> %s\n", dupefile->d_name);
-        continue;
-      }
+struct dedupe_dest {
+  file_t *file;
+  int fd;
+  enum dedupe_result result;
+  int status;           /* FIDEDUPERANGE status of the failing call */
+  int err;              /* errno of the failing call */
+};
 
-      /* Open destination file, skipping any that fail */
-      fdri->dest_fd = open(dupefile->d_name, O_RDONLY);
-      if (fdri->dest_fd == -1) {
-        fprintf(stderr, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
-        exit_status = EXIT_FAILURE;
-        continue;
+struct dedupe_set {
+  file_t *head;
+  file_t *src;          /* NULL if no file in the set could be opened */
+  struct dedupe_dest *dests;
+  unsigned int count;
+  unsigned int src_failed;  /* Files that failed to open as the source */
+  int done;
+};
+
+ #ifndef NO_THREADS
+static pthread_mutex_t set_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t set_cond = PTHREAD_COND_INITIALIZER;
+ #endif
+static struct dedupe_set *sets;
+static size_t set_count, next_set;
+
+
+/* Deduplicate a batch of open destinations against the source */
+static void dedupe_batch(const int src_fd, struct dedupe_dest * const restrict dests, const unsigned int count, struct file_dedupe_range * const restrict fdr, const off_t size)
+{
+  struct dedupe_dest *active[DEDUPE_MAX_DESTS];
+  off_t remain = size;
+
+  /* Dedupe 16 MiB or less at a time; a destination drops out at its first failure */
+  while (remain) {
+    unsigned int n = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+      if (dests[i].result != DD_OK) continue;
+      active[n] = &dests[i];
+      fdr->info[n].dest_fd = dests[i].fd;
+      fdr->info[n].dest_offset = (uint64_t)(size - remain);
+      fdr->info[n].status = FILE_DEDUPE_RANGE_SAME;
+      n++;
+    }
+    if (n == 0) break;
+    fdr->dest_count = (uint16_t)n;
+    fdr->src_offset = (uint64_t)(size - remain);
+    fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
+    errno = 0;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) == 0) {
+      for (unsigned int i = 0; i < n; i++) {
+        if (fdr->info[i].status != FILE_DEDUPE_RANGE_SAME) {
+          active[i]->result = DD_FAILED;
+          active[i]->status = fdr->info[i].status;
+        }
       }
+    } else {
+      /* The whole call failed, so none of the destinations were tried and
+       * one bad destination can fail them all; try each one on its own */
+      const int err = errno;
 
-      /* Dedupe src <--> dest, 16 MiB or less at a time */
-      remain = dupefile->size;
-      fdri->status = FILE_DEDUPE_RANGE_SAME;
-      /* Consume data blocks until no data remains */
-      while (remain) {
+      LOUD(fprintf(stderr, "dedupe_batch: batch of %u failed (%s), retrying one at a time\n", n, strerror(err));)
+      for (unsigned int i = 0; i < n; i++) {
+        fdr->dest_count = 1;
+        fdr->info[0].dest_fd = active[i]->fd;
+        fdr->info[0].dest_offset = fdr->src_offset;
+        fdr->info[0].status = FILE_DEDUPE_RANGE_SAME;
         errno = 0;
-        fdr->src_offset = (uint64_t)(dupefile->size - remain);
-        fdri->dest_offset = fdr->src_offset;
-        fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
-        ioctl(src_fd, FIDEDUPERANGE, fdr);
-        if (fdri->status < 0) break;
-        remain -= (off_t)fdr->src_length;
+        if (n == 1 || ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) {
+          active[i]->result = DD_FAILED;
+          active[i]->err = (n == 1) ? err : errno;
+        } else if (fdr->info[0].status != FILE_DEDUPE_RANGE_SAME) {
+          active[i]->result = DD_FAILED;
+          active[i]->status = fdr->info[0].status;
+        }
       }
+    }
+    remain -= (off_t)fdr->src_length;
+  }
+  return;
+}
+
+
+/* Deduplicate all files in one set; the results are printed later */
+static void dedupe_set(struct dedupe_set * const restrict set, struct file_dedupe_range * const restrict fdr)
+{
+  file_t *dupefile;
+  int src_fd = -1;
+  unsigned int i, start;
+
+  /* If an open fails, keep going down the dupe list until it is exhausted */
+  for (set->src = set->head; set->src != NULL; set->src = set->src->duplicates) {
+    src_fd = open(set->src->d_name, O_RDONLY);
+    if (src_fd != -1) break;
+    set->src_failed++;
+    if (set->src->duplicates == NULL || set->src->duplicates->duplicates == NULL) break;
+  }
+  if (src_fd == -1) {
+    set->src = NULL;
+    return;
+  }
+
+  for (dupefile = set->src->duplicates; dupefile != NULL; dupefile = dupefile->duplicates) set->count++;
+  set->dests = (struct dedupe_dest *)calloc(set->count, sizeof(struct dedupe_dest));
+  if (unlikely(set->dests == NULL)) jc_oom("dedupe_set()");
+
+  for (i = 0, dupefile = set->src->duplicates; dupefile != NULL; i++, dupefile = dupefile->duplicates) {
+    struct dedupe_dest * const dest = &set->dests[i];
+
+    dest->file = dupefile;
+    dest->fd = -1;
+    /* Don't pass hard links to dedupe (GitHub issue #25) */
+    if (dupefile->device == set->src->device && dupefile->inode == set->src->inode) {
+      dest->result = DD_LINKED;
+      continue;
+    }
+ #ifdef HAVE_EXTENTS
+    /* Files that already share all of their data need no more work */
+    if (extents_shared(set->src, dupefile)) {
+      dest->result = DD_LINKED;
+      continue;
+    }
+ #endif
+    /* Open destination file, skipping any that fail */
+    dest->fd = open(dupefile->d_name, O_RDONLY);
+    if (dest->fd == -1) dest->result = DD_OPEN_FAILED;
+  }
+
+  for (start = 0; start < set->count; start += (unsigned int)DEDUPE_MAX_DESTS) {
+    const unsigned int n = (set->count - start > DEDUPE_MAX_DESTS) ? (unsigned int)DEDUPE_MAX_DESTS : set->count - start;
+    dedupe_batch(src_fd, set->dests + start, n, fdr, set->src->size);
+  }
+
+  for (i = 0; i < set->count; i++) if (set->dests[i].fd != -1) close(set->dests[i].fd);
+  close(src_fd);
+  return;
+}
+
+
+static struct file_dedupe_range *alloc_fdr(void)
+{
+  struct file_dedupe_range * const fdr = (struct file_dedupe_range *)calloc(1,
+        sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info) * DEDUPE_MAX_DESTS);
+  if (unlikely(fdr == NULL)) jc_oom("dedupefiles()");
+  return fdr;
+}
 
-      /* Handle any errors */
-      err = fdri->status;
-      if (err != FILE_DEDUPE_RANGE_SAME || errno != 0) {
-        printf("  -XX-> %s\n", dupefile->d_name);
+
+ #ifndef NO_THREADS
+static void *dedupe_worker(void *arg)
+{
+  struct file_dedupe_range * const fdr = alloc_fdr();
+  size_t i;
+
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&set_lock);
+    i = next_set++;
+    pthread_mutex_unlock(&set_lock);
+    if (i >= set_count) break;
+    dedupe_set(&sets[i], fdr);
+    pthread_mutex_lock(&set_lock);
+    sets[i].done = 1;
+    pthread_cond_broadcast(&set_cond);
+    pthread_mutex_unlock(&set_lock);
+  }
+  free(fdr);
+  return NULL;
+}
+ #endif /* NO_THREADS */
+
+
+/* Report the results for one set in the same format as ever */
+static uint64_t print_set(const struct dedupe_set * const restrict set, int * const restrict err_twentytwo, int * const restrict err_ninetyfive)
+{
+  uint64_t total_files = 0;
+  const file_t *failed = set->head;
+
+  /* Every file that was tried as the source before one opened failed */
+  for (unsigned int i = 0; i < set->src_failed; i++, failed = failed->duplicates) {
+    fprintf(stderr, "dedupe: open failed (skipping): %s\n", failed->d_name);
+    exit_status = EXIT_FAILURE;
+  }
+  if (set->src == NULL) return 0;
+  printf("  [SRC] %s\n", set->src->d_name);
+
+  for (unsigned int i = 0; i < set->count; i++) {
+    const struct dedupe_dest * const dest = &set->dests[i];
+
+    switch (dest->result) {
+      case DD_LINKED:
+        printf("  -==-> %s\n", dest->file->d_name);
+        break;
+      case DD_OPEN_FAILED:
+        fprintf(stderr, "dedupe: open failed (skipping): %s\n", dest->file->d_name);
+        exit_status = EXIT_FAILURE;
+        break;
+      case DD_OK:
+        /* Dedupe OK; report to the user and add to file count */
+        printf("  ====> %s\n", dest->file->d_name);
+        total_files++;
+        break;
+      case DD_FAILED:
+        printf("  -XX-> %s\n", dest->file->d_name);
         fprintf(stderr, "error: ");
-        if (err == FILE_DEDUPE_RANGE_DIFFERS) {
+        if (dest->status == FILE_DEDUPE_RANGE_DIFFERS) {
           fprintf(stderr, "not identical (files modified between scan and dedupe?)\n");
-          exit_status = EXIT_FAILURE;
-        } else if (err != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(-err), err);
-          exit_status = EXIT_FAILURE;
-        } else if (errno != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
-          exit_status = EXIT_FAILURE;
+        } else if (dest->status != 0) {
+          fprintf(stderr, "%s (%d)\n", strerror(-dest->status), dest->status);
+        } else {
+          fprintf(stderr, "%s (%d)\n", strerror(dest->err), dest->err);
         }
-        if ((err == -22 || errno == 22) && err_twentytwo == 0) {
+        exit_status = EXIT_FAILURE;
+        if ((dest->status == -22 || dest->err == 22) && *err_twentytwo == 0) {
           fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
           fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
           fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
           fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_twentytwo = 1;
-	}
-        if ((err == -95 || errno == 95) && err_ninetyfive == 0) {
+          *err_twentytwo = 1;
+        }
+        if ((dest->status == -95 || dest->err == 95) && *err_ninetyfive == 0) {
           fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
           fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
           fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
           fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_ninetyfive = 1;
-	}
-      } else {
-        /* Dedupe OK; report to the user and add to file count */
-        printf("  ====> %s\n", dupefile->d_name);
-        total_files++;
-      }
-      close((int)fdri->dest_fd);
+          *err_ninetyfive = 1;
+        }
+        break;
+      default:
+        break;
     }
-    printf("\n");
-    close(src_fd);
-    total_files++;
   }
+  printf("\n");
+  return total_files + 1;
+}
+#endif /* __linux__ */
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
+
+void dedupefiles(file_t * restrict files)
+{
+#ifdef __linux__
+  file_t *curfile;
+  int err_twentytwo = 0, err_ninetyfive = 0;
+  uint64_t total_files = 0;
+  size_t i;
+ #ifndef NO_THREADS
+  pthread_t threads[DEDUPE_THREADS];
+  unsigned int tcount = 0;
+ #else
+  struct file_dedupe_range *fdr;
+ #endif
+
+  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+
+  /* Collect all duplicate sets so they can be handled in any order */
+  set_count = 0;
+  for (curfile = files; curfile; curfile = curfile->next)
+    if (ISFLAG(curfile->flags, FF_HAS_DUPES)) set_count++;
+  if (set_count == 0) goto done;
+  sets = (struct dedupe_set *)calloc(set_count, sizeof(struct dedupe_set));
+  if (unlikely(sets == NULL)) jc_oom("dedupefiles() sets");
+  i = 0;
+  for (curfile = files; curfile; curfile = curfile->next) {
+    /* Skip all files that have no duplicates */
+    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
+    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+    sets[i++].head = curfile;
+  }
+  next_set = 0;
+
+ #ifndef NO_THREADS
+  for (tcount = 0; tcount < DEDUPE_THREADS && tcount < set_count; tcount++)
+    if (pthread_create(&threads[tcount], NULL, dedupe_worker, NULL) != 0) break;
+  /* Without any worker thread the main thread does all of the work */
+  if (tcount == 0) dedupe_worker(NULL);
+  LOUD(fprintf(stderr, "dedupefiles: %" PRIuMAX " sets, %u threads\n", (uintmax_t)set_count, tcount);)
+
+  /* Print each set as soon as it and all sets before it are done */
+  for (i = 0; i < set_count; i++) {
+    pthread_mutex_lock(&set_lock);
+    while (sets[i].done == 0) pthread_cond_wait(&set_cond, &set_lock);
+    pthread_mutex_unlock(&set_lock);
+    total_files += print_set(&sets[i], &err_twentytwo, &err_ninetyfive);
+  }
+  for (unsigned int t = 0; t < tcount; t++) pthread_join(threads[t], NULL);
+ #else
+  fdr = alloc_fdr();
+  for (i = 0; i < set_count; i++) {
+    dedupe_set(&sets[i], fdr);
+    total_files += print_set(&sets[i], &err_twentytwo, &err_ninetyfive);
+  }
   free(fdr);
+ #endif /* NO_THREADS */
+
+  for (i = 0; i < set_count; i++) free(sets[i].dests);
+  free(sets);
+  sets = NULL;
+
+done:
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
 #endif /* __linux__ */
 
 /* On macOS, clonefile() is basically a "hard link" function, so linkfiles will do the work. */
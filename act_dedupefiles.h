@@ -9,6 +9,12 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+
+/* Number of duplicate sets deduplicated at the same time */
+#ifndef DEDUPE_THREADS
+ #define DEDUPE_THREADS 8
+#endif
+
 void dedupefiles(file_t * restrict files);
 
 #ifdef __cplusplus
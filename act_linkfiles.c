@@ -10,12 +10,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 
 #include <libjodycode.h>
+#include "likely_unlikely.h"
 #include "act_linkfiles.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
+#ifdef LINK_PARALLEL
+ #include <pthread.h>
+#endif
+#ifdef LINK_ATOMIC
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
 
 /* Apple clonefile() is basically a hard link */
 #ifdef ENABLE_DEDUPE
@@ -32,13 +41,66 @@
  #endif /* __APPLE__ */
 #endif /* ENABLE_DEDUPE */
 
+/* Linking one file takes several path-based system calls that each wait
+ * for the filesystem, which adds up to hours for millions of files on a
+ * network filesystem. Independent duplicate sets are linked by a pool of
+ * threads; the files within a set are still linked one after another in
+ * the usual order. Each set's messages are collected in memory and printed
+ * by the main thread in the original set order, so the output is the same
+ * as a serial run. */
+
+/* Everything needed to link one set, private to the thread doing it */
+struct link_ctx {
+  FILE *out;
+  FILE *err;
+  int failed;
+  char tempname[PATHBUF_SIZE * 2];
+#ifndef NO_SYMLINKS
+  char rel_path[PATHBUF_SIZE];
+#endif
+#ifdef ON_WINDOWS
+  struct jc_winstat s;
+#else
+  struct stat s;
+#endif
+#ifdef LINK_ATOMIC
+  /* Directories of the last source and target, kept open between files */
+  struct link_dir {
+    int fd;
+    char path[PATHBUF_SIZE];
+  } srcdir, dstdir;
+#endif
+};
+
+#ifdef LINK_PARALLEL
+struct link_set {
+  file_t *head;
+  char *out_text;
+  char *err_text;
+  size_t out_len;
+  size_t err_len;
+  int failed;
+  int done;
+};
+
+static pthread_mutex_t set_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t set_cond = PTHREAD_COND_INITIALIZER;
+ #ifndef NO_SYMLINKS
+/* jc_make_relative_link_name() works in static buffers */
+static pthread_mutex_t relpath_lock = PTHREAD_MUTEX_INITIALIZER;
+ #endif
+static struct link_set *sets;
+static size_t set_count, next_set, printed;
+static int link_type;
+#endif /* LINK_PARALLEL */
+
 
 #ifdef ENABLE_CLONEFILE_LINK
-static void clonefile_error(const char * const restrict func, const char * const restrict name)
+static void clonefile_error(struct link_ctx * const restrict ctx, const char * const restrict func, const char * const restrict name)
 {
-  fprintf(stderr, "warning: %s failed for destination file, reverting:\n-##-> ", func);
-  jc_fwprint(stderr,name, 1);
-  exit_status = EXIT_FAILURE;
+  fprintf(ctx->err, "warning: %s failed for destination file, reverting:\n-##-> ", func);
+  jc_fwprint(ctx->err, name, 1);
+  ctx->failed = 1;
   return;
 }
 #endif /* ENABLE_CLONEFILE_LINK */
@@ -54,345 +116,588 @@ static void linkfiles_nosupport(const char * const restrict call, const char * c
 #endif /* anything unsupported */
 
 
-static void revert_failed(const char * const restrict orig, const char * const restrict current)
+static void revert_failed(struct link_ctx * const restrict ctx, const char * const restrict orig, const char * const restrict current)
 {
-  fprintf(stderr, "\nwarning: couldn't revert the file to its original name\n");
-  fprintf(stderr, "original: "); jc_fwprint(stderr, orig, 1);
-  fprintf(stderr, "current:  "); jc_fwprint(stderr, current, 1);
-  exit_status = EXIT_FAILURE;
+  fprintf(ctx->err, "\nwarning: couldn't revert the file to its original name\n");
+  fprintf(ctx->err, "original: "); jc_fwprint(ctx->err, orig, 1);
+  fprintf(ctx->err, "current:  "); jc_fwprint(ctx->err, current, 1);
+  ctx->failed = 1;
   return;
 }
 
 
-/* linktype: 0=symlink, 1=hardlink, 2=clonefile() */
-void linkfiles(file_t *files, const int linktype, const int only_current)
+/* Report a new link */
+static void link_succeeded(struct link_ctx * const restrict ctx, file_t * const restrict dupefile, const int linktype)
 {
-  static file_t *tmpfile;
-  static file_t *srcfile;
-  static file_t *curfile;
-  static file_t ** restrict dupelist;
-  static unsigned int counter = 0;
-  static unsigned int max = 0;
-  static unsigned int x = 0;
-  static size_t name_len = 0;
-  static int i, success;
-#ifndef NO_SYMLINKS
-  static unsigned int symsrc;
-  static char rel_path[PATHBUF_SIZE];
-#endif
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    switch (linktype) {
+      case 0: /* symlink */
+        fprintf(ctx->out, "-@@-> ");
+        break;
+      default:
+      case 1: /* hardlink */
+        fprintf(ctx->out, "----> ");
+        break;
 #ifdef ENABLE_CLONEFILE_LINK
-  static unsigned int srcfile_preserved_flags = 0;
-  static unsigned int dupfile_preserved_flags = 0;
-  static unsigned int dupfile_original_flags = 0;
-  static struct timeval dupfile_original_tval[2];
+      case 2: /* clonefile */
+        fprintf(ctx->out, "-##-> ");
+        break;
 #endif
+    }
+    jc_fwprint(ctx->out, dupefile->d_name, 1);
+  }
+#ifndef NO_HASHDB
+  /* Mark the hashdb entry for deletion; see update_hashdb() */
+  if (linktype != 2 && ISFLAG(flags, F_HASHDB)) dupefile->mtime = 0;
+#endif
+  return;
+}
 
-  LOUD(fprintf(stderr, "linkfiles(%d): %p\n", linktype, files);)
-  curfile = files;
-
-  /* Calculate a maximum */
-  while (curfile) {
-    if (ISFLAG(curfile->flags, FF_HAS_DUPES)) {
-      counter = 1;
-      tmpfile = curfile->duplicates;
-      while (tmpfile) {
-       counter++;
-       tmpfile = tmpfile->duplicates;
-      }
 
-      if (counter > max) max = counter;
-    }
-    curfile = curfile->next;
+/* Report a link that could not be made */
+static void link_failed(struct link_ctx * const restrict ctx, const file_t * const restrict srcfile, const file_t * const restrict dupefile)
+{
+  const int err = errno;
+
+  ctx->failed = 1;
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(ctx->out, "-//-> "); jc_fwprint(ctx->out, dupefile->d_name, 1);
   }
+  fprintf(ctx->err, "warning: unable to link '"); jc_fwprint(ctx->err, dupefile->d_name, 0);
+  fprintf(ctx->err, "' -> '"); jc_fwprint(ctx->err, srcfile->d_name, 0);
+  fprintf(ctx->err, "': %s\n", strerror(err));
+  errno = err;
+  return;
+}
 
-  max++;
 
-  dupelist = (file_t**) malloc(sizeof(file_t*) * max);
+#ifndef NO_SYMLINKS
+/* Build the symlink target for dupefile in ctx->rel_path; returns 0 if OK */
+static int relative_link_name(struct link_ctx * const restrict ctx, const file_t * const restrict srcfile, const file_t * const restrict dupefile)
+{
+  int i;
+
+ #ifdef LINK_PARALLEL
+  pthread_mutex_lock(&relpath_lock);
+ #endif
+  i = jc_make_relative_link_name(srcfile->d_name, dupefile->d_name, ctx->rel_path);
+ #ifdef LINK_PARALLEL
+  pthread_mutex_unlock(&relpath_lock);
+ #endif
+  LOUD(fprintf(stderr, "symlink MRLN: %s to %s = %s\n", srcfile->d_name, dupefile->d_name, ctx->rel_path));
+  if (i < 0) {
+    fprintf(ctx->err, "warning: make_relative_link_name() failed (%d)\n", i);
+    return -1;
+  } else if (i == 1) {
+    fprintf(ctx->err, "warning: files to be linked have the same canonical path; not linking\n");
+    return -1;
+  }
+  return 0;
+}
+#endif /* NO_SYMLINKS */
 
-  if (!dupelist) jc_oom("linkfiles() dupelist");
 
-  while (files) {
-    if (ISFLAG(files->flags, FF_HAS_DUPES)) {
-      counter = 1;
-      dupelist[counter] = files;
+#ifdef LINK_ATOMIC
+/* Get a descriptor for the directory holding a path, reusing the last one
+ * if it is the same directory; *base is set to the name within it */
+static int link_dir(struct link_dir * const restrict dir, const char * const restrict path, const char ** const restrict base)
+{
+  const char * const slash = strrchr(path, '/');
+  size_t len;
 
-      tmpfile = files->duplicates;
+  if (slash == NULL) {
+    *base = path;
+    return AT_FDCWD;
+  }
+  *base = slash + 1;
+  len = (slash == path) ? 1 : (size_t)(slash - path);
+  if (len >= PATHBUF_SIZE) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (dir->fd >= 0 && strncmp(dir->path, path, len) == 0 && dir->path[len] == '\0') return dir->fd;
+  if (dir->fd >= 0) close(dir->fd);
+  memcpy(dir->path, path, len);
+  dir->path[len] = '\0';
+  dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  return dir->fd;
+}
 
-      while (tmpfile) {
-       counter++;
-       dupelist[counter] = tmpfile;
-       tmpfile = tmpfile->duplicates;
-      }
 
-      /* Link every file to the first file */
+/* Link dupefile to srcfile by making the link under a temporary name and
+ * renaming it over dupefile in one step; returns nonzero on success */
+static int link_atomic(struct link_ctx * const restrict ctx, const file_t * const restrict srcfile, const file_t * const restrict dupefile, const int linktype)
+{
+  const char *srcbase, *dstbase;
+  int srcfd, dstfd, err;
+
+  dstfd = link_dir(&ctx->dstdir, dupefile->d_name, &dstbase);
+  if (dstfd == -1) return 0;
+  if (strlen(dstbase) + 16 > sizeof(ctx->tempname)) {
+    errno = ENAMETOOLONG;
+    return 0;
+  }
+  strcpy(ctx->tempname, dstbase);
+  strcat(ctx->tempname, ".__jdupes__.tmp");
+
+  errno = 0;
+  if (linktype == 1) {
+    srcfd = link_dir(&ctx->srcdir, srcfile->d_name, &srcbase);
+    if (srcfd == -1) return 0;
+    if (linkat(srcfd, srcbase, dstfd, ctx->tempname, 0) != 0) return 0;
+  } else {
+ #ifndef NO_SYMLINKS
+    if (relative_link_name(ctx, srcfile, dupefile) != 0) return 0;
+    if (symlinkat(ctx->rel_path, dstfd, ctx->tempname) != 0) return 0;
+ #else
+    return 0;
+ #endif
+  }
+
+  /* The target keeps its name until the rename replaces it */
+  if (renameat(dstfd, ctx->tempname, dstfd, dstbase) != 0) {
+    err = errno;
+    if (unlinkat(dstfd, ctx->tempname, 0) != 0) {
+      fprintf(ctx->err, "\nwarning: couldn't remove temporary link ");
+      jc_fwprint(ctx->err, ctx->tempname, 1);
+    }
+    errno = err;
+    return 0;
+  }
+  return 1;
+}
+
+
+/* file_has_changed() through the open directory of a set's source or of
+ * a link target, so that files in the same directory are checked with
+ * fstatat() instead of a full path lookup each */
+static int changed_in_dir(struct link_dir * const restrict dir, file_t * const restrict file)
+{
+  const char *base;
+  const int dirfd = link_dir(dir, file->d_name, &base);
+
+  return (dirfd == -1) ? -2 : file_has_changed_at(file, dirfd, base);
+}
+#endif /* LINK_ATOMIC */
+
+
+/* Link every file in one duplicate set to the set's source file
+ * linktype: 0=symlink, 1=hardlink, 2=clonefile() */
+static void link_set(file_t * const restrict head, const int linktype, struct link_ctx * const restrict ctx)
+{
+  file_t *srcfile, *dupefile;
+  size_t name_len;
+  int i, success;
+#ifdef LINK_ATOMIC
+  int src_changed;
+#endif
+#ifndef NO_SYMLINKS
+  file_t *symsrc = NULL;
+#endif
+#ifdef ENABLE_CLONEFILE_LINK
+  unsigned int srcfile_preserved_flags = 0;
+  unsigned int dupfile_preserved_flags = 0;
+  unsigned int dupfile_original_flags = 0;
+  struct timeval dupfile_original_tval[2];
+#endif
 
-      if (linktype != 0) {
+  /* Link every file to the first file */
+  if (linktype != 0) {
 #ifndef NO_HARDLINKS
-        x = 2;
-        srcfile = dupelist[1];
+    srcfile = head;
+    dupefile = head->duplicates;
 #else
-        linkfiles_nosupport("hard", "hard link");
+    (void)head;
+    linkfiles_nosupport("hard", "hard link");
+    return;
 #endif
-      } else {
+  } else {
 #ifndef NO_SYMLINKS
-        x = 1;
-        /* Symlinks should target a normal file if one exists */
-        srcfile = NULL;
-        for (symsrc = 1; symsrc <= counter; symsrc++) {
-          if (!ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) {
-            srcfile = dupelist[symsrc];
-            break;
-          }
-        }
-        /* If no normal file exists, abort */
-        if (srcfile == NULL) goto linkfile_loop;
+    /* Symlinks should target a normal file if one exists */
+    for (symsrc = head; symsrc != NULL; symsrc = symsrc->duplicates)
+      if (!ISFLAG(symsrc->flags, FF_IS_SYMLINK)) break;
+    /* If no normal file exists, abort */
+    if (symsrc == NULL) return;
+    srcfile = symsrc;
+    dupefile = head;
 #else
-        linkfiles_nosupport("soft", "symlink");
+    (void)head;
+    linkfiles_nosupport("soft", "symlink");
+    return;
 #endif
-      }
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-        printf("[SRC] "); jc_fwprint(stdout, srcfile->d_name, 1);
-      }
-      if (linktype == 2) {
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+    fprintf(ctx->out, "[SRC] "); jc_fwprint(ctx->out, srcfile->d_name, 1);
+  }
+  if (linktype == 2) {
 #ifdef ENABLE_CLONEFILE_LINK
-        if (STAT(srcfile->d_name, &s) != 0) {
-          fprintf(stderr, "warning: stat() on source file failed, skipping:\n[SRC] ");
-          jc_fwprint(stderr, srcfile->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          goto linkfile_loop;
-        }
+    if (STAT(srcfile->d_name, &ctx->s) != 0) {
+      fprintf(ctx->err, "warning: stat() on source file failed, skipping:\n[SRC] ");
+      jc_fwprint(ctx->err, srcfile->d_name, 1);
+      ctx->failed = 1;
+      return;
+    }
 
-        /* macOS unexpectedly copies the compressed flag when copying metadata
-         * (which can result in files being unreadable), so we want to retain
-         * the compression flag of srcfile */
-        srcfile_preserved_flags = s.st_flags & UF_COMPRESSED;
+    /* macOS unexpectedly copies the compressed flag when copying metadata
+     * (which can result in files being unreadable), so we want to retain
+     * the compression flag of srcfile */
+    srcfile_preserved_flags = ctx->s.st_flags & UF_COMPRESSED;
 #else
-        linkfiles_nosupport("clone", "clonefile");
+    linkfiles_nosupport("clone", "clonefile");
 #endif
-      }
-      for (; x <= counter; x++) {
-        if (linktype == 1 || linktype == 2) {
-          /* Can't hard link files on different devices */
-          if (srcfile->device != dupelist[x]->device) {
-            fprintf(stderr, "warning: hard link target on different device, not linking:\n-//-> ");
-            jc_fwprint(stderr, dupelist[x]->d_name, 1);
-            exit_status = EXIT_FAILURE;
-            continue;
-          } else {
-            /* The devices for the files are the same, but we still need to skip
-             * anything that is already hard linked (-L and -H both set) */
-            if (srcfile->inode == dupelist[x]->inode) {
-              /* Don't show == arrows when not matching against other hard links */
-              if (ISFLAG(flags, F_CONSIDERHARDLINKS))
-                if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-                  printf("-==-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-                }
-              continue;
+  }
+#ifdef LINK_ATOMIC
+  ctx->srcdir.fd = -1;
+  ctx->dstdir.fd = -1;
+  /* The source is checked once and not again for every link */
+  src_changed = changed_in_dir(&ctx->srcdir, srcfile);
+#endif
+  for (; dupefile != NULL; dupefile = dupefile->duplicates) {
+    if (linktype == 1 || linktype == 2) {
+      /* Can't hard link files on different devices */
+      if (srcfile->device != dupefile->device) {
+        fprintf(ctx->err, "warning: hard link target on different device, not linking:\n-//-> ");
+        jc_fwprint(ctx->err, dupefile->d_name, 1);
+        ctx->failed = 1;
+        continue;
+      } else {
+        /* The devices for the files are the same, but we still need to skip
+         * anything that is already hard linked (-L and -H both set) */
+        if (srcfile->inode == dupefile->inode) {
+          /* Don't show == arrows when not matching against other hard links */
+          if (ISFLAG(flags, F_CONSIDERHARDLINKS))
+            if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+              fprintf(ctx->out, "-==-> "); jc_fwprint(ctx->out, dupefile->d_name, 1);
             }
-          }
-        } else {
-          /* Symlink prerequisite check code can go here */
-          /* Do not attempt to symlink a file to itself or to another symlink */
+          continue;
+        }
+      }
+    } else {
+      /* Symlink prerequisite check code can go here */
+      /* Do not attempt to symlink a file to itself or to another symlink */
 #ifndef NO_SYMLINKS
-          if (ISFLAG(dupelist[x]->flags, FF_IS_SYMLINK) &&
-              ISFLAG(dupelist[symsrc]->flags, FF_IS_SYMLINK)) continue;
-          if (x == symsrc) continue;
+      if (ISFLAG(dupefile->flags, FF_IS_SYMLINK) &&
+          ISFLAG(symsrc->flags, FF_IS_SYMLINK)) continue;
+      if (dupefile == symsrc) continue;
 #endif
-        }
+    }
 
-        /* Do not attempt to hard link files for which we don't have write access */
-	if (
+    /* Do not attempt to hard link files for which we don't have write access */
+    if (
 #ifdef ON_WINDOWS
-        !S_ISRO(dupelist[x]->mode) &&
+    !S_ISRO(dupefile->mode) &&
 #endif
-        (jc_access(dupelist[x]->d_name, JC_W_OK) != 0))
-        {
-          fprintf(stderr, "warning: link target is a read-only file, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        /* Check file pairs for modification before linking */
-        /* Safe linking: don't actually delete until the link succeeds */
-        i = file_has_changed(srcfile);
-        if (i) {
-          fprintf(stderr, "warning: source file modified since scanned; changing source file:\n[SRC] ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (file_has_changed(dupelist[x])) {
-          fprintf(stderr, "warning: target file modified since scanned, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
+    (jc_access(dupefile->d_name, JC_W_OK) != 0))
+    {
+      fprintf(ctx->err, "warning: link target is a read-only file, not linking:\n-//-> ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      ctx->failed = 1;
+      continue;
+    }
+    /* Check file pairs for modification before linking */
+    /* Safe linking: don't actually delete until the link succeeds */
+#ifdef LINK_ATOMIC
+    /* A symlink may point at a file of this set that was just replaced by
+     * a link, so symlinks are checked again right before use */
+    i = src_changed;
+    if (i == 0 && ISFLAG(srcfile->flags, FF_IS_SYMLINK)) i = file_has_changed(srcfile);
+#else
+    i = file_has_changed(srcfile);
+#endif
+    if (i) {
+      fprintf(ctx->err, "warning: source file modified since scanned; changing source file:\n[SRC] ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
+      srcfile = dupefile;
+#ifdef LINK_ATOMIC
+      src_changed = changed_in_dir(&ctx->srcdir, srcfile);
+#endif
+      ctx->failed = 1;
+      continue;
+    }
+#ifdef LINK_ATOMIC
+    /* Targets are checked right before they are replaced since earlier
+     * links in a large set can take a while */
+    if (changed_in_dir(&ctx->dstdir, dupefile) != 0) {
+#else
+    if (file_has_changed(dupefile)) {
+#endif
+      fprintf(ctx->err, "warning: target file modified since scanned, not linking:\n-//-> ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      ctx->failed = 1;
+      continue;
+    }
 #ifdef ON_WINDOWS
-        /* For Windows, the hard link count maximum is 1023 (+1); work around
-         * by skipping linking or changing the link source file as needed */
-        if (STAT(srcfile->d_name, &s) != 0) {
-          fprintf(stderr, "warning: win_stat() on source file failed, changing source file:\n[SRC] ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (s.st_nlink >= 1024) {
-          fprintf(stderr, "warning: maximum source link count reached, changing source file:\n[SRC] ");
-          srcfile = dupelist[x];
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
-        if (STAT(dupelist[x]->d_name, &s) != 0) continue;
-        if (s.st_nlink >= 1024) {
-          fprintf(stderr, "warning: maximum destination link count reached, skipping:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          continue;
-        }
+    /* For Windows, the hard link count maximum is 1023 (+1); work around
+     * by skipping linking or changing the link source file as needed */
+    if (STAT(srcfile->d_name, &ctx->s) != 0) {
+      fprintf(ctx->err, "warning: win_stat() on source file failed, changing source file:\n[SRC] ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      srcfile = dupefile;
+      ctx->failed = 1;
+      continue;
+    }
+    if (ctx->s.st_nlink >= 1024) {
+      fprintf(ctx->err, "warning: maximum source link count reached, changing source file:\n[SRC] ");
+      srcfile = dupefile;
+      ctx->failed = 1;
+      continue;
+    }
+    if (STAT(dupefile->d_name, &ctx->s) != 0) continue;
+    if (ctx->s.st_nlink >= 1024) {
+      fprintf(ctx->err, "warning: maximum destination link count reached, skipping:\n-//-> ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      ctx->failed = 1;
+      continue;
+    }
 #endif
 #ifdef ENABLE_CLONEFILE_LINK
-        if (linktype == 2) {
-          if (STAT(dupelist[x]->d_name, &s) != 0) {
-            fprintf(stderr, "warning: stat() on destination file failed, skipping:\n-##-> ");
-            jc_fwprint(stderr, dupelist[x]->d_name, 1);
-            exit_status = EXIT_FAILURE;
-            continue;
-          }
-
-          /* macOS unexpectedly copies the compressed flag when copying metadata
-           * (which can result in files being unreadable), so we want to ignore
-           * the compression flag on dstfile in favor of the one from srcfile */
-          dupfile_preserved_flags = s.st_flags & ~(unsigned int)UF_COMPRESSED;
-          dupfile_original_flags = s.st_flags;
-          dupfile_original_tval[0].tv_sec = s.st_atime;
-          dupfile_original_tval[1].tv_sec = s.st_mtime;
-          dupfile_original_tval[0].tv_usec = 0;
-          dupfile_original_tval[1].tv_usec = 0;
-        }
+    if (linktype == 2) {
+      if (STAT(dupefile->d_name, &ctx->s) != 0) {
+        fprintf(ctx->err, "warning: stat() on destination file failed, skipping:\n-##-> ");
+        jc_fwprint(ctx->err, dupefile->d_name, 1);
+        ctx->failed = 1;
+        continue;
+      }
+
+      /* macOS unexpectedly copies the compressed flag when copying metadata
+       * (which can result in files being unreadable), so we want to ignore
+       * the compression flag on dstfile in favor of the one from srcfile */
+      dupfile_preserved_flags = ctx->s.st_flags & ~(unsigned int)UF_COMPRESSED;
+      dupfile_original_flags = ctx->s.st_flags;
+      dupfile_original_tval[0].tv_sec = ctx->s.st_atime;
+      dupfile_original_tval[1].tv_sec = ctx->s.st_mtime;
+      dupfile_original_tval[0].tv_usec = 0;
+      dupfile_original_tval[1].tv_usec = 0;
+    }
 #endif
 
-        /* Make sure the name will fit in the buffer before trying */
-        name_len = strlen(dupelist[x]->d_name) + 14;
-        if (name_len > PATHBUF_SIZE) continue;
-        /* Assemble a temporary file name */
-        strcpy(tempname, dupelist[x]->d_name);
-        strcat(tempname, ".__jdupes__.tmp");
-        /* Rename the destination file to the temporary name */
-        i = jc_rename(dupelist[x]->d_name, tempname);
-        if (i != 0) {
-          fprintf(stderr, "warning: cannot move link target to a temporary name, not linking:\n-//-> ");
-          jc_fwprint(stderr, dupelist[x]->d_name, 1);
-          exit_status = EXIT_FAILURE;
-          /* Just in case the rename succeeded yet still returned an error, roll back the rename */
-          jc_rename(tempname, dupelist[x]->d_name);
-          continue;
-        }
+#ifdef LINK_ATOMIC
+    /* Hard links and symlinks are made under a temporary name next to the
+     * target and renamed over it, so the target name never goes missing */
+    if (linktype != 2) {
+      if (link_atomic(ctx, srcfile, dupefile, linktype) != 0) link_succeeded(ctx, dupefile, linktype);
+      else link_failed(ctx, srcfile, dupefile);
+      continue;
+    }
+#endif
 
-        /* Create the desired hard link with the original file's name */
-        errno = 0;
-        success = 0;
-        if (linktype == 1) {
-          if (jc_link(srcfile->d_name, dupelist[x]->d_name) == 0) success = 1;
+    /* Make sure the name will fit in the buffer before trying */
+    name_len = strlen(dupefile->d_name) + 14;
+    if (name_len > PATHBUF_SIZE) continue;
+    /* Assemble a temporary file name */
+    strcpy(ctx->tempname, dupefile->d_name);
+    strcat(ctx->tempname, ".__jdupes__.tmp");
+    /* Rename the destination file to the temporary name */
+    i = jc_rename(dupefile->d_name, ctx->tempname);
+    if (i != 0) {
+      fprintf(ctx->err, "warning: cannot move link target to a temporary name, not linking:\n-//-> ");
+      jc_fwprint(ctx->err, dupefile->d_name, 1);
+      ctx->failed = 1;
+      /* Just in case the rename succeeded yet still returned an error, roll back the rename */
+      jc_rename(ctx->tempname, dupefile->d_name);
+      continue;
+    }
+
+    /* Create the desired hard link with the original file's name */
+    errno = 0;
+    success = 0;
+    if (linktype == 1) {
+      if (jc_link(srcfile->d_name, dupefile->d_name) == 0) success = 1;
 #ifdef ENABLE_CLONEFILE_LINK
-        } else if (linktype == 2) {
-          if (clonefile(srcfile->d_name, dupelist[x]->d_name, 0) == 0) {
-            if (copyfile(tempname, dupelist[x]->d_name, NULL, COPYFILE_METADATA) == 0) {
-              /* If the preserved flags match what we just copied from the original dupfile, we're done.
-               * Otherwise, we need to update the flags to avoid data loss due to differing compression flags */
-              if (dupfile_original_flags == (srcfile_preserved_flags | dupfile_preserved_flags)) {
-                success = 1;
-              } else if (chflags(dupelist[x]->d_name, srcfile_preserved_flags | dupfile_preserved_flags) == 0) {
-                /* chflags overrides the timestamps that were restored by copyfile, so we need to reapply those as well */
-                if (utimes(dupelist[x]->d_name, dupfile_original_tval) == 0) {
-                  success = 1;
-                } else clonefile_error("utimes", dupelist[x]->d_name);
-              } else clonefile_error("chflags", dupelist[x]->d_name);
-            } else clonefile_error("copyfile", dupelist[x]->d_name);
-          } else clonefile_error("clonefile", dupelist[x]->d_name);
+    } else if (linktype == 2) {
+      if (clonefile(srcfile->d_name, dupefile->d_name, 0) == 0) {
+        if (copyfile(ctx->tempname, dupefile->d_name, NULL, COPYFILE_METADATA) == 0) {
+          /* If the preserved flags match what we just copied from the original dupfile, we're done.
+           * Otherwise, we need to update the flags to avoid data loss due to differing compression flags */
+          if (dupfile_original_flags == (srcfile_preserved_flags | dupfile_preserved_flags)) {
+            success = 1;
+          } else if (chflags(dupefile->d_name, srcfile_preserved_flags | dupfile_preserved_flags) == 0) {
+            /* chflags overrides the timestamps that were restored by copyfile, so we need to reapply those as well */
+            if (utimes(dupefile->d_name, dupfile_original_tval) == 0) {
+              success = 1;
+            } else clonefile_error(ctx, "utimes", dupefile->d_name);
+          } else clonefile_error(ctx, "chflags", dupefile->d_name);
+        } else clonefile_error(ctx, "copyfile", dupefile->d_name);
+      } else clonefile_error(ctx, "clonefile", dupefile->d_name);
 #endif /* ENABLE_CLONEFILE_LINK */
-        }
+    }
 #ifndef NO_SYMLINKS
-        else {
-          i = jc_make_relative_link_name(srcfile->d_name, dupelist[x]->d_name, rel_path);
-          LOUD(fprintf(stderr, "symlink MRLN: %s to %s = %s\n", srcfile->d_name, dupelist[x]->d_name, rel_path));
-          if (i < 0) {
-            fprintf(stderr, "warning: make_relative_link_name() failed (%d)\n", i);
-          } else if (i == 1) {
-            fprintf(stderr, "warning: files to be linked have the same canonical path; not linking\n");
-          } else if (symlink(rel_path, dupelist[x]->d_name) == 0) success = 1;
-        }
+    else if (relative_link_name(ctx, srcfile, dupefile) == 0) {
+      if (symlink(ctx->rel_path, dupefile->d_name) == 0) success = 1;
+    }
 #endif /* NO_SYMLINKS */
-        if (success) {
-          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            switch (linktype) {
-              case 0: /* symlink */
-                printf("-@@-> ");
-                break;
-              default:
-              case 1: /* hardlink */
-                printf("----> ");
-                break;
-#ifdef ENABLE_CLONEFILE_LINK
-              case 2: /* clonefile */
-                printf("-##-> ");
-                break;
+    if (success) link_succeeded(ctx, dupefile, linktype);
+    else {
+      /* The link failed. Warn the user and put the link target back */
+      link_failed(ctx, srcfile, dupefile);
+      i = jc_rename(ctx->tempname, dupefile->d_name);
+      if (i != 0) revert_failed(ctx, dupefile->d_name, ctx->tempname);
+      continue;
+    }
+
+    /* Remove temporary file to clean up; if we can't, reverse the linking */
+    i = jc_remove(ctx->tempname);
+    if (i != 0) {
+      /* If the temp file can't be deleted, there may be a permissions problem
+       * so reverse the process and warn the user */
+      fprintf(ctx->err, "\nwarning: can't delete temp file, reverting: ");
+      jc_fwprint(ctx->err, ctx->tempname, 1);
+      ctx->failed = 1;
+      i = jc_remove(dupefile->d_name);
+      /* This last error really should not happen, but we can't assume it won't */
+      if (i != 0) fprintf(ctx->err, "\nwarning: couldn't remove link to restore original file\n");
+      else {
+        i = jc_rename(ctx->tempname, dupefile->d_name);
+        if (i != 0) revert_failed(ctx, dupefile->d_name, ctx->tempname);
+      }
+    }
+  }
+#ifdef LINK_ATOMIC
+  if (ctx->srcdir.fd >= 0) close(ctx->srcdir.fd);
+  if (ctx->dstdir.fd >= 0) close(ctx->dstdir.fd);
 #endif
-            }
-            jc_fwprint(stdout, dupelist[x]->d_name, 1);
-          }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(ctx->out, "\n");
+  return;
+}
+
+
 #ifndef NO_HASHDB
-          /* Delete the hashdb entry for new hard/symbolic links */
-          if (linktype != 2 && ISFLAG(flags, F_HASHDB)) {
-            dupelist[x]->mtime = 0;
-            add_hashdb_entry(NULL, 0, dupelist[x]);
-          }
+/* Delete the hashdb entries of files that became links; the hash database
+ * is not thread-safe, so this is done by the main thread */
+static void update_hashdb(file_t * restrict head)
+{
+  if (!ISFLAG(flags, F_HASHDB)) return;
+  for (; head != NULL; head = head->duplicates)
+    if (head->mtime == 0) add_hashdb_entry(NULL, 0, head);
+  return;
+}
 #endif
-        } else {
-          /* The link failed. Warn the user and put the link target back */
-          exit_status = EXIT_FAILURE;
-          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
-            printf("-//-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
-          }
-          fprintf(stderr, "warning: unable to link '"); jc_fwprint(stderr, dupelist[x]->d_name, 0);
-          fprintf(stderr, "' -> '"); jc_fwprint(stderr, srcfile->d_name, 0);
-          fprintf(stderr, "': %s\n", strerror(errno));
-          i = jc_rename(tempname, dupelist[x]->d_name);
-          if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
-          continue;
-        }
 
-        /* Remove temporary file to clean up; if we can't, reverse the linking */
-        i = jc_remove(tempname);
-        if (i != 0) {
-          /* If the temp file can't be deleted, there may be a permissions problem
-           * so reverse the process and warn the user */
-          fprintf(stderr, "\nwarning: can't delete temp file, reverting: ");
-          jc_fwprint(stderr, tempname, 1);
-          exit_status = EXIT_FAILURE;
-          i = jc_remove(dupelist[x]->d_name);
-          /* This last error really should not happen, but we can't assume it won't */
-          if (i != 0) fprintf(stderr, "\nwarning: couldn't remove link to restore original file\n");
-          else {
-            i = jc_rename(tempname, dupelist[x]->d_name);
-            if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
-          }
-        }
-      }
-      if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
-    }
-#if !defined NO_SYMLINKS || defined ENABLE_CLONEFILE_LINK
-linkfile_loop:
+
+#ifdef LINK_PARALLEL
+static void *link_worker(void *arg)
+{
+  struct link_ctx * const ctx = (struct link_ctx *)malloc(sizeof(struct link_ctx));
+  size_t i;
+
+  (void)arg;
+  if (unlikely(ctx == NULL)) jc_oom("link_worker()");
+  while (1) {
+    struct link_set *set;
+
+    /* Don't get too far ahead of the sets that were printed */
+    pthread_mutex_lock(&set_lock);
+    while (next_set < set_count && next_set >= printed + LINK_BACKLOG) pthread_cond_wait(&set_cond, &set_lock);
+    i = next_set++;
+    pthread_mutex_unlock(&set_lock);
+    if (i >= set_count) break;
+    set = &sets[i];
+
+    ctx->failed = 0;
+    ctx->out = open_memstream(&set->out_text, &set->out_len);
+    ctx->err = open_memstream(&set->err_text, &set->err_len);
+    if (unlikely(ctx->out == NULL || ctx->err == NULL)) jc_oom("link_worker() output");
+    link_set(set->head, link_type, ctx);
+    fclose(ctx->out);
+    fclose(ctx->err);
+    set->failed = ctx->failed;
+
+    pthread_mutex_lock(&set_lock);
+    set->done = 1;
+    pthread_cond_broadcast(&set_cond);
+    pthread_mutex_unlock(&set_lock);
+  }
+  free(ctx);
+  return NULL;
+}
+#endif /* LINK_PARALLEL */
+
+
+/* linktype: 0=symlink, 1=hardlink, 2=clonefile() */
+void linkfiles(file_t *files, const int linktype, const int only_current)
+{
+  struct link_ctx *ctx;
+  file_t *curfile;
+  size_t count = 0;
+#ifdef LINK_PARALLEL
+  pthread_t threads[LINK_THREADS];
+  unsigned int tcount = 0;
+  size_t i;
 #endif
+
+  LOUD(fprintf(stderr, "linkfiles(%d): %p\n", linktype, files);)
+
+  for (curfile = files; curfile != NULL; curfile = curfile->next) {
+    if (ISFLAG(curfile->flags, FF_HAS_DUPES)) count++;
     if (only_current == 1) break;
-    files = files->next;
+  }
+  if (count == 0) {
+    printf("%s", s_no_dupes);
+    return;
   }
 
-  if (counter == 0) printf("%s", s_no_dupes);
+#ifdef LINK_PARALLEL
+  /* A single set (as from the delete prompt) is linked right here */
+  if (count > 1) {
+    sets = (struct link_set *)calloc(count, sizeof(struct link_set));
+    if (unlikely(sets == NULL)) jc_oom("linkfiles() sets");
+    set_count = 0;
+    for (curfile = files; curfile != NULL; curfile = curfile->next)
+      if (ISFLAG(curfile->flags, FF_HAS_DUPES)) sets[set_count++].head = curfile;
+    next_set = 0;
+    printed = 0;
+    link_type = linktype;
+
+    for (tcount = 0; tcount < LINK_THREADS && tcount < set_count; tcount++)
+      if (pthread_create(&threads[tcount], NULL, link_worker, NULL) != 0) break;
+    /* Without any worker thread the main thread does all of the work */
+    if (tcount == 0) link_worker(NULL);
+    LOUD(fprintf(stderr, "linkfiles: %" PRIuMAX " sets, %u threads\n", (uintmax_t)set_count, tcount);)
+
+    /* Print each set as soon as it and all sets before it are done */
+    for (i = 0; i < set_count; i++) {
+      struct link_set * const set = &sets[i];
+
+      pthread_mutex_lock(&set_lock);
+      while (set->done == 0) pthread_cond_wait(&set_cond, &set_lock);
+      pthread_mutex_unlock(&set_lock);
+      fwrite(set->out_text, 1, set->out_len, stdout);
+      fwrite(set->err_text, 1, set->err_len, stderr);
+      free(set->out_text);
+      free(set->err_text);
+      if (set->failed) exit_status = EXIT_FAILURE;
+ #ifndef NO_HASHDB
+      update_hashdb(set->head);
+ #endif
+      pthread_mutex_lock(&set_lock);
+      printed = i + 1;
+      pthread_cond_broadcast(&set_cond);
+      pthread_mutex_unlock(&set_lock);
+    }
+    for (unsigned int t = 0; t < tcount; t++) pthread_join(threads[t], NULL);
+    free(sets);
+    sets = NULL;
+    return;
+  }
+#endif /* LINK_PARALLEL */
 
-  free(dupelist);
+  ctx = (struct link_ctx *)malloc(sizeof(struct link_ctx));
+  if (unlikely(ctx == NULL)) jc_oom("linkfiles()");
+  ctx->out = stdout;
+  ctx->err = stderr;
+  for (; files != NULL; files = files->next) {
+    if (ISFLAG(files->flags, FF_HAS_DUPES)) {
+      ctx->failed = 0;
+      link_set(files, linktype, ctx);
+      if (ctx->failed) exit_status = EXIT_FAILURE;
+#ifndef NO_HASHDB
+      update_hashdb(files);
+#endif
+    }
+    if (only_current == 1) break;
+  }
+  free(ctx);
   return;
 }
 #endif /* NO_HARDLINKS + NO_SYMLINKS + !ENABLE_DEDUPE */
@@ -11,6 +11,27 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+
+/* Sets are linked by a thread pool; output is buffered with open_memstream() */
+#if !defined NO_THREADS && !defined ON_WINDOWS
+ #define LINK_PARALLEL 1
+#endif
+
+/* New links replace their targets with one rename on Linux */
+#if defined __linux__ && !defined NO_ATOMIC_LINK
+ #define LINK_ATOMIC 1
+#endif
+
+/* Number of duplicate sets linked at the same time */
+#ifndef LINK_THREADS
+ #define LINK_THREADS 8
+#endif
+
+/* Most sets that may be finished but not yet printed */
+#ifndef LINK_BACKLOG
+ #define LINK_BACKLOG 4096
+#endif
+
 void linkfiles(file_t *files, const int linktype, const int only_current);
 
 #ifdef __cplusplus
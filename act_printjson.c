@@ -15,14 +15,78 @@
 #include "jdupes.h"
 #include "version.h"
 #include "act_printjson.h"
+#include "filehash.h"
+#include "similar.h"
 
 #define IS_CONT(a)  ((a & 0xc0) == 0x80)
 #define GET_CONT(a) (a & 0x3f)
 #define TO_HEX(a) (char)(((a) & 0x0f) <= 0x09 ? ((a) & 0x0f) + 0x30 : ((a) & 0x0f) + 0x57)
 
-#if defined(__GNU__) && !defined(PATH_MAX)
-#define PATH_MAX 1024
+/* Output is collected here and written in large pieces */
+static char *json_buf = NULL;
+static size_t json_len = 0;
+static int json_sets = 0;
+
+
+static void json_flush(void)
+{
+  if (json_len == 0) return;
+#ifdef UNICODE
+  json_buf[json_len] = '\0';
+  jc_fwprint(stdout, json_buf, 0);
+#else
+  fwrite(json_buf, 1, json_len, stdout);
 #endif
+  json_len = 0;
+  return;
+}
+
+
+/* Make sure that at least 'len' more bytes fit in the output buffer */
+static inline void json_room(const size_t len)
+{
+  if (unlikely(json_len + len > JSON_BUF_SIZE)) json_flush();
+  return;
+}
+
+
+static void json_puts(const char * restrict string)
+{
+  while (*string != '\0') {
+    size_t len = strlen(string);
+
+    if (len > JSON_BUF_SIZE) len = JSON_BUF_SIZE;
+    json_room(len);
+    memcpy(json_buf + json_len, string, len);
+    json_len += len;
+    string += len;
+  }
+  return;
+}
+
+
+static void json_putnum(const intmax_t num)
+{
+  json_room(24);
+  json_len += (size_t)sprintf(json_buf + json_len, "%" PRIdMAX, num);
+  return;
+}
+
+
+static void json_putunum(const uintmax_t num)
+{
+  json_room(24);
+  json_len += (size_t)sprintf(json_buf + json_len, "%" PRIuMAX, num);
+  return;
+}
+
+
+/** Reads one UTF-8 continuation byte; a truncated sequence yields zero bits
+ * and the byte that ended it (possibly the terminator) is left in place. */
+static inline uint32_t next_cont(const char * restrict * const string) {
+  if (unlikely(!IS_CONT(**string))) return 0;
+  return (uint32_t)GET_CONT(*(*string)++);
+}
 
 /** Decodes a single UTF-8 codepoint, consuming bytes. */
 static inline uint32_t decode_utf8(const char * restrict * const string) {
@@ -31,6 +95,7 @@ static inline uint32_t decode_utf8(const char * restrict * const string) {
   assert(!IS_CONT(**string));
   while (unlikely(IS_CONT(**string)))
     (*string)++;
+  if (unlikely(**string == '\0')) return 0xffffffff;
 
   /** ASCII. */
   if (likely(!(**string & 0x80)))
@@ -39,27 +104,27 @@ static inline uint32_t decode_utf8(const char * restrict * const string) {
   /** Multibyte 2, 3, 4. */
   if ((**string & 0xe0) == 0xc0) {
     ret = *(*string)++ & 0x1f;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
+    ret = (ret << 6) | next_cont(string);
     return ret;
   }
 
   if ((**string & 0xf0) == 0xe0) {
     ret = *(*string)++ & 0x0f;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
+    ret = (ret << 6) | next_cont(string);
+    ret = (ret << 6) | next_cont(string);
     return ret;
   }
 
   if ((**string & 0xf8) == 0xf0) {
     ret = *(*string)++ & 0x07;
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
-    ret = (ret << 6) | GET_CONT(*(*string)++);
+    ret = (ret << 6) | next_cont(string);
+    ret = (ret << 6) | next_cont(string);
+    ret = (ret << 6) | next_cont(string);
     return ret;
   }
 
-  /** We shouldn't be here... Because 5 and 6 bytes are impossible... */
-  assert(0);
+  /** 5 and 6 byte sequences are impossible; skip the bad byte */
+  (*string)++;
   return 0xffffffff;
 }
 
@@ -73,12 +138,17 @@ static inline void escape_uni16(uint16_t u16, char ** const json) {
   *(*json)++ = TO_HEX(u16);
 }
 
-/** Escapes a UTF-8 string to ASCII JSON format. */
-static void json_escape(const char * restrict string, char * restrict const target)
+/** Escapes a UTF-8 string to ASCII JSON format. There is no length limit:
+ * the string is escaped straight into the output buffer. */
+static void json_putesc(const char * restrict string)
 {
   uint32_t curr = 0;
-  char *escaped = target;
-  while (*string != '\0' && (escaped - target) < (PATH_MAX * 2 - 1)) {
+  char *escaped;
+
+  while (*string != '\0') {
+    /* The longest escape is a surrogate pair */
+    json_room(12);
+    escaped = json_buf + json_len;
     switch (*string) {
       case '\"':
       case '\\':
@@ -88,7 +158,7 @@ static void json_escape(const char * restrict string, char * restrict const targ
       default:
 	curr = decode_utf8(&string);
 	if (curr == 0xffffffff) break;
-	if (likely(curr < 0xffff)) {
+	if (likely(curr <= 0xffff)) {
 	  if (likely(curr < 0x20 || curr > 0x7f))
 	    escape_uni16((uint16_t)curr, &escaped);
 	  else
@@ -100,69 +170,198 @@ static void json_escape(const char * restrict string, char * restrict const targ
 	}
         break;
     }
+    json_len = (size_t)(escaped - json_buf);
   }
-  *escaped = '\0';
   return;
 }
 
-void printjson(file_t * restrict files, const int argc, char **argv)
+
+/* Writes a UTF-8 string as a quoted JSON string */
+static void json_putstr(const char * restrict string)
 {
-  file_t * restrict tmpfile;
-  int arg = 0, comma = 0, len = 0;
-  char *temp = malloc(PATH_MAX * 2);
-  char *temp2 = malloc(PATH_MAX * 2);
-  char *temp_insert = temp;
+  json_puts("\"");
+  json_putesc(string);
+  json_puts("\"");
+  return;
+}
+
+
+/* Write a hash as a string of hex digits; 128-bit hashes put the upper
+ * half first */
+static void json_puthash(const uint64_t hash, const uint64_t hash_hi, const int wide)
+{
+  json_room(36);
+  if (wide) json_len += (size_t)sprintf(json_buf + json_len, "\"%016" PRIx64 "%016" PRIx64 "\"", hash_hi, hash);
+  else json_len += (size_t)sprintf(json_buf + json_len, "\"%016" PRIx64 "\"", hash);
+  return;
+}
+
+
+/* Output what jdupes already knows about a file (--json-fields) so that
+ * other tools don't have to stat or hash it again */
+static void json_putfields(const file_t * const restrict file, const int nd)
+{
+  const char * const sep = nd ? "," : ", ";
+  const char *how = NULL;
+
+  json_puts(sep); json_puts("\"inode\":"); if (!nd) json_puts(" ");
+  json_putunum((uintmax_t)file->inode);
+  json_puts(sep); json_puts("\"device\":"); if (!nd) json_puts(" ");
+  json_putunum((uintmax_t)file->device);
+#ifndef NO_MTIME
+  json_puts(sep); json_puts("\"mtime\":"); if (!nd) json_puts(" ");
+  json_putnum((intmax_t)file->mtime);
+#endif
+#ifndef NO_HARDLINKS
+  json_puts(sep); json_puts("\"nlink\":"); if (!nd) json_puts(" ");
+  json_putunum((uintmax_t)file->nlink);
+#endif
+  if (ISFLAG(file->flags, FF_HASH_PARTIAL)) {
+    json_puts(sep); json_puts("\"partialHash\":"); if (!nd) json_puts(" ");
+    json_puthash(file->filehash_partial, 0, 0);
+  }
+  if (ISFLAG(file->flags, FF_HASH_FULL)) {
+    json_puts(sep); json_puts("\"fullHash\":"); if (!nd) json_puts(" ");
+    json_puthash(file->filehash, file->filehash_hi, HASH_ALGO_WIDE(hash_algo));
+  }
+
+  /* The file that a set was started with was not matched against anything */
+  if (ISFLAG(file->flags, FF_MATCH_BYTES)) how = "bytes";
+  else if (ISFLAG(file->flags, FF_MATCH_HASH)) how = "hash";
+  else if (ISFLAG(file->flags, FF_MATCH_PARTIAL)) how = "partial";
+  else if (ISFLAG(file->flags, FF_MATCH_LINK)) how = "hardlink";
+  else if (ISFLAG(file->flags, FF_MATCH_EXTENTS)) how = "extents";
+  if (how != NULL) {
+    json_puts(sep); json_puts("\"matchedBy\":"); if (!nd) json_puts(" ");
+    json_putstr(how);
+  }
+  return;
+}
 
-  LOUD(fprintf(stderr, "printjson: %p\n", files));
 
-  /* Output information about the jdupes command environment */
-  printf("{\n  \"jdupesVersion\": \"%s\",\n  \"jdupesVersionDate\": \"%s\",\n", VER, VERDATE);
+/* Output information about the jdupes command environment */
+void printjson_start(const int argc, char **argv)
+{
+  const int nd = ISFLAG(a_flags, FA_NDJSON);
+
+  LOUD(fprintf(stderr, "printjson_start: %d args\n", argc));
+  if (json_buf == NULL) {
+    json_buf = (char *)malloc(JSON_BUF_SIZE + 1);
+    if (unlikely(json_buf == NULL)) jc_oom("printjson_start()");
+  }
+  json_len = 0;
+  json_sets = 0;
 
-  printf("  \"commandLine\": \"");
-  while (arg < argc) {
-    len = sprintf(temp_insert, " %s", argv[arg]);
-    assert(len >= 0);
-    temp_insert += len;
-    arg++;
+  json_puts(nd ? "{\"jdupesVersion\":" : "{\n  \"jdupesVersion\": ");
+  json_putstr(VER);
+  json_puts(nd ? ",\"jdupesVersionDate\":" : ",\n  \"jdupesVersionDate\": ");
+  json_putstr(VERDATE);
+
+  /* The command line is a single string with the arguments separated by spaces */
+  json_puts(nd ? ",\"commandLine\":\"" : ",\n  \"commandLine\": \"");
+  for (int arg = 0; arg < argc; arg++) {
+    if (arg > 0) json_puts(" ");
+    json_putesc(argv[arg]);
   }
-  json_escape(temp + 1, temp2); /* Skip the starting space */
-  printf("%s\",\n", temp2);
-  printf("  \"extensionFlags\": \"");
+  json_puts(nd ? "\",\"extensionFlags\":\"" : "\",\n  \"extensionFlags\": \"");
 #ifndef NO_HELPTEXT
-  if (feature_flags[0] == NULL) printf("none\",\n");
-  else for (int c = 0; feature_flags[c] != NULL; c++)
-    printf("%s%s", feature_flags[c], feature_flags[c+1] == NULL ? "\",\n" : " ");
+  if (feature_flags[0] == NULL) json_puts("none");
+  else for (int c = 0; feature_flags[c] != NULL; c++) {
+    json_puts(feature_flags[c]);
+    if (feature_flags[c+1] != NULL) json_puts(" ");
+  }
 #else
-  printf("unavailable\",\n");
+  json_puts("unavailable");
 #endif
+  json_puts("\"");
+  if (ISFLAG(a_flags, FA_JSONFIELDS)) {
+    json_puts(nd ? ",\"hashAlgorithm\":" : ",\n  \"hashAlgorithm\": ");
+    json_putstr(hash_algo_list[hash_algo]);
+  }
+  json_puts(nd ? "}\n" : ",\n  \"matchSets\": [\n");
+  return;
+}
+
+
+/* Output one set of duplicates */
+void printjson_set(const file_t * restrict head)
+{
+  const int nd = ISFLAG(a_flags, FA_NDJSON);
 
-  printf("  \"matchSets\": [\n");
-  while (files != NULL) {
-    if (ISFLAG(files->flags, FF_HAS_DUPES)) {
-      if (comma) printf(",\n");
-      printf("    {\n      \"fileSize\": %" PRIdMAX ",\n      \"fileList\": [\n        { \"filePath\": \"", (intmax_t)files->size);
-      sprintf(temp, "%s", files->d_name);
-      json_escape(temp, temp2);
-      jc_fwprint(stdout, temp2, 0);
-      printf("\"");
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        printf(" },\n        { \"filePath\": \"");
-        sprintf(temp, "%s", tmpfile->d_name);
-        json_escape(temp, temp2);
-        jc_fwprint(stdout, temp2, 0);
-        printf("\"");
-        tmpfile = tmpfile->duplicates;
-      }
-      printf(" }\n      ]\n    }");
-      comma = 1;
+  if (nd) json_puts("{\"fileSize\":");
+  else json_puts(json_sets ? ",\n    {\n      \"fileSize\": " : "    {\n      \"fileSize\": ");
+  json_putnum((intmax_t)head->size);
+  json_puts(nd ? ",\"fileList\":[{\"filePath\":" : ",\n      \"fileList\": [\n        { \"filePath\": ");
+  json_putstr(head->d_name);
+  if (ISFLAG(a_flags, FA_JSONFIELDS)) json_putfields(head, nd);
+  for (const file_t *dupe = head->duplicates; dupe != NULL; dupe = dupe->duplicates) {
+    json_puts(nd ? "},{\"filePath\":" : " },\n        { \"filePath\": ");
+    json_putstr(dupe->d_name);
+    if (ISFLAG(a_flags, FA_JSONFIELDS)) json_putfields(dupe, nd);
+  }
+  json_puts(nd ? "}]}\n" : " }\n      ]\n    }");
+  json_sets++;
+  return;
+}
+
+
+/* Finish the output; NDJSON output is flushed after every set */
+void printjson_end(void)
+{
+  const int nd = ISFLAG(a_flags, FA_NDJSON);
+
+  if (!nd) json_puts("\n  ]");
+
+#ifndef NO_SIMILARITY
+  /* Pairs of files that share data without being duplicates (--similar) */
+  if (similar_percent != 0) {
+    if (!nd) json_puts(",\n  \"similarFiles\": [\n");
+    for (size_t i = 0; i < similar_pair_count; i++) {
+      const struct similar_pair * const pair = &similar_pairs[i];
+
+      json_puts(nd ? "{\"sharedPercent\":" : "    {\n      \"sharedPercent\": ");
+      json_putunum(pair->percent);
+      json_puts(nd ? ",\"sharedBytes\":" : ",\n      \"sharedBytes\": ");
+      json_putunum(pair->shared);
+      json_puts(nd ? ",\"fileSize\":" : ",\n      \"fileSize\": ");
+      json_putnum((intmax_t)pair->file->size);
+      json_puts(nd ? ",\"filePath\":" : ",\n      \"filePath\": ");
+      json_putstr(pair->file->d_name);
+      json_puts(nd ? ",\"similarSize\":" : ",\n      \"similarSize\": ");
+      json_putnum((intmax_t)pair->similar->size);
+      json_puts(nd ? ",\"similarPath\":" : ",\n      \"similarPath\": ");
+      json_putstr(pair->similar->d_name);
+      if (nd) json_puts("}\n");
+      else json_puts((i + 1 < similar_pair_count) ? "\n    },\n" : "\n    }\n");
     }
-    files = files->next;
+    if (!nd) json_puts("  ]");
   }
+#endif /* NO_SIMILARITY */
 
-  printf("\n  ]\n}\n");
+  if (!nd) json_puts("\n}\n");
+  json_flush();
+  free(json_buf);
+  json_buf = NULL;
+  return;
+}
+
+
+/* Hand buffered output to stdio so that readers of a stream see finished sets */
+void printjson_flush(void)
+{
+  json_flush();
+  return;
+}
+
+
+void printjson(file_t * restrict files, const int argc, char **argv)
+{
+  LOUD(fprintf(stderr, "printjson: %p\n", files));
 
-  free(temp); free(temp2);
+  printjson_start(argc, argv);
+  for (; files != NULL; files = files->next)
+    if (ISFLAG(files->flags, FF_HAS_DUPES)) printjson_set(files);
+  printjson_end();
   return;
 }
 
@@ -11,7 +11,17 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
-void printjson(file_t * restrict files, const int argc, char ** const restrict argv);
+
+/* Size of the output buffer */
+#ifndef JSON_BUF_SIZE
+ #define JSON_BUF_SIZE 1048576
+#endif
+
+void printjson_start(const int argc, char **argv);
+void printjson_set(const file_t * restrict head);
+void printjson_end(void);
+void printjson_flush(void);
+void printjson(file_t * restrict files, const int argc, char **argv);
 
 #ifdef __cplusplus
 }
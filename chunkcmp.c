@@ -0,0 +1,99 @@
+/* jdupes data block equality check
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "chunkcmp.h"
+
+/* Match confirmation only needs to know whether two chunks are identical,
+ * not how they sort, so wide vector compares can OR differences together
+ * and test once per several vectors. chunkcmp_init() picks the best version
+ * for the running CPU. */
+
+#if !defined NO_SIMD && defined __x86_64__ && (defined __GNUC__ || defined __clang__)
+ #define USE_X86_DISPATCH 1
+ #include <immintrin.h>
+#endif
+
+static int chunk_equal_generic(const void * const restrict p1, const void * const restrict p2, const size_t len)
+{
+  return memcmp(p1, p2, len) == 0;
+}
+
+int (*chunk_equal)(const void * const restrict p1, const void * const restrict p2, const size_t len) = chunk_equal_generic;
+const char *chunk_equal_name = "memcmp";
+
+
+#ifdef USE_X86_DISPATCH
+__attribute__((target("avx2")))
+static int chunk_equal_avx2(const void * const restrict p1, const void * const restrict p2, const size_t len)
+{
+  const char *c1 = (const char *)p1;
+  const char *c2 = (const char *)p2;
+  size_t remain = len;
+
+  while (remain >= 128) {
+    __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)c1),
+                                  _mm256_loadu_si256((const __m256i *)(const void *)c2));
+    __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)(c1 + 32)),
+                                  _mm256_loadu_si256((const __m256i *)(const void *)(c2 + 32)));
+    __m256i d2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)(c1 + 64)),
+                                  _mm256_loadu_si256((const __m256i *)(const void *)(c2 + 64)));
+    __m256i d3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)(c1 + 96)),
+                                  _mm256_loadu_si256((const __m256i *)(const void *)(c2 + 96)));
+    d0 = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+    if (!_mm256_testz_si256(d0, d0)) return 0;
+    c1 += 128; c2 += 128; remain -= 128;
+  }
+  while (remain >= 32) {
+    const __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(const void *)c1),
+                                        _mm256_loadu_si256((const __m256i *)(const void *)c2));
+    if (!_mm256_testz_si256(d0, d0)) return 0;
+    c1 += 32; c2 += 32; remain -= 32;
+  }
+  return memcmp(c1, c2, remain) == 0;
+}
+
+
+__attribute__((target("avx512f")))
+static int chunk_equal_avx512(const void * const restrict p1, const void * const restrict p2, const size_t len)
+{
+  const char *c1 = (const char *)p1;
+  const char *c2 = (const char *)p2;
+  size_t remain = len;
+
+  while (remain >= 256) {
+    __mmask8 ne;
+    ne  = _mm512_cmpneq_epi64_mask(_mm512_loadu_si512((const void *)c1), _mm512_loadu_si512((const void *)c2));
+    ne |= _mm512_cmpneq_epi64_mask(_mm512_loadu_si512((const void *)(c1 + 64)), _mm512_loadu_si512((const void *)(c2 + 64)));
+    ne |= _mm512_cmpneq_epi64_mask(_mm512_loadu_si512((const void *)(c1 + 128)), _mm512_loadu_si512((const void *)(c2 + 128)));
+    ne |= _mm512_cmpneq_epi64_mask(_mm512_loadu_si512((const void *)(c1 + 192)), _mm512_loadu_si512((const void *)(c2 + 192)));
+    if (ne != 0) return 0;
+    c1 += 256; c2 += 256; remain -= 256;
+  }
+  while (remain >= 64) {
+    if (_mm512_cmpneq_epi64_mask(_mm512_loadu_si512((const void *)c1), _mm512_loadu_si512((const void *)c2)) != 0) return 0;
+    c1 += 64; c2 += 64; remain -= 64;
+  }
+  return memcmp(c1, c2, remain) == 0;
+}
+#endif /* USE_X86_DISPATCH */
+
+
+/* Point chunk_equal at the fastest code for this CPU. This must be called
+ * before any threads compare data; until it is called memcmp() is used */
+void chunkcmp_init(void)
+{
+#ifdef USE_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    chunk_equal = chunk_equal_avx512;
+    chunk_equal_name = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    chunk_equal = chunk_equal_avx2;
+    chunk_equal_name = "avx2";
+  }
+#endif /* USE_X86_DISPATCH */
+  return;
+}
@@ -0,0 +1,23 @@
+/* jdupes data block equality check
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_CHUNKCMP_H
+#define JDUPES_CHUNKCMP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/* Returns nonzero if two blocks of data are identical */
+extern int (*chunk_equal)(const void * const restrict p1, const void * const restrict p2, const size_t len);
+extern const char *chunk_equal_name;
+
+void chunkcmp_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_CHUNKCMP_H */
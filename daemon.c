@@ -0,0 +1,964 @@
+/* jdupes duplicate tracking daemon
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "daemon.h"
+
+#ifdef HAVE_DAEMON
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "checks.h"
+#include "extents.h"
+#include "filehash.h"
+#include "filestat.h"
+#include "interrupt.h"
+#include "loaddir.h"
+#include "match.h"
+#include "act_printmatches.h"
+#include "act_summarize.h"
+#ifndef NO_JSON
+ #include "act_printjson.h"
+#endif
+#ifndef NO_TRAVCHECK
+ #include "travcheck.h"
+#endif
+
+/* After the initial scan, the daemon keeps every file in an index by size
+ * and follows changes to the scanned directories with inotify instead of
+ * scanning again. Only files that share their size with another file are
+ * hashed, and only when they are added or changed, so keeping the index up
+ * to date costs time in proportion to what changes. Clients connect to a
+ * Unix socket and send one command line:
+ *   sets (or an empty line)  print the current duplicate sets in the output
+ *                            format chosen on the command line
+ *   stats                    print the number of files and directories
+ * Matches are confirmed byte for byte once (unless -Q is used) and the
+ * result is kept until one of the files changes. Writes are followed as
+ * they happen, not only when the writer closes the file; since writes
+ * through mmap() are not reported at all, a kept result is also dropped if
+ * either file's stat() information changed. Commands are read without
+ * blocking alongside the inotify events, so a slow client never holds up
+ * change tracking; one that sends no full line in CLIENT_TIMEOUT seconds
+ * is dropped. */
+
+#define WATCH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define CLIENT_TIMEOUT 5
+#define CMD_MAX 64
+#define CLIENTS_MAX 16
+#define FF_MATCH_ANY (FF_MATCH_BYTES | FF_MATCH_HASH | FF_MATCH_PARTIAL | FF_MATCH_LINK | FF_MATCH_EXTENTS)
+
+struct dfile {
+  struct dfile *path_next;  /* Path hash chain */
+  struct dfile *size_next;  /* Other files of the same size */
+  file_t *file;
+  uint64_t id;              /* Lower for files added later, like loaddir() */
+  uint64_t confirmed;       /* Set head id this file was compared equal to */
+  int hashed;               /* 1 = full hash is valid, -1 = file can't be read */
+};
+
+struct dsize {
+  struct dsize *next;       /* Size hash chain */
+  struct dfile *files;
+  off_t size;
+  size_t count;
+};
+
+/* A client whose command line has not been read in full yet */
+struct dclient {
+  int fd;
+  size_t len;
+  time_t start;
+  char cmd[CMD_MAX];
+};
+
+struct dwatch {
+  char *path;
+  unsigned int order;  /* user_item_count when the directory was loaded */
+  int recurse;
+};
+
+static int inotify_fd = -1;
+static int listen_fd = -1;
+static const char *sock_path = NULL;
+
+static struct dfile **path_table = NULL;
+static size_t path_mask = 0, path_count = 0;
+static struct dsize **size_table = NULL;
+static size_t size_mask = 0, size_count = 0;
+static uint64_t next_id = UINT64_MAX;
+
+static struct dwatch *watches = NULL;
+static int watch_alloc = 0;
+static uintmax_t watch_count = 0;
+static int watch_warned = 0;
+
+/* Sizes that gained files since they were last hashed */
+static off_t *dirty = NULL;
+static size_t dirty_count = 0, dirty_alloc = 0;
+
+static struct dclient clients[CLIENTS_MAX];
+static unsigned int client_count = 0;
+
+static int (*set_cmp)(file_t *, file_t *);
+static char path[PATHBUF_SIZE * 2];
+
+
+static uint64_t path_hash(const char *p)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (; *p != '\0'; p++) hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+  return hash;
+}
+
+
+static size_t size_hash(const off_t size)
+{
+  return (size_t)(((uint64_t)size * 0x9e3779b97f4a7c15ULL) >> 16);
+}
+
+
+/* Double a hash table once it has as many items as buckets */
+static void *grow_table(void *table, size_t * const restrict mask, const size_t count, const int is_path)
+{
+  size_t newmask;
+  void **newtable;
+
+  if (table != NULL && count <= *mask) return table;
+  newmask = (table == NULL) ? 1023 : (*mask << 1) | 1;
+  newtable = (void **)calloc(newmask + 1, sizeof(void *));
+  if (unlikely(newtable == NULL)) jc_oom("daemon grow_table()");
+  if (table != NULL) {
+    for (size_t i = 0; i <= *mask; i++) {
+      if (is_path) {
+        struct dfile *cur = ((struct dfile **)table)[i], *next;
+        for (; cur != NULL; cur = next) {
+          const size_t bucket = path_hash(cur->file->d_name) & newmask;
+          next = cur->path_next;
+          cur->path_next = (struct dfile *)newtable[bucket];
+          newtable[bucket] = cur;
+        }
+      } else {
+        struct dsize *cur = ((struct dsize **)table)[i], *next;
+        for (; cur != NULL; cur = next) {
+          const size_t bucket = size_hash(cur->size) & newmask;
+          next = cur->next;
+          cur->next = (struct dsize *)newtable[bucket];
+          newtable[bucket] = cur;
+        }
+      }
+    }
+    free(table);
+  }
+  *mask = newmask;
+  return newtable;
+}
+
+
+static struct dfile *find_file(const char * const restrict name)
+{
+  struct dfile *cur;
+
+  if (path_table == NULL) return NULL;
+  for (cur = path_table[path_hash(name) & path_mask]; cur != NULL; cur = cur->path_next)
+    if (strcmp(cur->file->d_name, name) == 0) return cur;
+  return NULL;
+}
+
+
+static struct dsize *find_size(const off_t size)
+{
+  struct dsize *cur;
+
+  if (size_table == NULL) return NULL;
+  for (cur = size_table[size_hash(size) & size_mask]; cur != NULL; cur = cur->next)
+    if (cur->size == size) return cur;
+  return NULL;
+}
+
+
+static void mark_dirty(const off_t size)
+{
+  if (dirty_count == dirty_alloc) {
+    dirty_alloc = (dirty_alloc == 0) ? 256 : dirty_alloc * 2;
+    dirty = (off_t *)realloc(dirty, sizeof(off_t) * dirty_alloc);
+    if (unlikely(dirty == NULL)) jc_oom("daemon mark_dirty()");
+  }
+  dirty[dirty_count++] = size;
+  return;
+}
+
+
+static void free_file(file_t * const restrict file)
+{
+#ifdef HAVE_EXTENTS
+  extents_free(file);
+#endif
+  free(file->d_name);
+  free(file);
+  return;
+}
+
+
+static void remove_file(struct dfile * const restrict dfile)
+{
+  struct dfile **link;
+  struct dsize **slink, *dsize;
+
+  LOUD(fprintf(stderr, "daemon: removing '%s'\n", dfile->file->d_name);)
+  for (link = &path_table[path_hash(dfile->file->d_name) & path_mask]; *link != dfile; link = &(*link)->path_next);
+  *link = dfile->path_next;
+  path_count--;
+
+  for (slink = &size_table[size_hash(dfile->file->size) & size_mask]; (*slink)->size != dfile->file->size; slink = &(*slink)->next);
+  dsize = *slink;
+  for (link = &dsize->files; *link != dfile; link = &(*link)->size_next);
+  *link = dfile->size_next;
+  dsize->count--;
+  if (dsize->count == 0) {
+    *slink = dsize->next;
+    size_count--;
+    free(dsize);
+  }
+
+  free_file(dfile->file);
+  free(dfile);
+  return;
+}
+
+
+/* Add a loaded file to the index, replacing any file with the same path */
+static void add_file(file_t * const restrict file)
+{
+  struct dfile *dfile, *old;
+  struct dsize *dsize;
+  size_t bucket;
+
+  old = find_file(file->d_name);
+  if (old != NULL) remove_file(old);
+  LOUD(fprintf(stderr, "daemon: adding '%s'\n", file->d_name);)
+
+  dfile = (struct dfile *)calloc(1, sizeof(struct dfile));
+  if (unlikely(dfile == NULL)) jc_oom("daemon add_file()");
+  dfile->file = file;
+  dfile->id = next_id--;
+  file->next = NULL;
+  file->duplicates = NULL;
+
+  path_table = (struct dfile **)grow_table(path_table, &path_mask, path_count + 1, 1);
+  bucket = path_hash(file->d_name) & path_mask;
+  dfile->path_next = path_table[bucket];
+  path_table[bucket] = dfile;
+  path_count++;
+
+  dsize = find_size(file->size);
+  if (dsize == NULL) {
+    size_table = (struct dsize **)grow_table(size_table, &size_mask, size_count + 1, 0);
+    dsize = (struct dsize *)calloc(1, sizeof(struct dsize));
+    if (unlikely(dsize == NULL)) jc_oom("daemon add_file() size");
+    dsize->size = file->size;
+    bucket = size_hash(file->size) & size_mask;
+    dsize->next = size_table[bucket];
+    size_table[bucket] = dsize;
+    size_count++;
+  }
+  dfile->size_next = dsize->files;
+  dsize->files = dfile;
+  dsize->count++;
+  if (dsize->count > 1) mark_dirty(file->size);
+  return;
+}
+
+
+/* Add a file list from loaddir(); the first file ends up first in output */
+static void add_list(file_t *files)
+{
+  file_t *reversed = NULL, *next;
+
+  for (; files != NULL; files = next) {
+    next = files->next;
+    files->next = reversed;
+    reversed = files;
+  }
+  for (; reversed != NULL; reversed = next) {
+    next = reversed->next;
+    add_file(reversed);
+  }
+  return;
+}
+
+
+static void hash_file(struct dfile * const restrict dfile)
+{
+  file_t * const file = dfile->file;
+  const uint64_t *hash;
+
+  /* The first block is hashed on its own like the main scan does and the
+   * full hash carries on from it */
+  hash = get_filehash(file, PARTIAL_HASH_SIZE, hash_algo);
+  if (hash == NULL) goto error_hash;
+  file->filehash_partial = hash[0];
+  file->filehash_hi = hash[1];
+  SETFLAG(file->flags, FF_HASH_PARTIAL);
+  if (file->size <= PARTIAL_HASH_SIZE) {
+    file->filehash = file->filehash_partial;
+  } else {
+    hash = get_filehash(file, 0, hash_algo);
+    if (hash == NULL) goto error_hash;
+    file->filehash = hash[0];
+    file->filehash_hi = hash[1];
+  }
+  SETFLAG(file->flags, FF_HASH_FULL);
+  dfile->hashed = 1;
+  return;
+
+error_hash:
+  dfile->hashed = -1;
+  return;
+}
+
+
+/* Hash the new files of every size that more than one file has */
+static void hash_dirty(void)
+{
+  for (size_t i = 0; i < dirty_count && interrupt == 0; i++) {
+    const struct dsize * const dsize = find_size(dirty[i]);
+
+    if (dsize == NULL || dsize->count < 2) continue;
+    for (struct dfile *cur = dsize->files; cur != NULL; cur = cur->size_next)
+      if (cur->hashed == 0) hash_file(cur);
+  }
+  dirty_count = 0;
+  return;
+}
+
+
+/* Put a name in a directory into the path buffer like loaddir() does */
+static int make_path(const char * const restrict dir, const char * const restrict name)
+{
+  size_t dirlen = strlen(dir);
+  const size_t namelen = strlen(name);
+
+  if (dirlen + namelen + 2 >= sizeof(path)) return -1;
+  memcpy(path, dir, dirlen);
+  if (dirlen != 0 && path[dirlen - 1] != '/') path[dirlen++] = '/';
+  memcpy(path + dirlen, name, namelen + 1);
+  return 0;
+}
+
+
+/* Check a name with the same rules loaddir() uses
+ * Returns the new file, or NULL if it is gone or filtered out */
+static file_t *stat_new_file(const char * const restrict name)
+{
+  file_t *file;
+  const size_t len = strlen(name) + 1;
+
+  file = (file_t *)calloc(1, sizeof(file_t));
+  if (unlikely(file == NULL)) jc_oom("daemon stat_new_file()");
+  file->d_name = (char *)malloc(EXTEND64(len));
+  if (unlikely(file->d_name == NULL)) jc_oom("daemon stat_new_file() name");
+  memcpy(file->d_name, name, len);
+#ifndef NO_USER_ORDER
+  file->user_order = user_item_count;
+#endif
+  file->size = -1;
+
+  if (check_singlefile(file) != 0) goto reject;
+#ifndef NO_SYMLINKS
+  if (ISFLAG(file->flags, FF_IS_SYMLINK) && !ISFLAG(flags, F_FOLLOWLINKS)) goto reject;
+#endif
+  return file;
+
+reject:
+  free_file(file);
+  return NULL;
+}
+
+
+/* Load a directory with loaddir(), which also starts watching it */
+static void load_dir(char * const restrict dir, const int recurse)
+{
+  file_t *files = NULL;
+
+  LOUD(fprintf(stderr, "daemon: loading '%s' (recurse %d)\n", dir, recurse);)
+  loaddir(dir, &files, recurse);
+#ifndef NO_TRAVCHECK
+  travcheck_free(NULL);
+#endif
+  add_list(files);
+  return;
+}
+
+
+static void unwatch(const int wd)
+{
+  if (wd < 0 || wd >= watch_alloc || watches[wd].path == NULL) return;
+  free(watches[wd].path);
+  watches[wd].path = NULL;
+  watch_count--;
+  return;
+}
+
+
+/* Forget a removed directory and everything in it */
+static void remove_tree(const char * const restrict dir)
+{
+  const size_t len = strlen(dir);
+
+  LOUD(fprintf(stderr, "daemon: removing tree '%s'\n", dir);)
+  for (size_t i = 0; path_table != NULL && i <= path_mask; i++) {
+    struct dfile *cur = path_table[i], *next;
+
+    for (; cur != NULL; cur = next) {
+      next = cur->path_next;
+      if (strncmp(cur->file->d_name, dir, len) == 0 && cur->file->d_name[len] == '/') remove_file(cur);
+    }
+  }
+  /* A moved directory keeps its watches under the old path; drop them */
+  for (int wd = 0; wd < watch_alloc; wd++) {
+    const char * const wpath = watches[wd].path;
+
+    if (wpath == NULL || strncmp(wpath, dir, len) != 0 || (wpath[len] != '\0' && wpath[len] != '/')) continue;
+    inotify_rm_watch(inotify_fd, wd);
+    unwatch(wd);
+  }
+  return;
+}
+
+
+/* Start over after the kernel dropped events */
+static void rescan(const int argc, char **argv, const int first_root, const int first_recurse)
+{
+  fprintf(stderr, "daemon: inotify queue overflowed; scanning everything again\n");
+  for (size_t i = 0; path_table != NULL && i <= path_mask; i++)
+    while (path_table[i] != NULL) remove_file(path_table[i]);
+  for (int wd = 0; wd < watch_alloc; wd++) {
+    if (watches[wd].path == NULL) continue;
+    inotify_rm_watch(inotify_fd, wd);
+    unwatch(wd);
+  }
+  for (int x = first_root; x < argc && interrupt == 0; x++) {
+    user_item_count = (unsigned int)(x - first_root + 1);
+    load_dir(argv[x], x >= first_recurse);
+  }
+  return;
+}
+
+
+static void handle_event(const struct inotify_event * const restrict event)
+{
+  struct dfile *old;
+  file_t *file;
+  int recurse;
+
+  if (event->wd < 0 || event->wd >= watch_alloc || watches[event->wd].path == NULL) return;
+  if (event->mask & IN_IGNORED) {
+    unwatch(event->wd);
+    return;
+  }
+  /* Only events for names in a directory matter */
+  if (event->len == 0 || event->name[0] == '\0') return;
+  if (make_path(watches[event->wd].path, event->name) != 0) return;
+  LOUD(fprintf(stderr, "daemon: event 0x%x for '%s'\n", event->mask, path);)
+  /* New files belong to the same command line parameter as the directory */
+  user_item_count = watches[event->wd].order;
+
+  if (event->mask & IN_ISDIR) {
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) remove_tree(path);
+    else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && watches[event->wd].recurse) {
+      /* Filter the directory itself as if loaddir() had found it */
+      file = stat_new_file(path);
+      if (file == NULL) return;
+      recurse = S_ISDIR(file->mode);
+      free_file(file);
+      if (recurse) load_dir(path, 1);
+    }
+    return;
+  }
+
+  old = find_file(path);
+  if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    if (old != NULL) remove_file(old);
+    return;
+  }
+  file = stat_new_file(path);
+  if (file == NULL || S_ISDIR(file->mode)) {
+    if (file != NULL) free_file(file);
+    if (old != NULL) remove_file(old);
+    return;
+  }
+  /* Nothing to do if the file is the same as before; written data only
+   * needs a new entry if the old one was hashed (a write in progress sends
+   * many events, but the file is hashed once after the last of a batch) */
+  if (old != NULL && old->file->inode == file->inode && old->file->device == file->device
+      && old->file->size == file->size
+#ifndef NO_MTIME
+      && old->file->mtime == file->mtime
+#endif
+      && (!(event->mask & (IN_MODIFY | IN_CLOSE_WRITE)) || old->hashed == 0)) {
+    free_file(file);
+    return;
+  }
+  add_file(file);
+  return;
+}
+
+
+static void read_events(const int argc, char **argv, const int first_root, const int first_recurse)
+{
+  char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + len; ) {
+      const struct inotify_event * const event = (const struct inotify_event *)p;
+
+      if (event->mask & IN_Q_OVERFLOW) rescan(argc, argv, first_root, first_recurse);
+      else handle_event(event);
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  hash_dirty();
+  return;
+}
+
+
+static int sort_by_hash(const void *a, const void *b)
+{
+  const struct dfile * const fa = *(const struct dfile * const *)a;
+  const struct dfile * const fb = *(const struct dfile * const *)b;
+
+  if (fa->file->filehash != fb->file->filehash) return (fa->file->filehash > fb->file->filehash) ? 1 : -1;
+  if (fa->file->filehash_hi != fb->file->filehash_hi) return (fa->file->filehash_hi > fb->file->filehash_hi) ? 1 : -1;
+  return set_cmp(fa->file, fb->file);
+}
+
+
+/* Sets come out in the order of the main scan's file list */
+static int sort_sets(const void *a, const void *b)
+{
+  const uint64_t ida = (*(const struct dfile * const *)a)->id;
+  const uint64_t idb = (*(const struct dfile * const *)b)->id;
+
+  return (ida > idb) ? 1 : ((ida < idb) ? -1 : 0);
+}
+
+
+/* Link the current duplicate sets together like the main scan does
+ * Returns the first set head */
+static file_t *build_sets(void)
+{
+  struct dfile **members = NULL;
+  struct dfile **heads = NULL;
+  size_t member_alloc = 0, head_count = 0, head_alloc = 0;
+  file_t *list = NULL;
+
+  for (size_t i = 0; size_table != NULL && i <= size_mask; i++) {
+    for (struct dsize *dsize = size_table[i]; dsize != NULL; dsize = dsize->next) {
+      size_t count = 0, j, k, end, left, next;
+
+      if (dsize->count < 2) continue;
+      if (dsize->count > member_alloc) {
+        member_alloc = dsize->count;
+        members = (struct dfile **)realloc(members, sizeof(struct dfile *) * member_alloc);
+        if (unlikely(members == NULL)) jc_oom("daemon build_sets()");
+      }
+      for (struct dfile *cur = dsize->files; cur != NULL; cur = cur->size_next) {
+        if (cur->hashed == 0) hash_file(cur);
+        if (cur->hashed == 1) members[count++] = cur;
+      }
+      qsort(members, count, sizeof(struct dfile *), sort_by_hash);
+
+      for (j = 0; j < count; j = next) {
+        for (next = j + 1; next < count && members[next]->file->filehash == members[j]->file->filehash
+            && members[next]->file->filehash_hi == members[j]->file->filehash_hi; next++);
+        end = next;
+
+        /* Files turned away by one set head may still match each other */
+        while (j < end) {
+          struct dfile * const head = members[j];
+          file_t *tail = head->file;
+
+          left = j + 1;
+          CLEARFLAG(head->file->flags, FF_MATCH_ANY);
+          for (k = j + 1; k < end; k++) {
+            struct dfile * const cur = members[k];
+            file_t *scan;
+            uint32_t shortcut;
+
+            /* The same checks as the main scan; -I, -1, -p and -H apply */
+            if (check_conditions(head->file, cur->file) < 0) goto not_in_set;
+            if (!ISFLAG(flags, F_CONSIDERHARDLINKS)) {
+              for (scan = head->file->duplicates; scan != NULL; scan = scan->duplicates)
+                if (scan->inode == cur->file->inode && scan->device == cur->file->device) break;
+              if (scan != NULL) goto not_in_set;
+            }
+            shortcut = match_shortcut(head->file, cur->file);
+            if (shortcut == 0) {
+              if (cur->confirmed == head->id
+                  && (file_has_changed(cur->file) != 0 || file_has_changed(head->file) != 0)) cur->confirmed = 0;
+              if (cur->confirmed != head->id) {
+                if (confirmmatch(head->file, cur->file) != 0) goto not_in_set;
+                cur->confirmed = head->id;
+              }
+              shortcut = FF_MATCH_BYTES;
+            }
+            CLEARFLAG(cur->file->flags, FF_MATCH_ANY);
+            SETFLAG(cur->file->flags, shortcut);
+            tail->duplicates = cur->file;
+            tail = cur->file;
+            continue;
+not_in_set:
+            members[left++] = cur;
+          }
+          tail->duplicates = NULL;
+          j++;
+          end = left;
+          if (head->file->duplicates == NULL) continue;
+          SETFLAG(head->file->flags, FF_HAS_DUPES);
+          if (head_count == head_alloc) {
+            head_alloc = (head_alloc == 0) ? 256 : head_alloc * 2;
+            heads = (struct dfile **)realloc(heads, sizeof(struct dfile *) * head_alloc);
+            if (unlikely(heads == NULL)) jc_oom("daemon build_sets() heads");
+          }
+          heads[head_count++] = head;
+        }
+      }
+    }
+  }
+
+  qsort(heads, head_count, sizeof(struct dfile *), sort_sets);
+  for (size_t i = head_count; i > 0; i--) {
+    heads[i - 1]->file->next = list;
+    list = heads[i - 1]->file;
+  }
+  free(heads);
+  free(members);
+  return list;
+}
+
+
+static void free_sets(file_t *list)
+{
+  file_t *next, *dupe, *dnext;
+
+  for (; list != NULL; list = next) {
+    next = list->next;
+    list->next = NULL;
+    CLEARFLAG(list->flags, FF_HAS_DUPES);
+    for (dupe = list; dupe != NULL; dupe = dnext) {
+      dnext = dupe->duplicates;
+      dupe->duplicates = NULL;
+    }
+  }
+  return;
+}
+
+
+/* Read what a client has sent so far without waiting for more
+ * Returns 1 once the command line is complete, 0 if more is needed, or -1
+ * if the client should be dropped */
+static int read_client(struct dclient * const restrict client)
+{
+  char *nl;
+  ssize_t r;
+
+  r = read(client->fd, client->cmd + client->len, CMD_MAX - 1 - client->len);
+  if (r < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  /* A client may close its end after sending the command */
+  if (r == 0) return 1;
+  nl = memchr(client->cmd + client->len, '\n', (size_t)r);
+  client->len += (size_t)r;
+  if (nl != NULL) {
+    client->len = (size_t)(nl - client->cmd);
+    return 1;
+  }
+  return (client->len == CMD_MAX - 1) ? 1 : 0;
+}
+
+
+/* Answer one client; the usual output code writes to the socket */
+static void answer_client(struct dclient * const restrict client, const int argc, char **argv)
+{
+  char * const cmd = client->cmd;
+  size_t len = client->len;
+  struct timeval tv = { CLIENT_TIMEOUT, 0 };
+  int saved_stdout;
+
+  /* Output goes through stdio, which needs a blocking descriptor */
+  fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (len > 0 && cmd[len - 1] == '\r') len--;
+  cmd[len] = '\0';
+  LOUD(fprintf(stderr, "daemon: client command '%s'\n", cmd);)
+
+  fflush(stdout);
+  saved_stdout = dup(STDOUT_FILENO);
+  if (saved_stdout == -1 || dup2(client->fd, STDOUT_FILENO) == -1) goto error_dup;
+
+  if (*cmd == '\0' || strcmp(cmd, "sets") == 0) {
+    file_t * const list = build_sets();
+
+    if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(list);
+#ifndef NO_JSON
+    if (ISFLAG(a_flags, FA_PRINTJSON)) printjson(list, argc, argv);
+#else
+    (void)argc; (void)argv;
+#endif
+    if (ISFLAG(a_flags, FA_SUMMARIZEMATCHES)) {
+      if (ISFLAG(a_flags, FA_PRINTMATCHES)) printf("\n\n");
+      summarizematches(list);
+    }
+    free_sets(list);
+  } else if (strcmp(cmd, "stats") == 0) {
+    printf("%" PRIuMAX " files, %" PRIuMAX " sizes, %" PRIuMAX " directories watched\n",
+        (uintmax_t)path_count, (uintmax_t)size_count, watch_count);
+  } else printf("error: unknown command '%s'\n", cmd);
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  /* A client that went away leaves an error on stdout */
+  clearerr(stdout);
+error_dup:
+  if (saved_stdout != -1) close(saved_stdout);
+  return;
+}
+
+
+/* Set up inotify and the socket before the initial scan
+ * Returns 0 on success or -1 on error */
+int daemon_start(const char * const restrict sockname)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  mode_t old_umask;
+  int fd;
+
+  if (unlikely(sockname == NULL)) jc_nullptr("daemon_start()");
+  LOUD(fprintf(stderr, "daemon_start('%s')\n", sockname);)
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(sockname) >= sizeof(addr.sun_path)) goto error_name;
+  strcpy(addr.sun_path, sockname);
+
+  /* Replace a socket left behind by a daemon that is no longer running,
+   * but never anything else that happens to have the same name */
+  if (lstat(sockname, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) goto error_not_socket;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) goto error_socket;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      close(fd);
+      goto error_in_use;
+    }
+    if (errno == ECONNREFUSED) unlink(sockname);
+    close(fd);
+  }
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) goto error_inotify;
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) goto error_socket;
+  /* The socket tells anyone who can connect about every scanned file */
+  old_umask = umask(077);
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    umask(old_umask);
+    goto error_socket;
+  }
+  umask(old_umask);
+  sock_path = sockname;
+  if (listen(listen_fd, 16) != 0) goto error_socket;
+  return 0;
+
+error_name:
+  fprintf(stderr, "error: socket name is too long: %s\n", sockname);
+  return -1;
+error_not_socket:
+  fprintf(stderr, "error: '%s' exists and is not a socket\n", sockname);
+  return -1;
+error_in_use:
+  fprintf(stderr, "error: socket '%s' is in use by another process\n", sockname);
+  return -1;
+error_inotify:
+  fprintf(stderr, "error: cannot start inotify: %s\n", strerror(errno));
+  return -1;
+error_socket:
+  fprintf(stderr, "error: cannot listen on socket '%s': %s\n", sockname, strerror(errno));
+  daemon_stop();
+  return -1;
+}
+
+
+/* Called by loaddir() for each directory it reads */
+void daemon_watch_dir(const char * const restrict dir, const int recurse)
+{
+  int wd;
+
+  if (inotify_fd == -1) return;
+  wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK | IN_ONLYDIR);
+  if (wd < 0) {
+    if (errno == ENOSPC && watch_warned == 0) {
+      fprintf(stderr, "\nwarning: out of inotify watches; raise fs.inotify.max_user_watches\n");
+      watch_warned = 1;
+    } else if (errno != ENOSPC) {
+      fprintf(stderr, "\nwarning: cannot watch directory "); jc_fwprint(stderr, dir, 1);
+    }
+    return;
+  }
+  if (wd >= watch_alloc) {
+    const int old_alloc = watch_alloc;
+
+    while (wd >= watch_alloc) watch_alloc = (watch_alloc == 0) ? 1024 : watch_alloc * 2;
+    watches = (struct dwatch *)realloc(watches, sizeof(struct dwatch) * (size_t)watch_alloc);
+    if (unlikely(watches == NULL)) jc_oom("daemon_watch_dir()");
+    memset(watches + old_alloc, 0, sizeof(struct dwatch) * (size_t)(watch_alloc - old_alloc));
+  }
+  /* The same directory reached again keeps one watch */
+  if (watches[wd].path != NULL) unwatch(wd);
+  watches[wd].path = (char *)malloc(strlen(dir) + 1);
+  if (unlikely(watches[wd].path == NULL)) jc_oom("daemon_watch_dir() path");
+  strcpy(watches[wd].path, dir);
+  watches[wd].order = user_item_count;
+  watches[wd].recurse = recurse;
+  watch_count++;
+  return;
+}
+
+
+/* Stop serving a client */
+static void drop_client(const unsigned int i)
+{
+  close(clients[i].fd);
+  clients[i] = clients[--client_count];
+  return;
+}
+
+
+/* Take a new client; it is answered once its command line has arrived */
+static void accept_client(void)
+{
+  const int fd = accept(listen_fd, NULL, NULL);
+
+  if (fd == -1) return;
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+    close(fd);
+    return;
+  }
+  clients[client_count].fd = fd;
+  clients[client_count].len = 0;
+  clients[client_count].start = time(NULL);
+  client_count++;
+  return;
+}
+
+
+/* Index the scanned files and serve clients until interrupted
+ * Roots are argv[first_root] on; those from first_recurse on are recursed
+ * into. cmp orders files within sets. Returns the exit status */
+int daemon_run(file_t *files, const int argc, char **argv, const int first_root,
+		const int first_recurse, int (*cmp)(file_t *, file_t *))
+{
+  struct pollfd pfd[2 + CLIENTS_MAX];
+
+  if (unlikely(cmp == NULL)) jc_nullptr("daemon_run()");
+  set_cmp = cmp;
+  add_list(files);
+  hash_dirty();
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, catch_interrupt);
+  if (!ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "\rWatching %" PRIuMAX " directories with %" PRIuMAX " files; listening on '%s'\n",
+        watch_count, (uintmax_t)path_count, sock_path);
+  /* Rescans after an event overflow are quiet */
+  SETFLAG(flags, F_HIDEPROGRESS);
+
+  pfd[0].fd = inotify_fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = listen_fd;
+  while (interrupt == 0) {
+    const unsigned int count = client_count;
+    int timeout = -1;
+
+    /* New clients wait in the listen backlog while all slots are busy */
+    pfd[1].events = (client_count < CLIENTS_MAX) ? POLLIN : 0;
+    for (unsigned int i = 0; i < count; i++) {
+      const int left = (int)(clients[i].start + CLIENT_TIMEOUT - time(NULL));
+
+      pfd[2 + i].fd = clients[i].fd;
+      pfd[2 + i].events = POLLIN;
+      pfd[2 + i].revents = 0;
+      if (timeout == -1 || left * 1000 < timeout) timeout = (left > 0) ? left * 1000 : 0;
+    }
+    if (poll(pfd, 2 + count, timeout) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "error: poll() failed: %s\n", strerror(errno));
+      break;
+    }
+    if (pfd[0].revents & POLLIN) read_events(argc, argv, first_root, first_recurse);
+
+    /* Walk backwards so that dropping a client doesn't skip another */
+    for (unsigned int i = count; i > 0; i--) {
+      struct dclient * const client = &clients[i - 1];
+      int r = 0;
+
+      if (pfd[1 + i].revents != 0) r = read_client(client);
+      if (r == 0 && time(NULL) - client->start >= CLIENT_TIMEOUT) {
+        LOUD(fprintf(stderr, "daemon: dropping client that sent no command\n");)
+        r = -1;
+      }
+      if (r == 1) answer_client(client, argc, argv);
+      if (r != 0) drop_client(i - 1);
+    }
+    if (pfd[1].revents & POLLIN) accept_client();
+  }
+  while (client_count > 0) drop_client(0);
+
+  daemon_stop();
+  for (size_t i = 0; path_table != NULL && i <= path_mask; i++)
+    while (path_table[i] != NULL) remove_file(path_table[i]);
+  for (int wd = 0; wd < watch_alloc; wd++) free(watches[wd].path);
+  free(path_table);
+  free(size_table);
+  free(watches);
+  free(dirty);
+  return (interrupt != 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* Close the socket and stop watching */
+void daemon_stop(void)
+{
+  if (listen_fd != -1) {
+    close(listen_fd);
+    listen_fd = -1;
+    if (sock_path != NULL) unlink(sock_path);
+    sock_path = NULL;
+  }
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  return;
+}
+
+#endif /* HAVE_DAEMON */
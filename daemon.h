@@ -0,0 +1,32 @@
+/* jdupes duplicate tracking daemon
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_DAEMON_H
+#define JDUPES_DAEMON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* The daemon watches directories with inotify */
+#if defined __linux__ && !defined NO_DAEMON
+ #define HAVE_DAEMON 1
+#endif
+
+#ifdef HAVE_DAEMON
+
+int daemon_start(const char * const restrict sockname);
+void daemon_watch_dir(const char * const restrict dir, const int recurse);
+int daemon_run(file_t *files, const int argc, char **argv, const int first_root,
+		const int first_recurse, int (*cmp)(file_t *, file_t *));
+void daemon_stop(void);
+
+#endif /* HAVE_DAEMON */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_DAEMON_H */
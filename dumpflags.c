@@ -29,6 +29,10 @@ void dump_all_flags(void)
   if (ISFLAG(flags, F_NOCHANGECHECK)) fprintf(stderr, " F_NOCHANGECHECK");
   if (ISFLAG(flags, F_NOTRAVCHECK)) fprintf(stderr, " F_NOTRAVCHECK");
   if (ISFLAG(flags, F_SKIPHASH)) fprintf(stderr, " F_SKIPHASH");
+  if (ISFLAG(flags, F_HASHVERIFY)) fprintf(stderr, " F_HASHVERIFY");
+  if (ISFLAG(flags, F_STREAM)) fprintf(stderr, " F_STREAM");
+  if (ISFLAG(flags, F_TREESNAP)) fprintf(stderr, " F_TREESNAP");
+  if (ISFLAG(flags, F_DAEMON)) fprintf(stderr, " F_DAEMON");
   if (ISFLAG(flags, F_BENCHMARKSTOP)) fprintf(stderr, " F_BENCHMARKSTOP");
   if (ISFLAG(flags, F_HASHDB)) fprintf(stderr, " F_HASHDB");
 
@@ -44,6 +48,9 @@ void dump_all_flags(void)
   if (ISFLAG(a_flags, FA_SHOWSIZE)) fprintf(stderr, " FA_SHOWSIZE");
   if (ISFLAG(a_flags, FA_HARDLINKFILES)) fprintf(stderr, " FA_HARDLINKFILES");
   if (ISFLAG(a_flags, FA_DEDUPEFILES)) fprintf(stderr, " FA_DEDUPEFILES");
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) fprintf(stderr, " FA_DEDUPEBLOCKS");
+  if (ISFLAG(a_flags, FA_NDJSON)) fprintf(stderr, " FA_NDJSON");
+  if (ISFLAG(a_flags, FA_JSONFIELDS)) fprintf(stderr, " FA_JSONFIELDS");
   if (ISFLAG(a_flags, FA_MAKESYMLINKS)) fprintf(stderr, " FA_MAKESYMLINKS");
   if (ISFLAG(a_flags, FA_PRINTNULL)) fprintf(stderr, " FA_PRINTNULL");
   if (ISFLAG(a_flags, FA_PRINTJSON)) fprintf(stderr, " FA_PRINTJSON");
@@ -0,0 +1,188 @@
+/* jdupes shared data extent detection
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "extents.h"
+
+#ifdef HAVE_EXTENTS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "rawio.h"
+
+/* Files that were cloned or deduplicated on a copy-on-write filesystem
+ * (btrfs, XFS) point at the same data on disk. If two files of the same
+ * size map every logical range to the same physical range, their contents
+ * are identical without reading a single byte. Only plain, fully shared
+ * extents are trusted: compressed, encrypted, inline, or not yet allocated
+ * data can have the same reported location while holding different data.
+ * Other filesystems never share extents, so their files are not probed. */
+
+#ifndef BTRFS_SUPER_MAGIC
+ #define BTRFS_SUPER_MAGIC 0x9123683E
+#endif
+#ifndef XFS_SUPER_MAGIC
+ #define XFS_SUPER_MAGIC 0x58465342
+#endif
+#ifndef BCACHEFS_SUPER_MAGIC
+ #define BCACHEFS_SUPER_MAGIC 0xca451a4e
+#endif
+
+struct _extentmap {
+  unsigned int count;
+  struct {
+    uint64_t logical;
+    uint64_t physical;
+    uint64_t length;
+  } extent[];
+};
+
+/* Marks files whose extents are unknown or can't be trusted */
+static struct _extentmap no_extents;
+
+/* Devices already checked for a filesystem that can share extents */
+static struct {
+  dev_t device;
+  int can_share;
+} *devices = NULL;
+static unsigned int device_count = 0;
+#ifndef NO_THREADS
+/* Deduplication workers can be the first to look at a device */
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define EXTENT_BAD_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED \
+		| FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED \
+		| FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_DATA_TAIL)
+
+
+/* Can files on this file's filesystem share extents at all? The answer is
+ * kept for each device so that statfs() is only called once per device */
+static int can_share(const file_t * const restrict file)
+{
+  struct statfs sfs;
+  int result = 0;
+
+#ifndef NO_THREADS
+  pthread_mutex_lock(&device_lock);
+#endif
+  for (unsigned int i = 0; i < device_count; i++) {
+    if (devices[i].device == file->device) {
+      result = devices[i].can_share;
+      goto done;
+    }
+  }
+  if (statfs(file->d_name, &sfs) != 0) goto done;
+  switch ((unsigned long)sfs.f_type) {
+    case BTRFS_SUPER_MAGIC:
+    case XFS_SUPER_MAGIC:
+    case BCACHEFS_SUPER_MAGIC:
+      result = 1;
+      break;
+    default:
+      break;
+  }
+  LOUD(fprintf(stderr, "can_share: device %" PRIuMAX " filesystem 0x%lx %s share extents\n",
+        (uintmax_t)file->device, (unsigned long)sfs.f_type, result ? "can" : "can't");)
+  if ((device_count & 7) == 0) {
+    void * const newdevices = realloc(devices, sizeof(devices[0]) * (device_count + 8));
+    if (unlikely(newdevices == NULL)) jc_oom("can_share()");
+    devices = newdevices;
+  }
+  devices[device_count].device = file->device;
+  devices[device_count].can_share = result;
+  device_count++;
+done:
+#ifndef NO_THREADS
+  pthread_mutex_unlock(&device_lock);
+#endif
+  return result;
+}
+
+
+/* Read a file's extent map; returns &no_extents if it is not usable */
+static struct _extentmap *load_extents(const file_t * const restrict file)
+{
+  struct fiemap *req;
+  struct _extentmap *map = &no_extents;
+  int fd;
+
+  req = (struct fiemap *)calloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent) * (EXTENTS_MAX + 1));
+  if (unlikely(req == NULL)) jc_oom("load_extents()");
+  fd = rawio_open(file->d_name);
+  if (fd == -1) goto done;
+  req->fm_start = 0;
+  req->fm_length = FIEMAP_MAX_OFFSET;
+  /* Only data already on disk can share extents. Writes to a file that was
+   * modified recently may still be in the page cache while the old, shared
+   * extents are reported, so only those files are written back first */
+#ifndef NO_MTIME
+  req->fm_flags = (time(NULL) - file->mtime < EXTENTS_SETTLED_SECS) ? FIEMAP_FLAG_SYNC : 0;
+#else
+  req->fm_flags = FIEMAP_FLAG_SYNC;
+#endif
+  req->fm_extent_count = EXTENTS_MAX + 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, req) != 0) goto done;
+  if (req->fm_mapped_extents == 0 || req->fm_mapped_extents > EXTENTS_MAX) goto done;
+  if (!(req->fm_extents[req->fm_mapped_extents - 1].fe_flags & FIEMAP_EXTENT_LAST)) goto done;
+
+  /* Data that is not shared with anything can't be shared with a duplicate */
+  for (unsigned int i = 0; i < req->fm_mapped_extents; i++) {
+    const uint32_t fe_flags = req->fm_extents[i].fe_flags;
+    if ((fe_flags & EXTENT_BAD_FLAGS) != 0 || !(fe_flags & FIEMAP_EXTENT_SHARED)) goto done;
+  }
+
+  map = (struct _extentmap *)malloc(sizeof(struct _extentmap) + sizeof(map->extent[0]) * req->fm_mapped_extents);
+  if (unlikely(map == NULL)) jc_oom("load_extents() map");
+  map->count = req->fm_mapped_extents;
+  for (unsigned int i = 0; i < map->count; i++) {
+    map->extent[i].logical = req->fm_extents[i].fe_logical;
+    map->extent[i].physical = req->fm_extents[i].fe_physical;
+    map->extent[i].length = req->fm_extents[i].fe_length;
+  }
+  LOUD(fprintf(stderr, "load_extents: '%s' has %u shared extents\n", file->d_name, map->count);)
+
+done:
+  rawio_close(fd);
+  free(req);
+  return map;
+}
+
+
+/* Returns nonzero if two files are known to use the same data on disk */
+int extents_shared(file_t * const restrict file1, file_t * const restrict file2)
+{
+  if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("extents_shared()");
+  if (file1->size != file2->size || file1->size <= 0 || file1->device != file2->device) return 0;
+  if (file1->extents == NULL) file1->extents = can_share(file1) ? load_extents(file1) : &no_extents;
+  if (file1->extents == &no_extents) return 0;
+  if (file2->extents == NULL) file2->extents = load_extents(file2);
+  if (file2->extents == &no_extents || file1->extents->count != file2->extents->count) return 0;
+  return memcmp(file1->extents->extent, file2->extents->extent, sizeof(file1->extents->extent[0]) * file1->extents->count) == 0;
+}
+
+
+/* Release a file's extent map once it can't be compared to anything else;
+ * it is loaded again if the file is compared later (e.g. by dedupe) */
+void extents_free(file_t * const restrict file)
+{
+  if (file->extents != NULL && file->extents != &no_extents) free(file->extents);
+  file->extents = NULL;
+  return;
+}
+
+#endif /* HAVE_EXTENTS */
@@ -0,0 +1,38 @@
+/* jdupes shared data extent detection
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_EXTENTS_H
+#define JDUPES_EXTENTS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Extent maps come from the Linux FIEMAP ioctl */
+#if defined __linux__ && !defined NO_EXTENTS
+ #define HAVE_EXTENTS 1
+#endif
+
+/* Files with more extents than this are never treated as shared */
+#ifndef EXTENTS_MAX
+ #define EXTENTS_MAX 64
+#endif
+
+/* Files not modified for this long are assumed to be written back to disk
+ * (the Linux default dirty_expire_centisecs is 30 seconds) */
+#ifndef EXTENTS_SETTLED_SECS
+ #define EXTENTS_SETTLED_SECS 120
+#endif
+
+#ifdef HAVE_EXTENTS
+int extents_shared(file_t * const restrict file1, file_t * const restrict file2);
+void extents_free(file_t * const restrict file);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_EXTENTS_H */
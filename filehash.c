@@ -13,21 +13,389 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <errno.h>
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
 
 #include <libjodycode.h>
 
 #include "likely_unlikely.h"
+#include "chunkcmp.h"
 #include "filehash.h"
 #include "interrupt.h"
 #include "progress.h"
+#include "rawio.h"
 #include "jdupes.h"
 #include "xxhash.h"
+#include "xxh3_dispatch.h"
 
-const char *hash_algo_list[2] = {
+const char *hash_algo_list[HASH_ALGO_COUNT] = {
   "xxHash64 v2",
-  "jodyhash v7"
+  "jodyhash v7",
+  "xxHash3 64",
+  "xxHash3 128"
+};
+
+/* Select the hash algorithm by name (--hash-algo); returns nonzero if the
+ * name is unknown or the algorithm was not compiled in */
+int set_hash_algo(const char * const restrict name)
+{
+  int algo;
+
+  if (unlikely(name == NULL)) jc_nullptr("set_hash_algo()");
+  if (strcmp(name, "xxhash64") == 0 || strcmp(name, "xxhash") == 0) algo = HASH_ALGO_XXHASH2_64;
+  else if (strcmp(name, "xxh3") == 0 || strcmp(name, "xxhash3") == 0) algo = HASH_ALGO_XXHASH3_64;
+  else if (strcmp(name, "xxh3-128") == 0 || strcmp(name, "xxhash3-128") == 0) algo = HASH_ALGO_XXHASH3_128;
+  else if (strcmp(name, "jodyhash") == 0) algo = HASH_ALGO_JODYHASH64;
+  else return 1;
+  if (!HASH_ALGO_AVAILABLE(algo)) return 1;
+  hash_algo = algo;
+  hash_algo_manual = 1;
+  return 0;
+}
+
+
+/* Streaming hash state for one file */
+struct hashstate {
+  int algo;
+  uint64_t running;     /* Running hash for algorithms without a state object */
+  void *state;          /* XXH64_state_t or XXH3_state_t */
 };
 
+/* Progressive hashing state for one file (see get_filehash_tier()) */
+struct _hashtiers {
+  struct hashstate hs;
+  off_t offset;         /* Number of bytes hashed so far */
+  unsigned int done;    /* Number of completed tiers */
+  uint64_t digest_hi;   /* Upper half of the last digest for 128-bit algorithms */
+  uint64_t digest[];    /* Hash of all data up to the end of each tier */
+};
+
+
+/* Hash a block of data that is entirely in memory; hash[1] receives the
+ * upper half of 128-bit hashes and is zero for 64-bit algorithms
+ * Returns 0 on success or -1 if the hash algorithm is not available */
+int hash_block(const int algo, const void * const restrict data, const size_t len, uint64_t hash[2])
+{
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+  hash[1] = 0;
+  switch (algo) {
+#ifndef NO_XXHASH2
+    case HASH_ALGO_XXHASH2_64:
+      *hash = XXH64(data, len, 0);
+      return 0;
+#endif
+#ifndef NO_XXHASH3
+    case HASH_ALGO_XXHASH3_64:
+      *hash = xxh3_64(data, len);
+      return 0;
+    case HASH_ALGO_XXHASH3_128:
+      *hash = xxh3_128(data, len, &hash[1]);
+      return 0;
+#endif
+    case HASH_ALGO_JODYHASH64:
+      *hash = 0;
+      if (unlikely(jc_block_hash((const uint64_t *)data, hash, len) != 0)) return -1;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+
+/* Start a streaming hash; jodyhash chains from 'start' (the partial hash)
+ * while the xxHash algorithms always begin with a fresh seed 0 state.
+ * XXH3 128-bit shares its state and update function with XXH3 64-bit.
+ * Returns 0 on success or -1 if the hash algorithm is not available */
+static int hashstate_init(struct hashstate * const restrict hs, const int algo, const uint64_t start)
+{
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+  hs->algo = algo;
+  hs->running = start;
+  hs->state = NULL;
+  switch (algo) {
+#ifndef NO_XXHASH2
+    case HASH_ALGO_XXHASH2_64:
+      hs->state = XXH64_createState();
+      if (unlikely(hs->state == NULL)) jc_oom("hashstate_init() xxh64");
+      XXH64_reset((XXH64_state_t *)hs->state, 0);
+      return 0;
+#endif
+#ifndef NO_XXHASH3
+    case HASH_ALGO_XXHASH3_64:
+    case HASH_ALGO_XXHASH3_128:
+      hs->state = XXH3_createState();
+      if (unlikely(hs->state == NULL)) jc_oom("hashstate_init() xxh3");
+      XXH3_64bits_reset((XXH3_state_t *)hs->state);
+      return 0;
+#endif
+    case HASH_ALGO_JODYHASH64:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+
+/* Add data to a streaming hash; returns 0 on success or -1 on failure */
+static int hashstate_update(struct hashstate * const restrict hs, const void * const restrict data, const size_t len)
+{
+  switch (hs->algo) {
+#ifndef NO_XXHASH2
+    case HASH_ALGO_XXHASH2_64:
+      return (XXH64_update((XXH64_state_t *)hs->state, data, len) == XXH_OK) ? 0 : -1;
+#endif
+#ifndef NO_XXHASH3
+    case HASH_ALGO_XXHASH3_64:
+    case HASH_ALGO_XXHASH3_128:
+      return xxh3_update(hs->state, data, len);
+#endif
+    case HASH_ALGO_JODYHASH64:
+      return (jc_block_hash((const uint64_t *)data, &hs->running, len) == 0) ? 0 : -1;
+    default:
+      return -1;
+  }
+}
+
+
+/* Hash of all data added so far; the state can still be updated afterwards
+ * The upper half of 128-bit hashes goes to *hi (zero for other algorithms) */
+static uint64_t hashstate_digest(const struct hashstate * const restrict hs, uint64_t * const restrict hi)
+{
+  *hi = 0;
+  switch (hs->algo) {
+#ifndef NO_XXHASH2
+    case HASH_ALGO_XXHASH2_64:
+      return XXH64_digest((const XXH64_state_t *)hs->state);
+#endif
+#ifndef NO_XXHASH3
+    case HASH_ALGO_XXHASH3_64:
+      return xxh3_digest(hs->state);
+    case HASH_ALGO_XXHASH3_128:
+      return xxh3_128_digest(hs->state, hi);
+#endif
+    default:
+      return hs->running;
+  }
+}
+
+
+static void hashstate_free(struct hashstate * const restrict hs)
+{
+  if (hs->state == NULL) return;
+  switch (hs->algo) {
+#ifndef NO_XXHASH2
+    case HASH_ALGO_XXHASH2_64:
+      XXH64_freeState((XXH64_state_t *)hs->state);
+      break;
+#endif
+#ifndef NO_XXHASH3
+    case HASH_ALGO_XXHASH3_64:
+    case HASH_ALGO_XXHASH3_128:
+      XXH3_freeState((XXH3_state_t *)hs->state);
+      break;
+#endif
+    default:
+      break;
+  }
+  hs->state = NULL;
+  return;
+}
+
+
+#ifndef NO_SMALLFILE
+/* Small file contents are packed into large blocks to avoid malloc() and
+ * allocation overhead for every file; the total size of all blocks is capped
+ * and files that don't fit are handled by the normal hash-and-confirm path */
+ #ifndef SMALL_POOL_BLOCK
+  #define SMALL_POOL_BLOCK 1048576
+ #endif
+ #ifndef SMALL_POOL_MAX
+  #define SMALL_POOL_MAX 268435456
+ #endif
+static char *pool_block = NULL;
+static size_t pool_used = SMALL_POOL_BLOCK, pool_total = 0;
+static const char empty_content[8] = { 0 };
+ #ifndef NO_THREADS
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define POOL_LOCK() pthread_mutex_lock(&pool_lock)
+  #define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+ #else
+  #define POOL_LOCK()
+  #define POOL_UNLOCK()
+ #endif
+
+
+/* Allocate space for a small file's contents; returns NULL if the pool is full */
+static char *small_pool_alloc(const size_t size)
+{
+  const size_t allocsize = EXTEND64(size);
+  char *p = NULL;
+
+  POOL_LOCK();
+  if (pool_used + allocsize > SMALL_POOL_BLOCK) {
+    if (pool_total + SMALL_POOL_BLOCK > SMALL_POOL_MAX) goto pool_full;
+    pool_block = (char *)malloc(SMALL_POOL_BLOCK);
+    if (unlikely(pool_block == NULL)) jc_oom("small_pool_alloc()");
+    pool_total += SMALL_POOL_BLOCK;
+    pool_used = 0;
+  }
+  p = pool_block + pool_used;
+  pool_used += allocsize;
+pool_full:
+  POOL_UNLOCK();
+  return p;
+}
+
+
+/* Give back an allocation if nothing has been allocated after it */
+static void small_pool_release(const char * const restrict p, const size_t size)
+{
+  const size_t allocsize = EXTEND64(size);
+
+  POOL_LOCK();
+  if (p + allocsize == pool_block + pool_used) pool_used -= allocsize;
+  POOL_UNLOCK();
+  return;
+}
+
+
+/* Read a small file into pooled memory; see get_small_file() */
+static int load_small_file(file_t * const restrict checkfile, const int algo, const int verbose)
+{
+  int fd;
+  const char *content;
+  char *buf = NULL;
+  uint64_t hash[2];
+  size_t fsize;
+
+  if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_small_file()");
+  if (unlikely(checkfile->size < 0 || checkfile->size > SMALL_FILE_SIZE)) return 1;
+  LOUD(fprintf(stderr, "get_small_file('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)checkfile->size);)
+  if (checkfile->content != NULL) return 0;
+
+  /* Empty files don't need to be read at all */
+  fsize = (size_t)checkfile->size;
+  if (fsize == 0) content = empty_content;
+  else {
+    buf = small_pool_alloc(fsize);
+    if (buf == NULL) {
+      LOUD(fprintf(stderr, "get_small_file: pool is full (%" PRIuMAX " bytes)\n", (uintmax_t)pool_total);)
+      return 1;
+    }
+    errno = 0;
+    fd = rawio_open(checkfile->d_name);
+    if (fd == -1) {
+      if (verbose) { fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1); }
+      goto error_release;
+    }
+    if (unlikely(rawio_read(fd, buf, fsize, 0) != (ssize_t)fsize)) {
+      if (verbose) { fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1); }
+      rawio_close(fd);
+      goto error_release;
+    }
+    rawio_close(fd);
+    content = buf;
+  }
+
+  if (!ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
+    if (unlikely(hash_block(algo, content, fsize, hash) != 0)) {
+      if (verbose) fprintf(stderr, "\nerror: requested hash algorithm %d is not available", algo);
+      goto error_release;
+    }
+    checkfile->filehash_partial = hash[0];
+    checkfile->filehash_hi = hash[1];
+    SETFLAG(checkfile->flags, FF_HASH_PARTIAL);
+  }
+
+  checkfile->content = content;
+  return 0;
+
+error_release:
+  if (buf != NULL) small_pool_release(buf, fsize);
+  return -1;
+}
+
+
+/* Read a small file into pooled memory so it can be compared directly instead
+ * of being opened again for confirmation; the partial hash is computed from
+ * the pooled copy if it isn't already known.
+ * Returns 0 on success, 1 if the pool is exhausted (fall back to hashing),
+ * or -1 if the file can't be read */
+int get_small_file(file_t * const restrict checkfile, int algo)
+{
+  return load_small_file(checkfile, algo, 1);
+}
+#endif /* NO_SMALLFILE */
+
+
+#ifndef NO_THREADS
+/* Compute only the partial hash of a file (and load small files into memory)
+ * without reporting errors. Unlike the other hashing functions this is safe
+ * to call from several threads at once as long as each file is only handled
+ * by one thread; failures are left for the main scan to retry and report.
+ * Returns 0 on success or -1 on failure */
+int prehash_file(file_t * const restrict checkfile, int algo)
+{
+  uint64_t buf[PARTIAL_HASH_SIZE / sizeof(uint64_t)];
+  int fd;
+  size_t fsize;
+  uint64_t hash[2];
+
+  if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("prehash_file()");
+  if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) return 0;
+#ifndef NO_SMALLFILE
+  if (checkfile->size <= SMALL_FILE_SIZE) {
+    const int result = load_small_file(checkfile, algo, 0);
+    if (result != 1) return result;
+  }
+#endif
+
+  fsize = (checkfile->size < PARTIAL_HASH_SIZE) ? (size_t)checkfile->size : PARTIAL_HASH_SIZE;
+  fd = rawio_open(checkfile->d_name);
+  if (fd == -1) return -1;
+  if (fsize > 0 && rawio_read(fd, buf, fsize, 0) != (ssize_t)fsize) {
+    rawio_close(fd);
+    return -1;
+  }
+  rawio_close(fd);
+  if (hash_block(algo, buf, fsize, hash) != 0) return -1;
+  checkfile->filehash_partial = hash[0];
+  /* The partial hash covers all of a small file */
+  if (checkfile->size <= PARTIAL_HASH_SIZE) checkfile->filehash_hi = hash[1];
+  SETFLAG(checkfile->flags, FF_HASH_PARTIAL);
+  return 0;
+}
+#endif /* NO_THREADS */
+
+
+/* Number of progressive hashing tiers needed to cover a file of this size */
+unsigned int hash_tier_count(const off_t size)
+{
+  unsigned int count = 0;
+  off_t end = PARTIAL_HASH_SIZE;
+
+  while (end < size) {
+    count++;
+    if (end > (size >> HASH_TIER_SHIFT)) break;
+    end <<= HASH_TIER_SHIFT;
+  }
+  return count;
+}
+
+
+/* Offset where a tier ends; the last tier always ends at the file size */
+static off_t hash_tier_end(const off_t size, const unsigned int tier)
+{
+  off_t end = PARTIAL_HASH_SIZE;
+
+  for (unsigned int i = 0; i < tier; i++) {
+    if (end > (size >> HASH_TIER_SHIFT)) return size;
+    end <<= HASH_TIER_SHIFT;
+  }
+  return (end < size) ? end : size;
+}
+
 
 /* Hash part or all of a file
  *
@@ -39,29 +407,20 @@ const char *hash_algo_list[2] = {
  * swapping hash functions. If you want to do it for fun then that's fine. */
 uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo)
 {
-  off_t fsize;
-  /* This is an array because we return a pointer to it */
-  static uint64_t hash[1];
-  static uint64_t *chunk = NULL;
-  FILE *file = NULL;
-  int hashing = 0;
-#ifndef NO_XXHASH2
-  XXH64_state_t *xxhstate = NULL;
-#endif
-#ifdef __linux__
-  int filenum;
-#endif
+  off_t fsize, offset;
+  /* This is an array because we return a pointer to it; the second element
+   * holds the upper half of 128-bit hashes */
+  static uint64_t hash[2];
+  const void *data;
+  size_t len;
+  int fd = -1;
+  int hashing = 0, result;
+  struct hashstate hs;
 
   if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_filehash()");
   if (unlikely((algo > HASH_ALGO_COUNT - 1) || (algo < 0))) goto error_bad_hash_algo;
   LOUD(fprintf(stderr, "get_filehash('%s', %" PRIdMAX ")\n", checkfile->d_name, (intmax_t)max_read);)
 
-  /* Allocate on first use */
-  if (unlikely(chunk == NULL)) {
-    chunk = (uint64_t *)malloc(auto_chunk_size);
-    if (unlikely(!chunk)) jc_oom("get_filehash() chunk");
-  }
-
   /* Get the file size. If we can't read it, bail out early */
   if (unlikely(checkfile->size == -1)) {
     LOUD(fprintf(stderr, "get_filehash: not hashing because stat() info is bad\n"));
@@ -80,110 +439,349 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
    * the computed hash for that chunk as our starting point.
    */
 
-  *hash = 0;
+  hash[0] = 0;
+  hash[1] = 0;
+  offset = 0;
   if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
-    *hash = checkfile->filehash_partial;
+    hash[0] = checkfile->filehash_partial;
+    hash[1] = checkfile->filehash_hi;
     /* Don't bother going further if max_read is already fulfilled */
     if (max_read != 0 && max_read <= PARTIAL_HASH_SIZE) {
       LOUD(fprintf(stderr, "Partial hash size (%d) >= max_read (%" PRIuMAX "), not hashing anymore\n", PARTIAL_HASH_SIZE, (uintmax_t)max_read);)
       return hash;
     }
+    /* Start reading after the first chunk if applicable
+     * This is part of the filehash_partial skip optimization; 128-bit hashes
+     * always cover the whole file so they can't use it */
+    if (!HASH_ALGO_WIDE(algo)) offset = PARTIAL_HASH_SIZE;
   }
   errno = 0;
-  file = jc_fopen(checkfile->d_name, JC_FILE_MODE_RDONLY_SEQ);
-  if (file == NULL) {
+  fd = rawio_open(checkfile->d_name);
+  if (fd == -1) {
     fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1);
     return NULL;
   }
-  /* Actually seek past the first chunk if applicable
-   * This is part of the filehash_partial skip optimization */
-  if (ISFLAG(checkfile->flags, FF_HASH_PARTIAL)) {
-    if (fseeko(file, PARTIAL_HASH_SIZE, SEEK_SET) == -1) {
-      fclose(file);
-      fprintf(stderr, "\nerror seeking in file "); jc_fwprint(stderr, checkfile->d_name, 1);
+
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+  if (unlikely(hashstate_init(&hs, algo, *hash) != 0)) goto error_bad_hash_algo;
+
+  /* Read the file in chunks until we've read it all; the next chunks are
+   * read ahead while the current one is hashed */
+  rawio_stream_start(fd, checkfile->device, offset, fsize);
+  while ((result = rawio_stream_next(&data, &len)) > 0) {
+    if (interrupt) {
+      rawio_stream_stop();
+      hashstate_free(&hs);
+      rawio_close(fd);
       return NULL;
     }
-    fsize -= PARTIAL_HASH_SIZE;
-#ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-  } else {
-#ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-  }
+    if (unlikely(hashstate_update(&hs, data, len) != 0)) goto error_reading_file;
+    offset += (off_t)len;
 
-/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
-#ifndef NO_XXHASH2
-  if (algo == HASH_ALGO_XXHASH2_64) {
-    xxhstate = XXH64_createState();
-    if (unlikely(xxhstate == NULL)) jc_nullptr("xxhstate");
-    XXH64_reset(xxhstate, 0);
+    check_sigusr1();
+    if (jc_alarm_ring != 0) {
+      jc_alarm_ring = 0;
+      /* Only show "hashing" part if hashing one file updates progress at least twice */
+      if (hashing == 1) {
+        update_phase2_progress("hashing", (int)((offset * 100) / checkfile->size));
+      } else {
+        update_phase2_progress(NULL, -1);
+        hashing = 1;
+      }
+    }
   }
-#endif /* NO_XXHASH2 */
+  rawio_stream_stop();
+  if (unlikely(result < 0)) goto error_reading_file;
 
-  /* Read the file in chunks until we've read it all. */
-  while (fsize > 0) {
-    size_t bytes_to_read;
+  rawio_close(fd);
 
-    if (interrupt) return 0;
-    bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (unlikely(fread((void *)chunk, bytes_to_read, 1, file) != 1)) goto error_reading_file;
+  hash[0] = hashstate_digest(&hs, &hash[1]);
+  hashstate_free(&hs);
 
-  switch (algo) {
-#ifndef NO_XXHASH2
-    case HASH_ALGO_XXHASH2_64:
-      if (unlikely(XXH64_update(xxhstate, chunk, bytes_to_read) != XXH_OK)) goto error_reading_file;
-      break;
-#endif
-    case HASH_ALGO_JODYHASH64:
-      if (unlikely(jc_block_hash(chunk, hash, bytes_to_read) != 0)) goto error_reading_file;
-      break;
-    default:
+  LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
+  return hash;
+error_reading_file:
+  rawio_stream_stop();
+  fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1);
+  hashstate_free(&hs);
+  rawio_close(fd);
+  return NULL;
+error_bad_hash_algo:
+  if ((hash_algo > HASH_ALGO_COUNT) || (hash_algo < 0))
+    fprintf(stderr, "\nerror: requested hash algorithm %d is not available", hash_algo);
+  else
+    fprintf(stderr, "\nerror: requested hash algorithm %s [%d] is not available", hash_algo_list[hash_algo], hash_algo);
+  rawio_close(fd);
+  return NULL;
+}
+
+
+/* Progressively hash a file up to the end of the requested tier
+ *
+ * Tiers start after the partial hash (or at the start of the file for
+ * 128-bit algorithms, see HASH_ALGO_WIDE()) and end at offsets that grow
+ * geometrically (64 KiB, 1 MiB, 16 MiB, ...) until the end of the file.
+ * Hashing resumes where the last call stopped so no data is read twice,
+ * and the digest of the final tier is identical to the full file hash
+ * from get_filehash(), which is stored in the file once it is reached.
+ * Returns a pointer to the requested tier's digest or NULL on error. */
+uint64_t *get_filehash_tier(file_t * const restrict checkfile, const unsigned int tier, int algo)
+{
+  struct _hashtiers *tiers;
+  const char *data;
+  size_t len;
+  unsigned int count;
+  off_t tier_end;
+  int fd;
+  int hashing = 0;
+
+  if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_filehash_tier()");
+  if (unlikely((algo > HASH_ALGO_COUNT - 1) || (algo < 0))) goto error_bad_hash_algo;
+  LOUD(fprintf(stderr, "get_filehash_tier('%s', %u)\n", checkfile->d_name, tier);)
+
+  count = hash_tier_count(checkfile->size);
+  if (unlikely(tier == 0 || tier > count || !ISFLAG(checkfile->flags, FF_HASH_PARTIAL))) {
+    fprintf(stderr, "\ninternal error: invalid hash tier %u/%u requested, report this\n", tier, count);
+    exit(EXIT_FAILURE);
+  }
+
+  tiers = checkfile->tiers;
+  if (tiers == NULL) {
+    tiers = (struct _hashtiers *)calloc(1, sizeof(struct _hashtiers) + sizeof(uint64_t) * count);
+    if (unlikely(tiers == NULL)) jc_oom("get_filehash_tier() tiers");
+    tiers->offset = HASH_ALGO_WIDE(algo) ? 0 : PARTIAL_HASH_SIZE;
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+    if (unlikely(hashstate_init(&tiers->hs, algo, checkfile->filehash_partial) != 0)) {
+      free(tiers);
       goto error_bad_hash_algo;
+    }
+    checkfile->tiers = tiers;
+  }
+
+  /* Already hashed far enough? */
+  if (tier <= tiers->done) {
+    hash_tiers_take_full(checkfile);
+    return &tiers->digest[tier - 1];
+  }
+
+  errno = 0;
+  fd = rawio_open(checkfile->d_name);
+  if (fd == -1) {
+    fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, checkfile->d_name, 1);
+    return NULL;
   }
 
-    if ((off_t)bytes_to_read > fsize) break;
-    else fsize -= (off_t)bytes_to_read;
+  /* Read chunks until every tier up to the requested one is complete */
+  rawio_stream_start(fd, checkfile->device, tiers->offset, hash_tier_end(checkfile->size, tier));
+  while (tiers->done < tier) {
+    if (interrupt) goto error_interrupted;
+    if (unlikely(rawio_stream_next((const void **)&data, &len) <= 0)) goto error_reading_file;
+
+    /* Record the digest for each tier as its end is reached; a chunk can
+     * span the end of a smaller tier */
+    while (len > 0) {
+      size_t part;
+
+      tier_end = hash_tier_end(checkfile->size, tiers->done + 1);
+      part = ((tier_end - tiers->offset) >= (off_t)len) ? len : (size_t)(tier_end - tiers->offset);
+      if (unlikely(hashstate_update(&tiers->hs, data, part) != 0)) goto error_reading_file;
+      tiers->offset += (off_t)part;
+      data += part;
+      len -= part;
+      if (tiers->offset == tier_end) {
+        tiers->digest[tiers->done] = hashstate_digest(&tiers->hs, &tiers->digest_hi);
+        tiers->done++;
+        LOUD(fprintf(stderr, "get_filehash_tier: tier %u digest 0x%016jx\n", tiers->done, (uintmax_t)tiers->digest[tiers->done - 1]));
+      }
+    }
 
     check_sigusr1();
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
       /* Only show "hashing" part if hashing one file updates progress at least twice */
       if (hashing == 1) {
-        update_phase2_progress("hashing", (int)(((checkfile->size - fsize) * 100) / checkfile->size));
+        update_phase2_progress("hashing", (int)((tiers->offset * 100) / checkfile->size));
       } else {
         update_phase2_progress(NULL, -1);
         hashing = 1;
       }
     }
-    continue;
   }
 
-  fclose(file);
+  rawio_stream_stop();
+  rawio_close(fd);
 
-#ifndef NO_XXHASH2
-  if (algo == HASH_ALGO_XXHASH2_64) {
-    *hash = XXH64_digest(xxhstate);
-    XXH64_freeState(xxhstate);
+  /* The last tier is the full file hash; the running state is no longer needed */
+  if (tiers->done == count) {
+    checkfile->filehash = tiers->digest[count - 1];
+    checkfile->filehash_hi = tiers->digest_hi;
+    SETFLAG(checkfile->flags, FF_HASH_FULL);
+    hashstate_free(&tiers->hs);
   }
-#endif /* NO_XXHASH2 */
 
-  LOUD(fprintf(stderr, "get_filehash: returning hash: 0x%016jx\n", (uintmax_t)*hash));
-  return hash;
+  return &tiers->digest[tier - 1];
+
+error_interrupted:
+  rawio_stream_stop();
+  rawio_close(fd);
+  return NULL;
 error_reading_file:
+  rawio_stream_stop();
   fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, checkfile->d_name, 1);
-  fclose(file);
+  rawio_close(fd);
   return NULL;
 error_bad_hash_algo:
-  if ((hash_algo > HASH_ALGO_COUNT) || (hash_algo < 0))
-    fprintf(stderr, "\nerror: requested hash algorithm %d is not available", hash_algo);
-  else
-    fprintf(stderr, "\nerror: requested hash algorithm %s [%d] is not available", hash_algo_list[hash_algo], hash_algo);
-  fclose(file);
+  fprintf(stderr, "\nerror: requested hash algorithm %d is not available", algo);
   return NULL;
 }
+
+
+/* Hard linked files share one set of tiers, but only the file that hashed
+ * the last tier gets the full hash stored in it. Copy the full hash from
+ * completed tiers into a file that lacks it. Returns 1 if it was copied */
+int hash_tiers_take_full(file_t * const restrict file)
+{
+  const struct _hashtiers * const tiers = file->tiers;
+  unsigned int count;
+
+  if (tiers == NULL || ISFLAG(file->flags, FF_HASH_FULL)) return 0;
+  count = hash_tier_count(file->size);
+  if (tiers->done != count) return 0;
+  file->filehash = tiers->digest[count - 1];
+  file->filehash_hi = tiers->digest_hi;
+  SETFLAG(file->flags, FF_HASH_FULL);
+  return 1;
+}
+
+
+static int sort_by_tiers(const void *a, const void *b)
+{
+  const uintptr_t ta = (uintptr_t)(*(file_t * const *)a)->tiers;
+  const uintptr_t tb = (uintptr_t)(*(file_t * const *)b)->tiers;
+
+  return (ta > tb) ? 1 : ((ta < tb) ? -1 : 0);
+}
+
+
+/* Release the hashing tiers of files that will not be compared again. Hard
+ * linked files can share tiers; sorting puts the sharers together so each
+ * tiers block is freed once, after every sharer took the full hash */
+void hash_tiers_release(file_t ** const restrict group, const size_t count)
+{
+  qsort(group, count, sizeof(file_t *), sort_by_tiers);
+  for (size_t i = 0; i < count; i++) hash_tiers_take_full(group[i]);
+  for (size_t i = 0; i < count; i++) {
+    struct _hashtiers * const tiers = group[i]->tiers;
+
+    if (tiers != NULL && (i == 0 || group[i - 1]->tiers != tiers)) {
+      hashstate_free(&tiers->hs);
+      free(tiers);
+    }
+  }
+  for (size_t i = 0; i < count; i++) group[i]->tiers = NULL;
+  return;
+}
+
+
+/* Compare two files of the same size byte-for-byte while computing their
+ * full hash from the same buffers, for files that can only match each
+ * other (FF_HASH_PAIR). If the contents are equal both files get the full
+ * hash and FF_PAIR_MATCHED so that confirmmatch() is not needed; if they
+ * differ, reading stops at the first difference and *cmpresult orders the
+ * files by their contents like memcmp().
+ * Returns nonzero if a file can't be read. */
+int hash_compare_pair(file_t * const restrict file1, file_t * const restrict file2, int algo, int * const restrict cmpresult)
+{
+  char *chunk1, *chunk2;
+  struct hashstate hs;
+  int fd1, fd2 = -1;
+  const char *failname = file1->d_name;
+  size_t chunk_size;
+  off_t offset = 0;
+  const off_t hash_start = HASH_ALGO_WIDE(algo) ? 0 : PARTIAL_HASH_SIZE;
+
+  if (unlikely(file1 == NULL || file2 == NULL || file1->d_name == NULL || file2->d_name == NULL)) jc_nullptr("hash_compare_pair()");
+  if (unlikely(file1->size != file2->size || !ISFLAG(file1->flags, FF_HASH_PARTIAL))) {
+    fprintf(stderr, "\ninternal error: invalid files passed to hash_compare_pair(), report this\n");
+    exit(EXIT_FAILURE);
+  }
+  LOUD(fprintf(stderr, "hash_compare_pair('%s', '%s')\n", file1->d_name, file2->d_name);)
+
+  chunk1 = (char *)rawio_buffer(0);
+  chunk2 = (char *)rawio_buffer(1);
+
+/* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
+  if (unlikely(hashstate_init(&hs, algo, file1->filehash_partial) != 0)) {
+    fprintf(stderr, "\nerror: requested hash algorithm %d is not available", algo);
+    return 1;
+  }
+
+  errno = 0;
+  fd1 = rawio_open(file1->d_name);
+  if (fd1 == -1) goto error_open;
+  failname = file2->d_name;
+  fd2 = rawio_open(file2->d_name);
+  if (fd2 == -1) goto error_open;
+  rawio_advise(fd1, file1->device, 0, file1->size);
+  rawio_advise(fd2, file2->device, 0, file2->size);
+  chunk_size = rawio_chunk_size(file1->device);
+  if (file2->device != file1->device && rawio_chunk_size(file2->device) < chunk_size) chunk_size = rawio_chunk_size(file2->device);
+
+  /* Only the hash of one file is needed: as long as the data is the same,
+   * so are the hashes */
+  *cmpresult = 0;
+  while (offset < file1->size) {
+    size_t bytes_to_read = chunk_size;
+
+    if ((file1->size - offset) < (off_t)bytes_to_read) bytes_to_read = (size_t)(file1->size - offset);
+
+    if (interrupt) goto error_interrupted;
+    failname = file1->d_name;
+    if (unlikely(rawio_read_dev(file1->device, fd1, chunk1, bytes_to_read, offset) != (ssize_t)bytes_to_read)) goto error_reading_file;
+    failname = file2->d_name;
+    if (unlikely(rawio_read_dev(file2->device, fd2, chunk2, bytes_to_read, offset) != (ssize_t)bytes_to_read)) goto error_reading_file;
+
+    if (!chunk_equal(chunk1, chunk2, bytes_to_read)) {
+      *cmpresult = (memcmp(chunk1, chunk2, bytes_to_read) < 0) ? -1 : 1;
+      LOUD(fprintf(stderr, "hash_compare_pair: files differ near offset %" PRIdMAX "\n", (intmax_t)offset);)
+      break;
+    }
+    if (offset + (off_t)bytes_to_read > hash_start) {
+      const size_t skip = (offset < hash_start) ? (size_t)(hash_start - offset) : 0;
+      if (unlikely(hashstate_update(&hs, chunk1 + skip, bytes_to_read - skip) != 0)) goto error_reading_file;
+    }
+    offset += (off_t)bytes_to_read;
+
+    check_sigusr1();
+    if (jc_alarm_ring != 0) {
+      jc_alarm_ring = 0;
+      update_phase2_progress("confirm", (int)((offset * 100) / file1->size));
+    }
+  }
+
+  rawio_close(fd1);
+  rawio_close(fd2);
+
+  if (*cmpresult == 0) {
+    file1->filehash = hashstate_digest(&hs, &file1->filehash_hi);
+    file2->filehash = file1->filehash;
+    file2->filehash_hi = file1->filehash_hi;
+    SETFLAG(file1->flags, FF_HASH_FULL | FF_PAIR_MATCHED);
+    SETFLAG(file2->flags, FF_HASH_FULL | FF_PAIR_MATCHED);
+    LOUD(fprintf(stderr, "hash_compare_pair: files match, hash 0x%016jx\n", (uintmax_t)file1->filehash);)
+  }
+  hashstate_free(&hs);
+  return 0;
+
+error_open:
+  fprintf(stderr, "\n%s error opening file ", strerror(errno)); jc_fwprint(stderr, failname, 1);
+  goto error_close;
+error_reading_file:
+  fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, failname, 1);
+error_interrupted:
+error_close:
+  rawio_close(fd1);
+  rawio_close(fd2);
+  hashstate_free(&hs);
+  return 1;
+}
@@ -8,14 +8,53 @@
 extern "C" {
 #endif
 
-#define HASH_ALGO_COUNT 2
+#define HASH_ALGO_COUNT 4
 extern const char *hash_algo_list[HASH_ALGO_COUNT];
 #define HASH_ALGO_XXHASH2_64 0
 #define HASH_ALGO_JODYHASH64 1
+#define HASH_ALGO_XXHASH3_64 2
+#define HASH_ALGO_XXHASH3_128 3
+
+/* 128-bit algorithms hash whole files (not just the data after the partial
+ * hash block) and keep the upper half of the full hash in filehash_hi */
+#define HASH_ALGO_WIDE(a) ((a) == HASH_ALGO_XXHASH3_128)
+
+/* Nonzero if a hash algorithm was compiled in */
+#ifdef NO_XXHASH2
+ #define HASH_ALGO_HAVE_XXHASH2 0
+#else
+ #define HASH_ALGO_HAVE_XXHASH2 1
+#endif
+#ifdef NO_XXHASH3
+ #define HASH_ALGO_HAVE_XXHASH3 0
+#else
+ #define HASH_ALGO_HAVE_XXHASH3 1
+#endif
+#define HASH_ALGO_AVAILABLE(a) ((a) == HASH_ALGO_JODYHASH64 \
+		|| ((a) == HASH_ALGO_XXHASH2_64 && HASH_ALGO_HAVE_XXHASH2) \
+		|| (((a) == HASH_ALGO_XXHASH3_64 || (a) == HASH_ALGO_XXHASH3_128) && HASH_ALGO_HAVE_XXHASH3))
+
+/* Progressive hashing tiers grow by this power of two (16x per tier) */
+#ifndef HASH_TIER_SHIFT
+ #define HASH_TIER_SHIFT 4
+#endif
 
 #include "jdupes.h"
 
+int set_hash_algo(const char * const restrict name);
+int hash_block(const int algo, const void * const restrict data, const size_t len, uint64_t hash[2]);
 uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo);
+#ifndef NO_SMALLFILE
+int get_small_file(file_t * const restrict checkfile, int algo);
+#endif
+#ifndef NO_THREADS
+int prehash_file(file_t * const restrict checkfile, int algo);
+#endif
+unsigned int hash_tier_count(const off_t size);
+uint64_t *get_filehash_tier(file_t * const restrict checkfile, const unsigned int tier, int algo);
+int hash_tiers_take_full(file_t * const restrict file);
+void hash_tiers_release(file_t ** const restrict group, const size_t count);
+int hash_compare_pair(file_t * const restrict file1, file_t * const restrict file2, int algo, int * const restrict cmpresult);
 
 #ifdef __cplusplus
 }
@@ -24,10 +24,39 @@
 #include "jdupes.h"
 #include "likely_unlikely.h"
 
+#ifdef ON_WINDOWS
+ #define STAT_STRUCT struct jc_winstat
+#else
+ #include <fcntl.h>
+ #include <sys/stat.h>
+ #define STAT_STRUCT struct stat
+#endif
+
+/* Compare fresh stat() info with what was seen during the scan */
+static int stat_differs(const file_t * const restrict file, const STAT_STRUCT * const restrict st)
+{
+  if (file->inode != st->st_ino) return 1;
+  if (file->size != st->st_size) return 1;
+  if (file->device != st->st_dev) return 1;
+  if (file->mode != st->st_mode) return 1;
+#ifndef NO_MTIME
+  if (file->mtime != st->st_mtime) return 1;
+#endif
+#ifndef NO_PERMS
+  if (file->uid != st->st_uid) return 1;
+  if (file->gid != st->st_gid) return 1;
+#endif
+  return 0;
+}
+
+
 /* Check file's stat() info to make sure nothing has changed
  * Returns 1 if changed, 0 if not changed, negative if error */
 int file_has_changed(file_t * const restrict file)
 {
+  /* Linking threads call this, so it can't use the global stat buffer */
+  STAT_STRUCT st;
+
   /* If -t/--no-change-check specified then completely bypass this code */
   if (ISFLAG(flags, F_NOCHANGECHECK)) return 0;
 
@@ -36,27 +65,44 @@ int file_has_changed(file_t * const restrict file)
 
   if (!ISFLAG(file->flags, FF_VALID_STAT)) return -66;
 
-  if (STAT(file->d_name, &s) != 0) return -2;
-  if (file->inode != s.st_ino) return 1;
-  if (file->size != s.st_size) return 1;
-  if (file->device != s.st_dev) return 1;
-  if (file->mode != s.st_mode) return 1;
-#ifndef NO_MTIME
-  if (file->mtime != s.st_mtime) return 1;
-#endif
-#ifndef NO_PERMS
-  if (file->uid != s.st_uid) return 1;
-  if (file->gid != s.st_gid) return 1;
-#endif
+  if (STAT(file->d_name, &st) != 0) return -2;
+  if (stat_differs(file, &st)) return 1;
 #ifndef NO_SYMLINKS
-  if (lstat(file->d_name, &s) != 0) return -3;
-  if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
+  if (lstat(file->d_name, &st) != 0) return -3;
+  if ((S_ISLNK(st.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
 #endif
 
   return 0;
 }
 
 
+#ifndef ON_WINDOWS
+/* Same as file_has_changed() for a name relative to an open directory. The
+ * symlink check comes first since for anything but a symlink its result is
+ * also the stat() result, saving a system call for most files */
+int file_has_changed_at(file_t * const restrict file, const int dirfd, const char * const restrict name)
+{
+  struct stat st;
+  int is_link;
+
+  if (ISFLAG(flags, F_NOCHANGECHECK)) return 0;
+
+  if (unlikely(file == NULL || name == NULL)) jc_nullptr("file_has_changed_at()");
+  LOUD(fprintf(stderr, "file_has_changed_at(%d, '%s')\n", dirfd, name);)
+
+  if (!ISFLAG(file->flags, FF_VALID_STAT)) return -66;
+
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return -3;
+  is_link = S_ISLNK(st.st_mode) ? 1 : 0;
+#ifndef NO_SYMLINKS
+  if (is_link ^ (ISFLAG(file->flags, FF_IS_SYMLINK) ? 1 : 0)) return 1;
+#endif
+  if (is_link && fstatat(dirfd, name, &st, 0) != 0) return -2;
+  return stat_differs(file, &st);
+}
+#endif /* ON_WINDOWS */
+
+
 int getfilestats(file_t * const restrict file)
 {
   if (unlikely(file == NULL || file->d_name == NULL)) jc_nullptr("getfilestats()");
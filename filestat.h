@@ -11,6 +11,9 @@ extern "C" {
 #include "jdupes.h"
 
 int file_has_changed(file_t * const restrict file);
+#ifndef ON_WINDOWS
+int file_has_changed_at(file_t * const restrict file, const int dirfd, const char * const restrict name);
+#endif
 int getfilestats(file_t * const restrict file);
 /* Returns -1 if stat() fails, 0 if it's a directory, 1 if it's not */
 int getdirstats(const char * const restrict name,
@@ -12,11 +12,14 @@
 #include "jdupes.h"
 #include "libjodycode.h"
 #include "likely_unlikely.h"
+#include "filehash.h"
 #include "hashdb.h"
 
 #define HASHDB_VER 2
+/* v3 is v2 with 128-bit full hashes; only used for 128-bit algorithms */
+#define HASHDB_VER_WIDE 3
 #define HASHDB_MIN_VER 1
-#define HASHDB_MAX_VER 2
+#define HASHDB_MAX_VER 3
 #ifndef PH_SHIFT
  #define PH_SHIFT 12
 #endif
@@ -108,7 +111,8 @@ static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int
   /* Write header and traverse array on first call */
   if (unlikely(cur == NULL)) {
     gettimeofday(&tm, NULL);
-    snprintf(out, PATH_MAX + 127, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
+    snprintf(out, PATH_MAX + 127, "jdupes hashdb:%d,%d,%08lx\n",
+        HASH_ALGO_WIDE(hash_algo) ? HASHDB_VER_WIDE : HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
     LOUD(fprintf(stderr, "write hashdb: %s", out);)
     errno = 0;
     if (db == NULL) printf("%s", out); else fputs(out, db);
@@ -128,8 +132,12 @@ static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int
 
   /* Write out this node if it wasn't invalidated */
   if (cur->hashcount != 0) {
-    snprintf(out, PATH_MAX + 127, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
-      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
+    if (HASH_ALGO_WIDE(hash_algo))
+      snprintf(out, PATH_MAX + 127, "%u,%016" PRIx64 ",%016" PRIx64 "%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
+        cur->hashcount, cur->partialhash, cur->fullhash_hi, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
+    else
+      snprintf(out, PATH_MAX + 127, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
+        cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
     (*cnt)++;
     LOUD(fprintf(stderr, "write hashdb: %s", out);)
     errno = 0;
@@ -244,6 +252,7 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
             if (cur->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
               cur->hashcount = 2;
               cur->fullhash = check->filehash;
+              cur->fullhash_hi = check->filehash_hi;
               hashdb_dirty = 1;
             }
             return cur;
@@ -297,6 +306,7 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
     file->mtime = check->mtime;
     file->partialhash = check->filehash_partial;
     file->fullhash = check->filehash;
+    file->fullhash_hi = check->filehash_hi;
     if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
     else file->hashcount = 1;
   } else {
@@ -309,7 +319,8 @@ hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
 
 
 /* db header format: jdupes hashdb:dbversion,hashtype,update_mtime
- * db line format: hashcount,partial,full,mtime,size,inode,path */
+ * db line format: hashcount,partial,full,mtime,size,inode,path
+ * (v3 "full" is 32 hex digits: upper half first) */
 int64_t load_hash_database(const char * const restrict dbname)
 {
   FILE *db;
@@ -348,18 +359,25 @@ int64_t load_hash_database(const char * const restrict dbname)
   LOUD(SECS_TO_TIME(date, &db_mtime);)
   LOUD(fprintf(stderr, "hashdb header: ver %u, algo %u, mod %s\n", db_ver, hashdb_algo, date);)
   if (db_ver < HASHDB_MIN_VER || db_ver > HASHDB_MAX_VER) goto error_hashdb_version;
-  if (hashdb_algo != hash_algo) goto warn_hashdb_algo;
+  if (hashdb_algo != hash_algo) {
+    /* Use the database's algorithm unless the user asked for a specific one */
+    if (hash_algo_manual != 0 || !HASH_ALGO_AVAILABLE(hashdb_algo)) goto warn_hashdb_algo;
+    LOUD(fprintf(stderr, "hashdb: switching to hash algorithm %d from database\n", hashdb_algo);)
+    hash_algo = hashdb_algo;
+  }
 
-  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes */
+  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes; v3 has 128-bit full hashes */
   fixed_len = 87;
   if (db_ver == 1) fixed_len = 71;
+  if (db_ver == HASHDB_VER_WIDE) fixed_len = 103;
+  if ((db_ver == HASHDB_VER_WIDE) != (HASH_ALGO_WIDE(hashdb_algo) != 0)) goto error_hashdb_version;
 
   /* Read database entries */
   while (1) {
     int pathlen;
     unsigned int linelen;
     int hashcount;
-    uint64_t partialhash, fullhash = 0;
+    uint64_t partialhash, fullhash = 0, fullhash_hi = 0;
     time_t mtime;
     char *path;
     hashdb_t *entry;
@@ -385,7 +403,17 @@ int64_t load_hash_database(const char * const restrict dbname)
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     partialhash = strtoull(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    if (hashcount == 2) fullhash = strtoull(field, NULL, 16);
+    if (hashcount == 2) {
+      if (db_ver == HASHDB_VER_WIDE) {
+        char hi[17];
+
+        if (strlen(field) != 32) goto error_hashdb_line;
+        memcpy(hi, field, 16);
+        hi[16] = '\0';
+        fullhash_hi = strtoull(hi, NULL, 16);
+        fullhash = strtoull(field + 16, NULL, 16);
+      } else fullhash = strtoull(field, NULL, 16);
+    }
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
     mtime = (time_t)strtoul(field, NULL, 16);
     field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
@@ -409,6 +437,7 @@ int64_t load_hash_database(const char * const restrict dbname)
     entry->size = size;
     entry->partialhash = partialhash;
     entry->fullhash = fullhash;
+    entry->fullhash_hi = fullhash_hi;
     entry->hashcount = hashcount;
   }
 
@@ -493,9 +522,13 @@ int read_hashdb_entry(file_t *file)
         hashdb_dirty = 1;
         return -1;
       }
+      /* The upper half of a small file's 128-bit hash is only stored with
+       * its full hash; without it the partial hash is useless */
+      if (cur->hashcount == 1 && HASH_ALGO_WIDE(hash_algo) && file->size <= PARTIAL_HASH_SIZE) return 0;
       file->filehash_partial = cur->partialhash;
       if (cur->hashcount == 2) {
         file->filehash = cur->fullhash;
+        file->filehash_hi = cur->fullhash_hi;
         SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
       } else SETFLAG(file->flags, FF_HASH_PARTIAL);
       return 1;
@@ -18,6 +18,7 @@ typedef struct _hashdb {
   char *path;
   uint64_t partialhash;
   uint64_t fullhash;
+  uint64_t fullhash_hi;  /* Upper half of 128-bit full hashes */
   jdupes_ino_t inode;
   off_t size;
   time_t mtime;
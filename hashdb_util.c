@@ -16,6 +16,7 @@
 #include "version.h"
 
 int hash_algo = 0;
+int hash_algo_manual = 0;
 uint64_t flags = 0;
 
 #ifdef UNICODE
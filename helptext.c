@@ -5,9 +5,17 @@
 #include <inttypes.h>
 
 #include <libjodycode.h>
+#ifdef ENABLE_DEDUPE
+ #include "act_dedupeblocks.h"
+#endif
+#include "daemon.h"
 #include "filehash.h"
 #include "helptext.h"
 #include "jdupes.h"
+#include "similar.h"
+#ifndef NO_THREADS
+ #include "prehash.h"
+#endif
 #include "version.h"
 
 
@@ -32,12 +40,18 @@ const char *feature_flags[] = {
   #ifdef NO_CHUNKSIZE
   "nochunk",
   #endif
+  #ifndef HAVE_DAEMON
+  "nodaemon",
+  #endif
   #ifdef NO_DELETE
   "nodel",
   #endif
   #ifdef NO_ERRORONDUPE
   "noeod",
   #endif
+  #ifdef NO_EXTENTS
+  "noextents",
+  #endif
   #ifdef NO_EXTFILTER
   "noxf",
   #endif
@@ -62,12 +76,36 @@ const char *feature_flags[] = {
   #ifdef NO_PERMS
   "noperm",
   #endif
+  #ifdef NO_RESULTFILE
+  "noresultfile",
+  #endif
+  #ifdef NO_SCANORDER
+  "noscanorder",
+  #endif
+  #ifdef NO_SIMILARITY
+  "nosimilar",
+  #endif
+  #ifdef NO_SIMD
+  "nosimd",
+  #endif
+  #ifdef NO_SMALLFILE
+  "nosmall",
+  #endif
   #ifdef NO_SYMLINKS
   "noslink",
   #endif
+  #ifdef NO_STREAM
+  "nostream",
+  #endif
+  #ifdef NO_THREADS
+  "nothreads",
+  #endif
   #ifdef NO_TRAVCHECK
   "notrav",
   #endif
+  #ifdef NO_TREESNAP
+  "notreesnap",
+  #endif
   #ifdef NO_USER_ORDER
   "nouorder",
   #endif
@@ -101,9 +139,19 @@ void help_text(void)
   printf(" -0 --print-null  \toutput nulls instead of CR/LF (like 'find -print0')\n");
   printf(" -1 --one-file-system\tdo not match files on different filesystems/devices\n");
   printf(" -A --no-hidden    \texclude hidden files from consideration\n");
+  printf(" -a --hash-algo=name\tfile hash algorithm: xxh3, xxh3-128, xxhash64, or jodyhash\n");
+  printf("                  \t(default is the hash database's algorithm, or xxh3)\n");
 #ifdef ENABLE_DEDUPE
   printf(" -B --dedupe      \tdo a copy-on-write (reflink/clone) deduplication\n");
+ #ifdef HAVE_DEDUPE_BLOCKS
+  printf(" -b --dedupe-blocks\tshare identical blocks between large files that are\n");
+  printf("                  \tnot complete duplicates (Linux only)\n");
+ #endif
 #endif
+#ifndef NO_SIMILARITY
+  printf(" -c --similar=#   \twith -j, also list large files sharing at least #%%\n");
+  printf("                  \tof their data with a larger file\n");
+#endif /* NO_SIMILARITY */
 #ifndef NO_CHUNKSIZE
   printf(" -C --chunk-size=#\toverride I/O chunk size in KiB (min %d, max %d)\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
 #endif /* NO_CHUNKSIZE */
@@ -122,6 +170,16 @@ void help_text(void)
   printf(" -e --error-on-dupe\texit on any duplicate found with status code 255\n");
 #endif
   printf(" -f --omit-first  \tomit the first file in each set of matches\n");
+#ifdef HAVE_DAEMON
+  printf(" -g --daemon=socket\tafter scanning, keep watching the directories with\n");
+  printf("                  \tinotify and print the current duplicate sets to each\n");
+  printf("                  \tclient that connects to the Unix socket\n");
+#endif
+#ifndef NO_RESULTFILE
+  printf(" -G --read-results=file\tload duplicate sets from a -W result file instead of\n");
+  printf("                  \tscanning, then print them or act on them; files that\n");
+  printf("                  \tchanged since the scan are left alone\n");
+#endif
   printf(" -h --help        \tdisplay this help message\n");
 #ifndef NO_HARDLINKS
   printf(" -H --hard-links  \ttreat any linked files as duplicate files. Normally\n");
@@ -132,8 +190,15 @@ void help_text(void)
   printf(" -I --isolate     \tfiles in the same specified directory won't match\n");
 #endif
 #ifndef NO_JSON
+  printf(" -F --json-fields \twith -j or -J, add inode, device, mtime, link count,\n");
+  printf("                  \thashes, and how each file was matched\n");
+  printf(" -J --ndjson      \tproduce JSON output with one line per duplicate set\n");
   printf(" -j --json        \tproduce JSON (machine-readable) output\n");
 #endif /* NO_JSON */
+#ifndef NO_XXHASH3
+  printf(" -k --hash-verify \tmatch on 128-bit full-file hashes instead of reading\n");
+  printf("                  \tmatched files again (implies --hash-algo=xxh3-128)\n");
+#endif
 /*  printf(" -K --skip-hash   \tskip full file hashing (may be faster; 100%% safe)\n");
     printf("                  \tWARNING: in development, not fully working yet!\n"); */
 #ifndef NO_SYMLINKS
@@ -184,12 +249,28 @@ void help_text(void)
   printf(" -U --no-trav-check\tdisable double-traversal safety check (BE VERY CAREFUL)\n");
   printf("                  \tThis fixes a Google Drive File Stream recursion issue\n");
   printf(" -v --version     \tdisplay jdupes version and license information\n");
+#ifndef NO_RESULTFILE
+  printf(" -W --write-results=file\twrite duplicate sets to a compact binary file\n");
+#endif
+#ifndef NO_THREADS
+  printf(" -w --io-threads=#[,#]\tthreads per device that read the first block of each\n");
+  printf("                  \tfile (rotating,other); later reads are not threaded;\n");
+  printf("                  \tdefault is %d,%d; one number sets both\n", PREHASH_THREADS_ROTATIONAL, PREHASH_THREADS_SOLID);
+#endif
+#ifndef NO_STREAM
+  printf(" -x --stream      \tprint, link, or delete (with -N) each duplicate set as\n");
+  printf("                  \tsoon as all files of its size have been checked\n");
+#endif
 #ifndef NO_EXTFILTER
   printf(" -X --ext-filter=x:y\tfilter files based on specified criteria\n");
   printf("                  \tUse '-X help' for detailed extfilter help\n");
 #endif /* NO_EXTFILTER */
   printf(" -y --hash-db=file\tuse a hash database text file to speed up repeat runs\n");
   printf("                  \tPassing '-y .' will expand to  '-y jdupes_hashdb.txt'\n");
+#ifndef NO_TREESNAP
+  printf(" -Y --tree-snapshot=file\tkeep directory listings in a file and reuse them for\n");
+  printf("                  \tdirectories that have not changed since the last run\n");
+#endif
   printf(" -z --zero-match  \tconsider zero-length files to be duplicates\n");
   printf(" -Z --soft-abort  \tIf the user aborts (i.e. CTRL-C) act on matches so far\n");
 #ifndef ON_WINDOWS
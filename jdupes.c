@@ -42,6 +42,9 @@
 #include "jdupes.h"
 #include "args.h"
 #include "checks.h"
+#include "chunkcmp.h"
+#include "daemon.h"
+#include "extents.h"
 #ifdef DEBUG
  #include "dumpflags.h"
 #endif
@@ -56,13 +59,23 @@
 #include "helptext.h"
 #include "loaddir.h"
 #include "match.h"
+#ifndef NO_THREADS
+ #include "prehash.h"
+#endif
 #include "progress.h"
 #include "interrupt.h"
+#include "rawio.h"
+#include "resultfile.h"
+#include "scanorder.h"
+#include "sizegroup.h"
 #include "sort.h"
+#include "stream.h"
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
+#include "treesnap.h"
 #include "version.h"
+#include "xxh3_dispatch.h"
 
 #ifndef USE_JODY_HASH
  #include "xxhash.h"
@@ -77,6 +90,7 @@
 #include "act_deletefiles.h"
 #ifdef ENABLE_DEDUPE
  #include "act_dedupefiles.h"
+ #include "act_dedupeblocks.h"
 #endif
 #include "act_linkfiles.h"
 #include "act_printmatches.h"
@@ -84,6 +98,7 @@
  #include "act_printjson.h"
 #endif /* NO_JSON */
 #include "act_summarize.h"
+#include "similar.h"
 
 
 /* Detect Windows and modify as needed */
@@ -126,7 +141,7 @@ uintmax_t filecount = 0, progress = 0, item_progress = 0, dupecount = 0;
 /* Performance and behavioral statistics (debug mode) */
 #ifdef DEBUG
 unsigned int small_file = 0, partial_hash = 0, partial_elim = 0;
-unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0;
+unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0, tier_elim = 0, pair_compare = 0, extent_match = 0;
 uintmax_t comparisons = 0;
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
@@ -142,8 +157,10 @@ static filetree_t *checktree = NULL;
 #ifdef USE_JODY_HASH
 int hash_algo = HASH_ALGO_JODYHASH64;
 #else
-int hash_algo = HASH_ALGO_XXHASH2_64;
+int hash_algo = HASH_ALGO_XXHASH3_64;
 #endif
+/* Set when the user picked an algorithm; otherwise a hash database's wins */
+int hash_algo_manual = 0;
 
 /* Directory/file parameter position counter */
 unsigned int user_item_count = 1;
@@ -165,6 +182,20 @@ int exit_status = EXIT_SUCCESS;
 
 /***** Add new functions here *****/
 
+/* All files of one size are done: act on their sets with --stream and drop
+ * what was kept to compare them */
+static void size_done(file_t ** const restrict group, const size_t count)
+{
+#ifndef NO_STREAM
+  if (ISFLAG(flags, F_STREAM)) stream_sets(group, count);
+#endif
+  hash_tiers_release(group, count);
+#ifdef HAVE_EXTENTS
+  for (size_t i = 0; i < count; i++) extents_free(group[i]);
+#endif
+  return;
+}
+
 
 #ifdef UNICODE
 int wmain(int argc, wchar_t **wargv)
@@ -174,6 +205,10 @@ int main(int argc, char **argv)
 {
   static file_t *files = NULL;
   static file_t *curfile;
+#ifndef NO_SCANORDER
+  static file_t **scanorder = NULL;
+  static size_t scanindex = 0;
+#endif
   static char **oldargv;
   static int firstrecurse;
   static int opt;
@@ -193,6 +228,15 @@ int main(int argc, char **argv)
   static struct utsname utsname;
  #endif /* __linux__ */
 #endif
+#ifndef NO_RESULTFILE
+  const char *results_in = NULL, *results_out = NULL;
+#endif
+#ifndef NO_TREESNAP
+  const char *treesnap_name = NULL;
+#endif
+#ifdef HAVE_DAEMON
+  const char *daemon_name = NULL;
+#endif
 #ifndef NO_HASHDB
   char *hashdb_name = NULL;
   int hdblen;
@@ -208,19 +252,29 @@ int main(int argc, char **argv)
     { "one-file-system", 0, 0, '1' },
     { "", 0, 0, '9' },
     { "no-hidden", 0, 0, 'A' },
+    { "hash-algo", 1, 0, 'a' },
     { "dedupe", 0, 0, 'B' },
+    { "dedupe-blocks", 0, 0, 'b' },
+    { "similar", 1, 0, 'c' },
     { "chunk-size", 1, 0, 'C' },
     { "debug", 0, 0, 'D' },
+    { "read-results", 1, 0, 'G' },
     { "delete", 0, 0, 'd' },
     { "error-on-dupe", 0, 0, 'e' },
     { "ext-option", 0, 0, 'E' },
     { "omit-first", 0, 0, 'f' },
+    { "daemon", 1, 0, 'g' },
     { "hard-links", 0, 0, 'H' },
     { "help", 0, 0, 'h' },
     { "isolate", 0, 0, 'I' },
     { "reverse", 0, 0, 'i' },
     { "json", 0, 0, 'j' },
+    { "json-fields", 0, 0, 'F' },
+    { "ndjson", 0, 0, 'J' },
 /*    { "skip-hash", 0, 0, 'K' }, */
+#ifndef NO_XXHASH3
+    { "hash-verify", 0, 0, 'k' },
+#endif
     { "link-hard", 0, 0, 'L' },
     { "link-soft", 0, 0, 'l' },
     { "print-summarize", 0, 0, 'M'},
@@ -241,8 +295,12 @@ int main(int argc, char **argv)
     { "no-trav-check", 0, 0, 'U' },
     { "print-unique", 0, 0, 'u' },
     { "version", 0, 0, 'v' },
+    { "io-threads", 1, 0, 'w' },
+    { "write-results", 1, 0, 'W' },
+    { "stream", 0, 0, 'x' },
     { "ext-filter", 1, 0, 'X' },
     { "hash-db", 1, 0, 'y' },
+    { "tree-snapshot", 1, 0, 'Y' },
     { "soft-abort", 0, 0, 'Z' },
     { "zero-match", 0, 0, 'z' },
     { NULL, 0, 0, 0 }
@@ -252,7 +310,7 @@ int main(int argc, char **argv)
  #define GETOPT getopt
 #endif
 
-#define GETOPT_STRING "@019ABC:DdEefHhIijKLlMmNnOo:P:pQqRrSsTtUuVvX:y:Zz"
+#define GETOPT_STRING "@019Aa:Bbc:C:DdEeFfg:G:HhIiJjKkLlMmNnOo:P:pQqRrSsTtUuVvW:w:xX:y:Y:Zz"
 
   /* Verify libjodycode compatibility before going further */
   if (libjodycode_version_check(1, 0) != 0) {
@@ -282,6 +340,13 @@ int main(int argc, char **argv)
   jc_set_output_modes(0x0c);
 #endif /* UNICODE */
 
+#ifndef NO_XXHASH3
+  /* Pick the XXH3 code for this CPU before anything is hashed */
+  xxh3_dispatch_init();
+#endif
+  /* Pick the compare code for this CPU before any threads start */
+  chunkcmp_init();
+
 #ifndef NO_CHUNKSIZE
 #ifdef __linux__
   /* Auto-tune chunk size to be half of L1 data cache if possible */
@@ -329,7 +394,17 @@ int main(int argc, char **argv)
     case 'A':
       SETFLAG(flags, F_EXCLUDEHIDDEN);
       break;
+    case 'a':
+      if (set_hash_algo(optarg) != 0) {
+        fprintf(stderr, "error: unknown or unavailable hash algorithm '%s' for --hash-algo\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      LOUD(fprintf(stderr, "opt: hash algorithm %s (--hash-algo)\n", hash_algo_list[hash_algo]);)
+      break;
 #ifdef ENABLE_DEDUPE
+ #ifdef HAVE_DEDUPE_BLOCKS
+    case 'b':
+ #endif
     case 'B':
 #ifdef __linux__
       /* Refuse to dedupe on 2.x kernels; they could damage user data */
@@ -342,6 +417,11 @@ int main(int argc, char **argv)
         fprintf(stderr, "Refusing to dedupe on a 2.x kernel; data loss could occur. Aborting.\n");
         exit(EXIT_FAILURE);
       }
+      if (opt == 'b') {
+        SETFLAG(a_flags, FA_DEDUPEBLOCKS);
+        LOUD(fprintf(stderr, "opt: partial block-level deduplication enabled (--dedupe-blocks)\n");)
+        break;
+      }
       /* Kernel-level dedupe will do the byte-for-byte check itself */
       if (!ISFLAG(flags, F_PARTIALONLY)) SETFLAG(flags, F_QUICKCOMPARE);
 #endif /* __linux__ */
@@ -351,6 +431,15 @@ int main(int argc, char **argv)
       LOUD(fprintf(stderr, "opt: CoW/block-level deduplication enabled (--dedupe)\n");)
       break;
 #endif /* ENABLE_DEDUPE */
+#ifndef NO_SIMILARITY
+    case 'c':
+      if (set_similar_percent(optarg) != 0) {
+        fprintf(stderr, "error: --similar must be a percentage from 1 to 100\n");
+        exit(EXIT_FAILURE);
+      }
+      LOUD(fprintf(stderr, "opt: report files sharing at least %u%% of their data (--similar)\n", similar_percent);)
+      break;
+#endif /* NO_SIMILARITY */
 #ifndef NO_CHUNKSIZE
     case 'C':
       manual_chunk_size = (strtol(optarg, NULL, 10) & 0x0ffffffcL) << 10;  /* Align to 4K sizes */
@@ -358,7 +447,12 @@ int main(int argc, char **argv)
         fprintf(stderr, "warning: invalid manual chunk size (must be %d - %d KiB); using defaults\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
         LOUD(fprintf(stderr, "Manual chunk size (failed) was apparently '%s' => %ld KiB\n", optarg, manual_chunk_size / 1024));
         manual_chunk_size = 0;
-      } else auto_chunk_size = (size_t)manual_chunk_size;
+      } else {
+        auto_chunk_size = (size_t)manual_chunk_size;
+#ifdef RAWIO_TUNE
+        rawio_tune_enabled = 0;
+#endif
+      }
       LOUD(fprintf(stderr, "Manual chunk size is %ld\n", manual_chunk_size));
       break;
 #endif /* NO_CHUNKSIZE */
@@ -427,6 +521,14 @@ int main(int argc, char **argv)
       SETFLAG(a_flags, FA_PRINTJSON);
       LOUD(fprintf(stderr, "opt: print output in JSON format (--print-json)\n");)
       break;
+    case 'J':
+      SETFLAG(a_flags, FA_PRINTJSON | FA_NDJSON);
+      LOUD(fprintf(stderr, "opt: print output as JSON lines (--ndjson)\n");)
+      break;
+    case 'F':
+      SETFLAG(a_flags, FA_JSONFIELDS);
+      LOUD(fprintf(stderr, "opt: add file metadata and hashes to JSON output (--json-fields)\n");)
+      break;
 #endif /* NO_JSON */
     case 'K':
       SETFLAG(flags, F_SKIPHASH);
@@ -472,6 +574,12 @@ int main(int argc, char **argv)
         exit(EXIT_FAILURE);
       }
       break;
+#ifndef NO_XXHASH3
+    case 'k':
+      SETFLAG(flags, F_HASHVERIFY);
+      LOUD(fprintf(stderr, "opt: byte-for-byte check replaced by 128-bit hash match (--hash-verify)\n");)
+      break;
+#endif
     case 'q':
       SETFLAG(flags, F_HIDEPROGRESS);
       break;
@@ -512,6 +620,38 @@ int main(int argc, char **argv)
     case 'V':
       version_text(0);
       exit(EXIT_SUCCESS);
+#ifndef NO_THREADS
+    case 'w':
+      if (set_io_threads(optarg) != 0) {
+        fprintf(stderr, "error: --io-threads must be one number or two numbers separated by a comma (max %d)\n", PREHASH_THREADS_MAX);
+        exit(EXIT_FAILURE);
+      }
+      LOUD(fprintf(stderr, "opt: I/O threads per device: %u rotational, %u other (--io-threads)\n", io_threads_rotational, io_threads_solid);)
+      break;
+#endif /* NO_THREADS */
+#ifdef HAVE_DAEMON
+    case 'g':
+      SETFLAG(flags, F_DAEMON);
+      daemon_name = optarg;
+      LOUD(fprintf(stderr, "opt: keep watching for changes and answer queries (--daemon)\n");)
+      break;
+#endif /* HAVE_DAEMON */
+#ifndef NO_RESULTFILE
+    case 'G':
+      results_in = optarg;
+      LOUD(fprintf(stderr, "opt: load duplicate sets from a result file (--read-results)\n");)
+      break;
+    case 'W':
+      results_out = optarg;
+      LOUD(fprintf(stderr, "opt: write duplicate sets to a result file (--write-results)\n");)
+      break;
+#endif /* NO_RESULTFILE */
+#ifndef NO_STREAM
+    case 'x':
+      SETFLAG(flags, F_STREAM);
+      LOUD(fprintf(stderr, "opt: act on each set as soon as it is complete (--stream)\n");)
+      break;
+#endif /* NO_STREAM */
 #ifndef NO_SYMLINKS
     case 'l':
       SETFLAG(a_flags, FA_MAKESYMLINKS);
@@ -548,6 +688,13 @@ int main(int argc, char **argv)
       else strcpy(hashdb_name, optarg);
       break;
 #endif /* NO_HASHDB */
+#ifndef NO_TREESNAP
+    case 'Y':
+      SETFLAG(flags, F_TREESNAP);
+      treesnap_name = optarg;
+      LOUD(fprintf(stderr, "opt: replay unchanged directories from a tree snapshot (--tree-snapshot)\n");)
+      break;
+#endif /* NO_TREESNAP */
     case 'z':
       SETFLAG(flags, F_INCLUDEEMPTY);
       LOUD(fprintf(stderr, "opt: zero-length files count as matches (--zero-match)\n");)
@@ -570,6 +717,15 @@ int main(int argc, char **argv)
     }
   }
 
+#ifndef NO_RESULTFILE
+  /* Sets loaded from a result file replace the file scan */
+  if (results_in != NULL) {
+    if (optind < argc) {
+      fprintf(stderr, "option --read-results can't be used with files or directories\n");
+      exit(EXIT_FAILURE);
+    }
+  } else
+#endif
   if (optind >= argc) {
     fprintf(stderr, "no files or directories specified (use -h option for help)\n");
     exit(EXIT_FAILURE);
@@ -607,6 +763,36 @@ skip_partialonly_noise:
     exit(EXIT_FAILURE);
   }
 
+#ifndef NO_XXHASH3
+  /* Matching on hashes alone is only acceptable with a 128-bit hash */
+  if (ISFLAG(flags, F_HASHVERIFY)) {
+    if (hash_algo_manual != 0 && !HASH_ALGO_WIDE(hash_algo)) {
+      fprintf(stderr, "option --hash-verify requires a 128-bit hash algorithm (--hash-algo=xxh3-128)\n");
+      exit(EXIT_FAILURE);
+    }
+    hash_algo = HASH_ALGO_XXHASH3_128;
+    hash_algo_manual = 1;
+  }
+#endif
+
+#ifndef NO_JSON
+  if (ISFLAG(a_flags, FA_JSONFIELDS) && !ISFLAG(a_flags, FA_PRINTJSON)) {
+    fprintf(stderr, "option --json-fields requires --json or --ndjson\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
+#ifndef NO_SIMILARITY
+  if (similar_percent != 0 && !ISFLAG(a_flags, FA_PRINTJSON)) {
+    fprintf(stderr, "option --similar requires --json\n");
+    exit(EXIT_FAILURE);
+  }
+  if (similar_percent != 0 && ISFLAG(flags, F_STREAM)) {
+    fprintf(stderr, "option --similar can't be used with --stream\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   if (ISFLAG(a_flags, FA_SUMMARIZEMATCHES) && ISFLAG(a_flags, FA_DELETEFILES)) {
     fprintf(stderr, "options --summarize and --delete are not compatible\n");
     exit(EXIT_FAILURE);
@@ -628,14 +814,57 @@ skip_partialonly_noise:
       !!ISFLAG(a_flags, FA_PRINTJSON) +
       !!ISFLAG(a_flags, FA_PRINTUNIQUE) +
       !!ISFLAG(a_flags, FA_ERRORONDUPE) +
-      !!ISFLAG(a_flags, FA_DEDUPEFILES);
+      !!ISFLAG(a_flags, FA_DEDUPEFILES) +
+      !!ISFLAG(a_flags, FA_DEDUPEBLOCKS);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, or --dedupe may be used\n");
+      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, --dedupe, or --dedupe-blocks may be used\n");
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(a_flags, FA_PRINTMATCHES);
 
+#ifndef NO_STREAM
+  /* Only actions that need no other set and no prompt can be streamed */
+  if (ISFLAG(flags, F_STREAM) && (ISFLAG(a_flags, FA_SUMMARIZEMATCHES) || ISFLAG(a_flags, FA_PRINTUNIQUE)
+        || (ISFLAG(a_flags, FA_PRINTJSON) && !ISFLAG(a_flags, FA_NDJSON))
+        || ISFLAG(a_flags, FA_DEDUPEFILES) || ISFLAG(a_flags, FA_DEDUPEBLOCKS)
+        || (ISFLAG(a_flags, FA_DELETEFILES) && !ISFLAG(flags, F_NOPROMPT)))) {
+    fprintf(stderr, "error: --stream only works with printing, --ndjson, --link-hard, --link-soft,\nor --delete with --no-prompt\n");
+    exit(EXIT_FAILURE);
+  }
+#endif /* NO_STREAM */
+
+#ifndef NO_RESULTFILE
+  if (results_in != NULL && (ISFLAG(a_flags, FA_DEDUPEBLOCKS) || ISFLAG(a_flags, FA_PRINTUNIQUE)
+        || ISFLAG(a_flags, FA_ERRORONDUPE) || ISFLAG(flags, F_STREAM) || ISFLAG(flags, F_HASHDB)
+        || ISFLAG(flags, F_TREESNAP))) {
+    fprintf(stderr, "error: --read-results can't be used with --dedupe-blocks, --print-unique,\n--error-on-dupe, --stream, --hash-db, or --tree-snapshot\n");
+    exit(EXIT_FAILURE);
+  }
+  if (results_out != NULL && ISFLAG(flags, F_STREAM)) {
+    fprintf(stderr, "option --write-results can't be used with --stream\n");
+    exit(EXIT_FAILURE);
+  }
+#endif /* NO_RESULTFILE */
+
+#ifdef HAVE_DAEMON
+  /* The daemon only reports; it never changes files */
+  if (ISFLAG(flags, F_DAEMON) && (ISFLAG(a_flags, FA_DELETEFILES) || ISFLAG(a_flags, FA_HARDLINKFILES)
+        || ISFLAG(a_flags, FA_MAKESYMLINKS) || ISFLAG(a_flags, FA_DEDUPEFILES) || ISFLAG(a_flags, FA_DEDUPEBLOCKS)
+        || ISFLAG(a_flags, FA_PRINTUNIQUE) || ISFLAG(a_flags, FA_ERRORONDUPE) || ISFLAG(flags, F_STREAM)
+        || ISFLAG(flags, F_PARTIALONLY) || ISFLAG(flags, F_HASHDB) || ISFLAG(flags, F_TREESNAP)
+ #ifndef NO_SIMILARITY
+        || similar_percent != 0
+ #endif
+ #ifndef NO_RESULTFILE
+        || results_in != NULL || results_out != NULL
+ #endif
+        )) {
+    fprintf(stderr, "error: --daemon only works with printing, --json, --ndjson, or --summarize\n");
+    exit(EXIT_FAILURE);
+  }
+#endif /* HAVE_DAEMON */
+
 #ifndef ON_WINDOWS
   /* Catch SIGUSR1 and use it to enable -Z */
   signal(SIGUSR1, catch_sigusr1);
@@ -659,6 +888,25 @@ skip_partialonly_noise:
     jc_alarm_ring = 1;
   }
 
+#ifndef NO_RESULTFILE
+  if (results_in != NULL) {
+    if (read_results(results_in, &files) != 0) exit(EXIT_FAILURE);
+    /* Files may have changed since the scan; never act on those */
+    if (ISFLAG(a_flags, FA_DELETEFILES) || ISFLAG(a_flags, FA_HARDLINKFILES)
+        || ISFLAG(a_flags, FA_MAKESYMLINKS) || ISFLAG(a_flags, FA_DEDUPEFILES))
+      validate_results(files);
+    goto skip_file_scan;
+  }
+#endif
+
+#ifndef NO_TREESNAP
+  if (ISFLAG(flags, F_TREESNAP) && treesnap_open(treesnap_name) != 0) exit(EXIT_FAILURE);
+#endif
+#ifdef HAVE_DAEMON
+  /* Directories are watched as they are loaded, so start before the scan */
+  if (ISFLAG(flags, F_DAEMON) && daemon_start(daemon_name) != 0) exit(EXIT_FAILURE);
+#endif
+
   if (ISFLAG(flags, F_RECURSEAFTER)) {
     firstrecurse = nonoptafter("--recurse:", argc, oldargv, argv);
 
@@ -696,6 +944,10 @@ skip_partialonly_noise:
   /* Abort on CTRL-C (-Z doesn't matter yet) */
   if (unlikely(interrupt)) goto interrupt_exit;
 
+#ifndef NO_TREESNAP
+  if (ISFLAG(flags, F_TREESNAP) && treesnap_close(treesnap_name, 1) != 0) exit_status = EXIT_FAILURE;
+#endif
+
   /* Force a progress update */
   if (!ISFLAG(flags, F_HIDEPROGRESS)) update_phase1_progress("items");
 
@@ -714,9 +966,48 @@ skip_partialonly_noise:
 
   if (ISFLAG(flags, F_REVERSESORT)) sort_direction = -1;
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
+
+#ifdef HAVE_DAEMON
+  /* The daemon keeps the file list and follows changes instead of matching once */
+  if (ISFLAG(flags, F_DAEMON)) {
+    jc_stop_alarm();
+ #ifndef NO_MTIME
+    exit(daemon_run(files, argc, argv, optind,
+        ISFLAG(flags, F_RECURSEAFTER) ? firstrecurse : (ISFLAG(flags, F_RECURSE) ? optind : argc),
+        (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename));
+ #else
+    exit(daemon_run(files, argc, argv, optind,
+        ISFLAG(flags, F_RECURSEAFTER) ? firstrecurse : (ISFLAG(flags, F_RECURSE) ? optind : argc),
+        sort_pairs_by_filename));
+ #endif
+  }
+#endif /* HAVE_DAEMON */
+
   if (!files) goto skip_file_scan;
+#ifdef HAVE_DEDUPE_BLOCKS
+  /* Block-level dedupe works on all files, not on sets of duplicates */
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) goto skip_file_scan;
+#endif
 
+#ifndef NO_SCANORDER
+  /* Scan files in on-disk order rather than discovery order */
+  scanorder = build_scan_order(files);
+  curfile = (scanorder != NULL) ? scanorder[0] : files;
+ #ifndef NO_THREADS
+  /* Read the first block of every candidate file in parallel per device */
+  if (scanorder != NULL) prehash_files(scanorder);
+ #endif
+  /* Find candidates that can only match one other file */
+  if (scanorder != NULL) mark_hash_pairs(scanorder);
+#else
   curfile = files;
+#endif
+#ifndef NO_STREAM
+ #ifndef NO_JSON
+  if (ISFLAG(flags, F_STREAM) && ISFLAG(a_flags, FA_PRINTJSON)) printjson_start(argc, argv);
+ #endif
+#endif
+  sizegroup_start(files, size_done);
   progress = 0;
 
   /* Force an immediate progress update */
@@ -738,19 +1029,11 @@ skip_partialonly_noise:
 
     /* Byte-for-byte check that a matched pair are actually matched */
     if (match != NULL) {
-      /* Quick or partial-only compare will never run confirmmatch()
-       * Also skip match confirmation for hard-linked files
-       * (This set of comparisons is ugly, but quite efficient) */
-      if (
-             ISFLAG(flags, F_QUICKCOMPARE)
-          || ISFLAG(flags, F_PARTIALONLY)
-#ifndef NO_HARDLINKS
-          || (ISFLAG(flags, F_CONSIDERHARDLINKS)
-          &&  (curfile->inode == (*match)->inode)
-          &&  (curfile->device == (*match)->device))
-#endif
-          ) {
-        LOUD(fprintf(stderr, "MAIN: notice: hard linked, quick, or partial-only match (-H/-Q/-T)\n"));
+      const uint32_t shortcut = match_shortcut(curfile, *match);
+
+      if (shortcut != 0) {
+        LOUD(fprintf(stderr, "MAIN: notice: hard linked, quick, hash-verified, or partial-only match (-H/-Q/-k/-T)\n"));
+        SETFLAG(curfile->flags, shortcut);
 #ifndef NO_MTIME
         registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
 #else
@@ -760,8 +1043,9 @@ skip_partialonly_noise:
         goto skip_full_check;
       }
 
-      if (confirmmatch(curfile->d_name, (*match)->d_name, curfile->size) == 0) {
+      if (confirmmatch(curfile, *match) == 0) {
         LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
+        SETFLAG(curfile->flags, FF_MATCH_BYTES);
 #ifndef NO_MTIME
         registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
 #else
@@ -775,6 +1059,11 @@ skip_partialonly_noise:
     }
 
 skip_full_check:
+    sizegroup_file_done(curfile);
+#ifndef NO_SCANORDER
+    if (scanorder != NULL) curfile = scanorder[++scanindex];
+    else
+#endif
     curfile = curfile->next;
 
     check_sigusr1();
@@ -788,15 +1077,33 @@ skip_full_check:
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
 
 skip_file_scan:
+#ifndef NO_SCANORDER
+  free(scanorder);
+  scanorder = NULL;
+#endif
   /* Stop catching CTRL+C and firing alarms */
   signal(SIGINT, SIG_DFL);
   if (!ISFLAG(flags, F_HIDEPROGRESS)) jc_stop_alarm();
 
+#ifndef NO_RESULTFILE
+  if (results_out != NULL && write_results(files, results_out) != 0) exit_status = EXIT_FAILURE;
+#endif
+
   if (files == NULL) {
     printf("%s", s_no_dupes);
     exit(exit_status);
   }
 
+  /* Release what the scan kept; with --stream most or all sets were
+   * already acted upon during the scan */
+  sizegroup_finish();
+#ifndef NO_STREAM
+  if (ISFLAG(flags, F_STREAM)) {
+    stream_finish();
+    goto skip_actions;
+  }
+#endif
+
 #ifndef NO_DELETE
   if (ISFLAG(a_flags, FA_DELETEFILES)) {
     if (ISFLAG(flags, F_NOPROMPT)) deletefiles(files, 0, 0);
@@ -811,9 +1118,15 @@ skip_file_scan:
 #endif /* NO_HARDLINKS */
 #ifdef ENABLE_DEDUPE
   if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(files);
+ #ifdef HAVE_DEDUPE_BLOCKS
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) dedupeblocks(files);
+ #endif
 #endif /* ENABLE_DEDUPE */
   if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(files);
   if (ISFLAG(a_flags, FA_PRINTUNIQUE)) printunique(files);
+#ifndef NO_SIMILARITY
+  if (similar_percent != 0) find_similar(files);
+#endif
 #ifndef NO_JSON
   if (ISFLAG(a_flags, FA_PRINTJSON)) printjson(files, argc, argv);
 #endif /* NO_JSON */
@@ -822,6 +1135,9 @@ skip_file_scan:
     summarizematches(files);
   }
 
+#ifndef NO_STREAM
+skip_actions:
+#endif
 #ifndef NO_HASHDB
   if (ISFLAG(flags, F_HASHDB)) {
     hdbout = save_hash_database(hashdb_name, 1);
@@ -839,10 +1155,16 @@ skip_all_scan_code:
 
 #ifdef DEBUG
   if (ISFLAG(flags, F_DEBUG)) {
-    fprintf(stderr, "\n%d partial(%uKiB) (+%d small) -> %d full hash -> %d full (%d partial elim) (%d hash%u fail)\n",
-        partial_hash, PARTIAL_HASH_SIZE >> 10, small_file, full_hash, partial_to_full,
-        partial_elim, hash_fail, (unsigned int)sizeof(uint64_t)*8);
+    fprintf(stderr, "\n%d partial(%uKiB) (+%d small) -> %d full hash (+%d pair compare, +%d shared extents) -> %d full (%d partial elim, %d tier elim) (%d hash%u fail)\n",
+        partial_hash, PARTIAL_HASH_SIZE >> 10, small_file, full_hash, pair_compare, extent_match, partial_to_full,
+        partial_elim, tier_elim, hash_fail, (unsigned int)sizeof(uint64_t)*8);
     fprintf(stderr, "%" PRIuMAX " total files, %" PRIuMAX " comparisons\n", filecount, comparisons);
+    fprintf(stderr, "Match confirmation compare: %s\n", chunk_equal_name);
+ #ifndef NO_XXHASH3
+    if (hash_algo == HASH_ALGO_XXHASH3_64) fprintf(stderr, "Hash algorithm: %s (%s)\n", hash_algo_list[hash_algo], xxh3_simd_name);
+    else
+ #endif
+      fprintf(stderr, "Hash algorithm: %s\n", hash_algo_list[hash_algo]);
  #ifndef NO_CHUNKSIZE
     if (manual_chunk_size > 0) fprintf(stderr, "I/O chunk size: %ld KiB (manually set)\n", manual_chunk_size >> 10);
     else {
@@ -851,6 +1173,9 @@ skip_all_scan_code:
   #else
       fprintf(stderr, "I/O chunk size: %" PRIuMAX " KiB (default size)\n", (uintmax_t)(auto_chunk_size >> 10));
   #endif /* __linux__ */
+  #ifdef RAWIO_TUNE
+      rawio_print_tuning();
+  #endif
     }
  #endif /* NO_CHUNKSIZE */
  #ifdef ON_WINDOWS
@@ -873,6 +1198,13 @@ error_load_hashdb:
   exit(EXIT_FAILURE);
 #endif
 interrupt_exit:
+#ifndef NO_TREESNAP
+  /* A partial snapshot would lose the listings that were not reached */
+  if (ISFLAG(flags, F_TREESNAP)) treesnap_close(treesnap_name, 0);
+#endif
+#ifdef HAVE_DAEMON
+  if (ISFLAG(flags, F_DAEMON)) daemon_stop();
+#endif
   fprintf(stderr, "%s", s_interrupt);
   exit(EXIT_FAILURE);
 }
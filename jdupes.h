@@ -16,6 +16,7 @@ extern "C" {
  #define NO_SYMLINKS 1
  #define NO_PERMS 1
  #define NO_SIGACTION 1
+ #define NO_TREESNAP 1
  #ifndef WIN32_LEAN_AND_MEAN
   #define WIN32_LEAN_AND_MEAN
  #endif
@@ -79,7 +80,7 @@ extern "C" {
 /* Debugging stats */
 #ifdef DEBUG
 extern unsigned int small_file, partial_hash, partial_elim;
-extern unsigned int full_hash, partial_to_full, hash_fail;
+extern unsigned int full_hash, partial_to_full, hash_fail, tier_elim, pair_compare, extent_match;
 extern uintmax_t comparisons;
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
@@ -160,6 +161,10 @@ extern uint64_t flags, a_flags, p_flags;
 #define F_NOCHANGECHECK		(1ULL << 17)
 #define F_NOTRAVCHECK		(1ULL << 18)
 #define F_SKIPHASH		(1ULL << 19)
+#define F_HASHVERIFY		(1ULL << 20)
+#define F_STREAM		(1ULL << 21)
+#define F_TREESNAP		(1ULL << 22)
+#define F_DAEMON		(1ULL << 23)
 #define F_BENCHMARKSTOP		(1ULL << 29)
 #define F_HASHDB		(1ULL << 30)
 
@@ -179,6 +184,9 @@ extern uint64_t flags, a_flags, p_flags;
 #define FA_PRINTNULL		(1U << 9)
 #define FA_PRINTJSON		(1U << 10)
 #define FA_ERRORONDUPE		(1U << 11)
+#define FA_DEDUPEBLOCKS		(1U << 12)
+#define FA_NDJSON		(1U << 13)
+#define FA_JSONFIELDS		(1U << 14)
 
 /* Per-file true/false flags */
 #define FF_VALID_STAT		(1U << 0)
@@ -187,6 +195,15 @@ extern uint64_t flags, a_flags, p_flags;
 #define FF_HAS_DUPES		(1U << 3)
 #define FF_IS_SYMLINK		(1U << 4)
 #define FF_NOT_UNIQUE		(1U << 5)
+#define FF_SIZE_PEER		(1U << 6)  /* Another file has the same size */
+#define FF_HASH_PAIR		(1U << 7)  /* Exactly one other file can match this one */
+#define FF_PAIR_MATCHED		(1U << 8)  /* Contents already compared equal to its pair */
+/* How this file was found to match the file it was paired with */
+#define FF_MATCH_BYTES		(1U << 9)
+#define FF_MATCH_HASH		(1U << 10)
+#define FF_MATCH_PARTIAL	(1U << 11)
+#define FF_MATCH_LINK		(1U << 12)
+#define FF_MATCH_EXTENTS	(1U << 13)
 
 /* Extra print flags */
 #define PF_PARTIAL		(1U << 0)
@@ -202,6 +219,19 @@ typedef enum {
  #define PARTIAL_HASH_SIZE 4096
 #endif
 
+/* Files this size or smaller are read into memory once and compared there */
+#ifndef SMALL_FILE_SIZE
+ #define SMALL_FILE_SIZE PARTIAL_HASH_SIZE
+#endif
+#if SMALL_FILE_SIZE > PARTIAL_HASH_SIZE
+ #error SMALL_FILE_SIZE must not be larger than PARTIAL_HASH_SIZE
+#endif
+
+/* Progressive hashing state (private to filehash.c) */
+struct _hashtiers;
+/* Data extent map (private to extents.c) */
+struct _extentmap;
+
 /* Per-file information */
 typedef struct _file {
   struct _file *duplicates;
@@ -209,6 +239,12 @@ typedef struct _file {
   char *d_name;
   uint64_t filehash_partial;
   uint64_t filehash;
+  uint64_t filehash_hi;  /* Upper half of 128-bit full hashes, else 0 */
+  struct _hashtiers *tiers;
+  struct _extentmap *extents;  /* Loaded by extents_shared() */
+#ifndef NO_SMALLFILE
+  const char *content;  /* Pooled contents of small files */
+#endif
   jdupes_ino_t inode;
   off_t size;
 #ifndef NO_MTIME
@@ -254,7 +290,7 @@ typedef struct _filetree {
 /* Progress indicator variables */
 extern uintmax_t filecount, progress, item_progress, dupecount;
 
-extern int hash_algo;
+extern int hash_algo, hash_algo_manual;
 extern unsigned int user_item_count;
 extern int sort_direction;
 extern char tempname[];
@@ -263,6 +299,9 @@ extern const char *s_no_dupes;
 extern int exit_status;
 
 int file_has_changed(file_t * const restrict file);
+#ifndef ON_WINDOWS
+int file_has_changed_at(file_t * const restrict file, const int dirfd, const char * const restrict name);
+#endif
 
 #ifdef __cplusplus
 }
@@ -13,6 +13,7 @@
 #include "likely_unlikely.h"
 #include "jdupes.h"
 #include "checks.h"
+#include "daemon.h"
 #include "filestat.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
@@ -22,6 +23,9 @@
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
+#ifndef NO_TREESNAP
+ #include "treesnap.h"
+#endif
 
 #ifdef UNICODE
  static wchar_t wname[WPATH_MAX];
@@ -89,6 +93,7 @@ void loaddir(char * const restrict dir,
 {
   file_t * restrict newfile;
   struct dirent *dirinfo;
+  const char *entname;
   size_t dirlen, dirpos;
   int i;
 //  single = 0;
@@ -100,7 +105,12 @@ void loaddir(char * const restrict dir,
   HANDLE hFind = INVALID_HANDLE_VALUE;
   char *p;
 #else
-  DIR *cd;
+  DIR *cd = NULL;
+#endif
+#ifndef NO_TREESNAP
+  snapdir_t snapdir;
+  struct stat dirstat;
+  const char *snapline = NULL;
 #endif
   static int sf_warning = 0; /* single file warning should only appear once */
 
@@ -115,6 +125,11 @@ void loaddir(char * const restrict dir,
   /* Get directory stats (or file stats if it's a file) */
   i = getdirstats(dir, &inode, &device, &mode);
   if (unlikely(i < 0)) goto error_stat_dir;
+#ifndef NO_TREESNAP
+  /* getdirstats() leaves the full stats in the global 's'; keep a copy so
+   * that later stat calls can't change what the snapshot is checked against */
+  dirstat = s;
+#endif
 
   /* if dir is actually a file, just add it to the file tree */
   if (i == 1) {
@@ -149,6 +164,10 @@ void loaddir(char * const restrict dir,
   }
 #endif /* NO_TRAVCHECK */
 
+#ifdef HAVE_DAEMON
+  if (ISFLAG(flags, F_DAEMON)) daemon_watch_dir(dir, recurse);
+#endif
+
   item_progress++;
 
 #ifdef UNICODE
@@ -172,19 +191,39 @@ void loaddir(char * const restrict dir,
     /* Get necessary length and allocate d_name */
     dirinfo = (struct dirent *)malloc(sizeof(struct dirent));
     if (!W2M(ffd.cFileName, dirinfo->d_name)) continue;
+    entname = dirinfo->d_name;
 #else
-  cd = opendir(dir);
-  if (unlikely(!cd)) goto error_cd;
+ #ifndef NO_TREESNAP
+  /* An unchanged directory is listed from the tree snapshot instead */
+  if (!ISFLAG(flags, F_TREESNAP) || treesnap_dir_begin(&snapdir, dir, &dirstat) == 0) {
+ #endif
+    cd = opendir(dir);
+    if (unlikely(!cd)) goto error_cd;
+ #ifndef NO_TREESNAP
+  }
+ #endif
   dirlen = strlen(dir);
 
-  while ((dirinfo = readdir(cd)) != NULL) {
+  while (1) {
     char * restrict tp = tempname;
     size_t d_name_len;
+
+ #ifndef NO_TREESNAP
+    if (cd == NULL) {
+      entname = treesnap_dir_next(&snapdir, &snapline);
+      if (entname == NULL) break;
+    } else
+ #endif
+    {
+      dirinfo = readdir(cd);
+      if (dirinfo == NULL) break;
+      entname = dirinfo->d_name;
+    }
 #endif /* UNICODE */
 
     if (unlikely(interrupt != 0)) return;
-    LOUD(fprintf(stderr, "loaddir: readdir: '%s'\n", dirinfo->d_name));
-    if (unlikely(!jc_streq(dirinfo->d_name, ".") || !jc_streq(dirinfo->d_name, ".."))) continue;
+    LOUD(fprintf(stderr, "loaddir: readdir: '%s'\n", entname));
+    if (unlikely(!jc_streq(entname, ".") || !jc_streq(entname, ".."))) continue;
     check_sigusr1();
     if (jc_alarm_ring != 0) {
       jc_alarm_ring = 0;
@@ -193,7 +232,7 @@ void loaddir(char * const restrict dir,
 
     /* Assemble the file's full path name, optimized to avoid strcat() */
     dirpos = dirlen;
-    d_name_len = strlen(dirinfo->d_name);
+    d_name_len = strlen(entname);
     memcpy(tp, dir, dirpos + 1);
     if (dirpos != 0 && tp[dirpos - 1] != dir_sep) {
       tp[dirpos] = dir_sep;
@@ -201,7 +240,7 @@ void loaddir(char * const restrict dir,
     }
     if (unlikely(dirpos + d_name_len + 1 >= (PATHBUF_SIZE * 2))) goto error_overflow;
     tp += dirpos;
-    memcpy(tp, dirinfo->d_name, d_name_len);
+    memcpy(tp, entname, d_name_len);
     tp += d_name_len;
     *tp = '\0';
     d_name_len++;
@@ -212,15 +251,25 @@ void loaddir(char * const restrict dir,
     tp = tempname;
     memcpy(newfile->d_name, tp, dirpos + d_name_len);
 
+#ifndef NO_TREESNAP
+    if (cd == NULL) treesnap_dir_apply(&snapdir, snapline, entname, newfile);
+#endif
+
     /*** WARNING: tempname global gets reused by check_singlefile here! ***/
 
     /* Single-file [l]stat() and exclusion condition check */
     if (check_singlefile(newfile) != 0) {
       LOUD(fprintf(stderr, "loaddir: check_singlefile rejected file\n"));
+#ifndef NO_TREESNAP
+      if (ISFLAG(flags, F_TREESNAP)) treesnap_dir_add(&snapdir, entname, NULL);
+#endif
       free(newfile->d_name);
       free(newfile);
       continue;
     }
+#ifndef NO_TREESNAP
+    if (ISFLAG(flags, F_TREESNAP)) treesnap_dir_add(&snapdir, entname, newfile);
+#endif
 
     /* Optionally recurse directories, including symlinked ones if requested */
     if (S_ISDIR(newfile->mode)) {
@@ -281,7 +330,10 @@ void loaddir(char * const restrict dir,
   while (FindNextFileW(hFind, &ffd) != 0);
   FindClose(hFind);
 #else
-  closedir(cd);
+ #ifndef NO_TREESNAP
+  if (ISFLAG(flags, F_TREESNAP)) treesnap_dir_end(&snapdir, dir);
+ #endif
+  if (cd != NULL) closedir(cd);
 #endif
 
   return;
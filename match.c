@@ -1,9 +1,6 @@
 /* jdupes file matching functions
  * This file is part of jdupes; see jdupes.c for license information */
 
-#ifdef __linux__
- #include <fcntl.h>
-#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +9,8 @@
 #include "jdupes.h"
 #include "likely_unlikely.h"
 #include "checks.h"
+#include "chunkcmp.h"
+#include "extents.h"
 #include "filehash.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
@@ -19,6 +18,7 @@
 #include "interrupt.h"
 #include "match.h"
 #include "progress.h"
+#include "rawio.h"
 
 
 /* Copy any hashes between entries for detected hard-linked files */
@@ -30,10 +30,24 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
 
   if (file1 == NULL || file2 == NULL) jc_nullptr("cross_copy_hashes()");
 
+  /* Linked files have the same contents so they can share hashing tiers */
+  if (file1->tiers == NULL) file1->tiers = file2->tiers;
+  else if (file2->tiers == NULL) file2->tiers = file1->tiers;
+  /* Tiers shared earlier may since have reached the end of the file */
+  if (file1->tiers == file2->tiers) {
+    hash_tiers_take_full(file1);
+    hash_tiers_take_full(file2);
+  }
+#ifndef NO_SMALLFILE
+  if (file1->content == NULL) file1->content = file2->content;
+  else if (file2->content == NULL) file2->content = file1->content;
+#endif
+
   if (ISFLAG(file1->flags, FF_HASH_FULL)) {
     if (ISFLAG(file2->flags, FF_HASH_FULL)) return;
     file2->filehash_partial = file1->filehash_partial;
     file2->filehash = file1->filehash;
+    file2->filehash_hi = file1->filehash_hi;
     SETFLAG(file2->flags, FF_HASH_PARTIAL | FF_HASH_FULL);
 #ifndef NO_HASHDB
     dirty2 = 1;
@@ -42,6 +56,7 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
     if (ISFLAG(file1->flags, FF_HASH_FULL)) return;
     file1->filehash_partial = file2->filehash_partial;
     file1->filehash = file2->filehash;
+    file1->filehash_hi = file2->filehash_hi;
     SETFLAG(file1->flags, FF_HASH_PARTIAL | FF_HASH_FULL);
 #ifndef NO_HASHDB
     dirty1 = 1;
@@ -49,6 +64,7 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
   } else if (ISFLAG(file1->flags, FF_HASH_PARTIAL)) {
     if (ISFLAG(file2->flags, FF_HASH_PARTIAL)) return;
     file2->filehash_partial = file1->filehash_partial;
+    file2->filehash_hi = file1->filehash_hi;
     SETFLAG(file2->flags, FF_HASH_PARTIAL);
 #ifndef NO_HASHDB
     dirty2 = 1;
@@ -56,6 +72,7 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
   } else if (ISFLAG(file2->flags, FF_HASH_PARTIAL)) {
     if (ISFLAG(file1->flags, FF_HASH_PARTIAL)) return;
     file1->filehash_partial = file2->filehash_partial;
+    file1->filehash_hi = file2->filehash_hi;
     SETFLAG(file1->flags, FF_HASH_PARTIAL);
 #ifndef NO_HASHDB
     dirty1 = 1;
@@ -74,6 +91,76 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
 }
 
 
+/* Get a file's partial hash; small files are read into memory at the same
+ * time so that they never need to be opened again
+ * Returns nonzero if the file can't be hashed */
+static int get_partial_hash(file_t * const restrict file)
+{
+  const uint64_t * restrict filehash;
+
+#ifndef NO_SMALLFILE
+  if (file->size <= SMALL_FILE_SIZE) {
+    const int result = get_small_file(file, hash_algo);
+    if (result == 0) return 0;
+    if (result < 0) return 1;
+    /* The small file pool is full; hash the file normally */
+  }
+#endif
+  filehash = get_filehash(file, PARTIAL_HASH_SIZE, hash_algo);
+  if (filehash == NULL) return 1;
+  file->filehash_partial = *filehash;
+  /* The partial hash covers all of a small file */
+  if (file->size <= PARTIAL_HASH_SIZE) file->filehash_hi = filehash[1];
+  SETFLAG(file->flags, FF_HASH_PARTIAL);
+  return 0;
+}
+
+
+#ifndef NO_SMALLFILE
+/* Compare the pooled contents of two small files of the same size like
+ * memcmp(). If either file can't be held in memory the files are treated
+ * as equal and confirmmatch() makes the final decision. */
+static int compare_small_files(file_t * const restrict file1, file_t * const restrict file2)
+{
+  /* Contents may be missing if partial hashes came from the hash database */
+  if (file1->content == NULL && get_small_file(file1, hash_algo) != 0) return 0;
+  if (file2->content == NULL && get_small_file(file2, hash_algo) != 0) return 0;
+  return memcmp(file1->content, file2->content, (size_t)file1->size);
+}
+#endif
+
+
+/* Compare the progressive hash tiers of two files, stopping at the first
+ * tier that differs. The result is stored like HASH_COMPARE() in *cmpresult.
+ * Returns nonzero if hashing fails. */
+static int compare_hash_tiers(file_t * const restrict file1, file_t * const restrict file2, int * const restrict cmpresult)
+{
+  const unsigned int count = hash_tier_count(file1->size);
+  const uint64_t * restrict hash1;
+  const uint64_t * restrict hash2;
+
+  LOUD(fprintf(stderr, "compare_hash_tiers('%s', '%s') %u tiers\n", file1->d_name, file2->d_name, count));
+
+  for (unsigned int tier = 1; tier <= count; tier++) {
+    hash1 = get_filehash_tier(file1, tier, hash_algo);
+    if (hash1 == NULL) return 1;
+    hash2 = get_filehash_tier(file2, tier, hash_algo);
+    if (hash2 == NULL) return 1;
+
+    *cmpresult = HASH_COMPARE(*hash1, *hash2);
+    if (*cmpresult != 0) {
+      LOUD(fprintf(stderr, "compare_hash_tiers: tier %u of %u differs\n", tier, count));
+      DBG(if (tier < count) tier_elim++;)
+      return 0;
+    }
+  }
+  /* The last tier is the full hash; 128-bit hashes have an upper half too */
+  *cmpresult = HASH_COMPARE(file1->filehash_hi, file2->filehash_hi);
+  DBG(full_hash++;)
+  return 0;
+}
+
+
 void registerpair(file_t **matchlist, file_t *newmatch, int (*comparef)(file_t *f1, file_t *f2))
 {
   file_t *traverse;
@@ -213,24 +300,25 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     if (ISFLAG(p_flags, PF_EARLYMATCH)) printf("Early match check passed:\n   %s\n   %s\n\n", file->d_name, tree->file->d_name);
 
     LOUD(fprintf(stderr, "checkmatch: starting file data comparisons\n"));
+#ifdef HAVE_EXTENTS
+    /* Files already sharing all of their data on disk (reflinks or earlier
+     * dedupe) are duplicates without reading them */
+    if (cantmatch == 0 && extents_shared(file, tree->file)) {
+      LOUD(fprintf(stderr, "checkmatch: files share all data extents\n"));
+      DBG(extent_match++;)
+      return &tree->file;
+    }
+#endif
     /* Attempt to exclude files quickly with partial file hashing */
     if (!ISFLAG(tree->file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(tree->file, PARTIAL_HASH_SIZE, hash_algo);
-      if (filehash == NULL) return NULL;
-
-      tree->file->filehash_partial = *filehash;
-      SETFLAG(tree->file->flags, FF_HASH_PARTIAL);
+      if (get_partial_hash(tree->file) != 0) return NULL;
 #ifndef NO_HASHDB
       dirtytree = 1;
 #endif
     }
 
     if (!ISFLAG(file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(file, PARTIAL_HASH_SIZE, hash_algo);
-      if (filehash == NULL) return NULL;
-
-      file->filehash_partial = *filehash;
-      SETFLAG(file->flags, FF_HASH_PARTIAL);
+      if (get_partial_hash(file) != 0) return NULL;
 #ifndef NO_HASHDB
       dirtyfile = 1;
 #endif
@@ -265,7 +353,40 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 #endif
         DBG(small_file++;)
       }
+      /* The partial hash of a small file is its full hash */
+      if (cmpresult == 0 && file->size <= PARTIAL_HASH_SIZE)
+        cmpresult = HASH_COMPARE(file->filehash_hi, tree->file->filehash_hi);
+#ifndef NO_SMALLFILE
+      /* Small files are compared byte-for-byte right here instead of being
+       * opened again later by confirmmatch() */
+      if (cmpresult == 0 && file->size <= SMALL_FILE_SIZE) {
+        cmpresult = compare_small_files(file, tree->file);
+        LOUD(if (cmpresult) fprintf(stderr, "checkmatch: small file contents do not match\n"));
+      }
+#endif
+    } else if (cmpresult == 0 && cantmatch == 0
+        && ISFLAG(file->flags, FF_HASH_PAIR) && ISFLAG(tree->file->flags, FF_HASH_PAIR)
+        && !ISFLAG(file->flags, FF_HASH_FULL) && !ISFLAG(tree->file->flags, FF_HASH_FULL)) {
+      /* No other file can match these two, so compare them directly; this
+       * reads each file once instead of once to hash and again to confirm */
+      if (hash_compare_pair(file, tree->file, hash_algo, &cmpresult) != 0) return NULL;
+      LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: pair contents match\n"));
+      LOUD(if (cmpresult) fprintf(stderr, "checkmatch: pair contents do not match\n"));
+      DBG(pair_compare++;)
+#ifndef NO_HASHDB
+      if (cmpresult == 0) {
+        dirtyfile = 1;
+        dirtytree = 1;
+      }
+#endif
+    } else if (cmpresult == 0 && !ISFLAG(flags, F_HASHDB)) {
+      /* Hash progressively so that files which differ early are not read fully */
+      if (compare_hash_tiers(file, tree->file, &cmpresult) != 0) return NULL;
+      LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: all hash tiers match\n"));
+      LOUD(if (cmpresult) fprintf(stderr, "checkmatch: hash tiers do not match\n"));
     } else if (cmpresult == 0) {
+      /* Hash database entries only carry full hashes, so tiers can't be used
+       * without breaking the ordering of the file tree */
 //      if (ISFLAG(flags, F_SKIPHASH)) {
 //        LOUD(fprintf(stderr, "checkmatch: skipping full file hashes (F_SKIPMATCH)\n"));
 //      } else {
@@ -274,7 +395,8 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
           filehash = get_filehash(tree->file, 0, hash_algo);
           if (filehash == NULL) return NULL;
 
-          tree->file->filehash = *filehash;
+          tree->file->filehash = filehash[0];
+          tree->file->filehash_hi = filehash[1];
           SETFLAG(tree->file->flags, FF_HASH_FULL);
 #ifndef NO_HASHDB
 	  dirtytree = 1;
@@ -285,7 +407,8 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
           filehash = get_filehash(file, 0, hash_algo);
           if (filehash == NULL) return NULL;
 
-          file->filehash = *filehash;
+          file->filehash = filehash[0];
+          file->filehash_hi = filehash[1];
           SETFLAG(file->flags, FF_HASH_FULL);
 #ifndef NO_HASHDB
 	  dirtyfile = 1;
@@ -294,6 +417,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 
         /* Full file hash comparison */
         cmpresult = HASH_COMPARE(file->filehash, tree->file->filehash);
+        if (cmpresult == 0) cmpresult = HASH_COMPARE(file->filehash_hi, tree->file->filehash_hi);
         LOUD(if (!cmpresult) fprintf(stderr, "checkmatch: full hashes match\n"));
         LOUD(if (cmpresult) fprintf(stderr, "checkmatch: full hashes do not match\n"));
         DBG(full_hash++);
@@ -359,55 +483,79 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 }
 
 
+/* Quick or partial-only compare will never run confirmmatch()
+ * Also skip match confirmation for hard-linked files, for small
+ * files and pairs that checkmatch() already compared, for files
+ * with matching 128-bit full hashes in --hash-verify mode, and for
+ * files sharing all data extents on disk
+ * Returns the FF_MATCH_* flag for how the match was made, or 0 if
+ * confirmmatch() is still needed */
+uint32_t match_shortcut(file_t * const restrict file1, file_t * const restrict file2)
+{
+  if (ISFLAG(flags, F_QUICKCOMPARE)) return FF_MATCH_HASH;
+  if (ISFLAG(flags, F_PARTIALONLY)) return FF_MATCH_PARTIAL;
+  if (ISFLAG(file1->flags, FF_PAIR_MATCHED) && ISFLAG(file2->flags, FF_PAIR_MATCHED)) return FF_MATCH_BYTES;
+#ifndef NO_SMALLFILE
+  if (file1->content != NULL && file2->content != NULL) return FF_MATCH_BYTES;
+#endif
+#ifndef NO_HARDLINKS
+  if (ISFLAG(flags, F_CONSIDERHARDLINKS) && file1->inode == file2->inode && file1->device == file2->device) return FF_MATCH_LINK;
+#endif
+  if (ISFLAG(flags, F_HASHVERIFY) && HASH_ALGO_WIDE(hash_algo)
+      && ISFLAG(file1->flags, FF_HASH_FULL) && ISFLAG(file2->flags, FF_HASH_FULL)) return FF_MATCH_HASH;
+#ifdef HAVE_EXTENTS
+  if (extents_shared(file1, file2)) return FF_MATCH_EXTENTS;
+#endif
+  return 0;
+}
+
+
 /* Do a byte-by-byte comparison in case two different files produce the
    same signature. Unlikely, but better safe than sorry. */
-int confirmmatch(const char * const restrict file1, const char * const restrict file2, const off_t size)
+int confirmmatch(const file_t * const restrict file1, const file_t * const restrict file2)
 {
-  static char *c1 = NULL, *c2 = NULL;
-  FILE *fp1, *fp2;
-  size_t r1, r2;
+  const off_t size = file1->size;
+  char *c1, *c2;
+  size_t chunk;
+  int fd1, fd2;
+  ssize_t r1, r2;
   off_t bytes = 0;
   int retval = 0;
 
-  if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("confirmmatch()");
+  if (unlikely(file1 == NULL || file2 == NULL || file1->d_name == NULL || file2->d_name == NULL)) jc_nullptr("confirmmatch()");
   LOUD(fprintf(stderr, "confirmmatch running\n"));
 
-  if (unlikely(c1 == NULL || c2 == NULL)) {
-    c1 = (char *)malloc(auto_chunk_size);
-    c2 = (char *)malloc(auto_chunk_size);
-  }
-  if (unlikely(c1 == NULL || c2 == NULL)) jc_oom("confirmmatch() buffers");
-
-  fp1 = jc_fopen(file1, JC_FILE_MODE_RDONLY_SEQ);
-  fp2 = jc_fopen(file2, JC_FILE_MODE_RDONLY_SEQ);
-  if (fp1 == NULL) {
-    if (fp2 != NULL) fclose(fp2);
-    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file1);)
-    goto different;
+  c1 = (char *)rawio_buffer(0);
+  c2 = (char *)rawio_buffer(1);
+
+  fd1 = rawio_open(file1->d_name);
+  if (fd1 == -1) {
+    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file1->d_name);)
+    return 1;
   }
-  if (fp2 == NULL) {
-    if (fp1 != NULL) fclose(fp1);
-    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file2);)
-    goto different;
+  fd2 = rawio_open(file2->d_name);
+  if (fd2 == -1) {
+    rawio_close(fd1);
+    LOUD(fprintf(stderr, "confirmmatch: warning: file open failed ('%s')\n", file2->d_name);)
+    return 1;
   }
 
-  fseek(fp1, 0, SEEK_SET);
-  fseek(fp2, 0, SEEK_SET);
-#ifdef __linux__
-  /* Tell Linux we will accees sequentially and soon */
-  posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_WILLNEED);
-  posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
+  /* Tell the OS we will access sequentially and soon */
+  rawio_advise(fd1, file1->device, 0, size);
+  rawio_advise(fd2, file2->device, 0, size);
+
+  /* Both files are read in pieces of the same size */
+  chunk = rawio_chunk_size(file1->device);
+  if (file2->device != file1->device && rawio_chunk_size(file2->device) < chunk) chunk = rawio_chunk_size(file2->device);
 
   do {
     if (interrupt) goto different;
-    r1 = fread(c1, sizeof(char), auto_chunk_size, fp1);
-    r2 = fread(c2, sizeof(char), auto_chunk_size, fp2);
+    r1 = rawio_read_dev(file1->device, fd1, c1, chunk, bytes);
+    r2 = rawio_read_dev(file2->device, fd2, c2, chunk, bytes);
 
+    if (r1 < 0 || r2 < 0) goto different; /* read error */
     if (r1 != r2) goto different; /* file lengths are different */
-    if (memcmp (c1, c2, r1)) goto different; /* file contents are different */
+    if (!chunk_equal(c1, c2, (size_t)r1)) goto different; /* file contents are different */
 
     bytes += (off_t)r1;
     if (jc_alarm_ring != 0) {
@@ -423,7 +571,6 @@ different:
   retval = 1;
 
 finish_confirm:
-//  free(c1); free(c2);
-  fclose(fp1); fclose(fp2);
+  rawio_close(fd1); rawio_close(fd2);
   return retval;
 }
@@ -0,0 +1,277 @@
+/* jdupes per-device parallel partial hashing
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_THREADS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef __linux__
+ #include <string.h>
+ #include <sys/stat.h>
+ #include <sys/sysmacros.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "filehash.h"
+#ifndef NO_HASHDB
+ #include "hashdb.h"
+#endif
+#include "interrupt.h"
+#include "progress.h"
+#include "prehash.h"
+
+/* Before the main scan, the first block of every file that shares its size
+ * with another file is hashed by a pool of threads for each device. Every
+ * device has its own queue and thread count, so a slow rotating disk never
+ * holds up work on a fast SSD and vice versa. The main scan then finds the
+ * partial hashes (and small file contents) already loaded. Tier and full
+ * hashing and match confirmation are not threaded; they run in the main
+ * scan in the order of the match tree. */
+
+unsigned int io_threads_rotational = PREHASH_THREADS_ROTATIONAL;
+unsigned int io_threads_solid = PREHASH_THREADS_SOLID;
+
+struct devqueue {
+  file_t **files;
+  size_t count;
+  size_t next;           /* Next file to hand out; protected by lock */
+  pthread_mutex_t lock;
+  dev_t device;
+  unsigned int threads;
+};
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int running = 0;
+static uintmax_t prehashed = 0;
+
+
+/* Parse the --io-threads option: "N" for all devices, or "ROT,SOLID" for
+ * rotating and non-rotating devices separately. Returns nonzero if invalid */
+int set_io_threads(const char * const restrict arg)
+{
+  char *end;
+  unsigned long rot, solid;
+
+  if (unlikely(arg == NULL)) jc_nullptr("set_io_threads()");
+  rot = strtoul(arg, &end, 10);
+  if (end == arg) return 1;
+  if (*end == ',') {
+    const char * const next = end + 1;
+    solid = strtoul(next, &end, 10);
+    if (end == next) return 1;
+  } else solid = rot;
+  if (*end != '\0' || rot > PREHASH_THREADS_MAX || solid > PREHASH_THREADS_MAX) return 1;
+  io_threads_rotational = (unsigned int)rot;
+  io_threads_solid = (unsigned int)solid;
+  return 0;
+}
+
+
+#ifdef __linux__
+/* Read a block device's rotational flag: '1', '0', or EOF if unknown.
+ * Partitions keep their queue settings in the parent disk's directory */
+static int rotational(const unsigned int maj, const unsigned int min)
+{
+  char path[64];
+  FILE *fp;
+  int c = EOF;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", maj, min);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", maj, min);
+    fp = fopen(path, "r");
+  }
+  if (fp != NULL) {
+    c = fgetc(fp);
+    fclose(fp);
+  }
+  return c;
+}
+
+
+/* btrfs and some other filesystems report an anonymous device number with
+ * no block device behind it; find the device they were mounted from */
+static int mount_source_rotational(const dev_t device)
+{
+  char line[PATHBUF_SIZE];
+  char devnum[32], source[256];
+  FILE *fp;
+  int c = EOF;
+
+  snprintf(devnum, sizeof(devnum), "%u:%u", major(device), minor(device));
+  fp = fopen("/proc/self/mountinfo", "r");
+  if (fp == NULL) return EOF;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char field[32];
+    const char *sep;
+    struct stat st;
+
+    /* "ID PARENT MAJ:MIN ROOT MOUNTPOINT ... - FSTYPE SOURCE OPTIONS" */
+    if (sscanf(line, "%*s %*s %31s", field) != 1 || strcmp(field, devnum) != 0) continue;
+    sep = strstr(line, " - ");
+    if (sep == NULL || sscanf(sep + 3, "%*s %255s", source) != 1) continue;
+    if (strncmp(source, "/dev/", 5) != 0 || stat(source, &st) != 0 || !S_ISBLK(st.st_mode)) continue;
+    c = rotational(major(st.st_rdev), minor(st.st_rdev));
+    if (c != EOF) break;
+  }
+  fclose(fp);
+  return c;
+}
+#endif /* __linux__ */
+
+
+/* Pick the number of I/O threads for a device */
+static unsigned int device_threads(const dev_t device)
+{
+#ifdef __linux__
+  int c = rotational(major(device), minor(device));
+
+  if (c == EOF) c = mount_source_rotational(device);
+  LOUD(fprintf(stderr, "device_threads: device %u:%u rotational '%c'\n", major(device), minor(device), (c == EOF) ? '?' : c);)
+  if (c == '0') return io_threads_solid;
+  /* Network filesystems and devices that can't be identified may sit on
+   * rotating disks, which only slow down when read in parallel */
+  return io_threads_rotational;
+#else
+  (void)device;
+  return io_threads_solid;
+#endif /* __linux__ */
+}
+
+
+static void *prehash_worker(void *arg)
+{
+  struct devqueue * const restrict queue = (struct devqueue *)arg;
+  size_t i;
+
+  while (interrupt == 0) {
+    pthread_mutex_lock(&queue->lock);
+    i = queue->next++;
+    pthread_mutex_unlock(&queue->lock);
+    if (i >= queue->count) break;
+    prehash_file(queue->files[i], hash_algo);
+    pthread_mutex_lock(&done_lock);
+    prehashed++;
+    pthread_mutex_unlock(&done_lock);
+  }
+
+  pthread_mutex_lock(&done_lock);
+  running--;
+  pthread_cond_signal(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+  return NULL;
+}
+
+
+/* Hash the first block of all files that will be compared, using a separate
+ * queue and thread pool for each device. The order array must come from
+ * build_scan_order(): grouped by device and with FF_SIZE_PEER set. */
+void prehash_files(file_t ** const restrict order)
+{
+  file_t **todo;
+  struct devqueue *queues;
+  pthread_t *threads;
+  size_t count = 0, total = 0, qcount = 0, tcount = 0, i;
+
+  if (unlikely(order == NULL)) jc_nullptr("prehash_files()");
+
+  for (i = 0; order[i] != NULL; i++) {
+    if (ISFLAG(order[i]->flags, FF_SIZE_PEER) && !ISFLAG(order[i]->flags, FF_HASH_PARTIAL)) count++;
+    if (i == 0 || order[i]->device != order[i - 1]->device) qcount++;
+  }
+  if (count == 0) return;
+
+  todo = (file_t **)malloc(sizeof(file_t *) * count);
+  queues = (struct devqueue *)calloc(qcount, sizeof(struct devqueue));
+  if (todo == NULL || queues == NULL) goto cleanup;
+
+  /* Split the work by device, keeping the scan order within each device */
+  qcount = 0;
+  for (i = 0; order[i] != NULL; i++) {
+    if (!ISFLAG(order[i]->flags, FF_SIZE_PEER) || ISFLAG(order[i]->flags, FF_HASH_PARTIAL)) continue;
+    if (qcount == 0 || order[i]->device != queues[qcount - 1].device) {
+      queues[qcount].files = todo + total;
+      queues[qcount].device = order[i]->device;
+      qcount++;
+    }
+    queues[qcount - 1].count++;
+    todo[total++] = order[i];
+  }
+
+  for (i = 0; i < qcount; i++) {
+    queues[i].threads = device_threads(queues[i].device);
+    if (queues[i].threads > queues[i].count) queues[i].threads = (unsigned int)queues[i].count;
+    pthread_mutex_init(&queues[i].lock, NULL);
+    tcount += queues[i].threads;
+    LOUD(fprintf(stderr, "prehash_files: device %" PRIuMAX ": %" PRIuMAX " files, %u threads\n",
+          (uintmax_t)queues[i].device, (uintmax_t)queues[i].count, queues[i].threads);)
+  }
+  if (tcount == 0) goto cleanup_locks;
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * tcount);
+  if (threads == NULL) goto cleanup_locks;
+
+  /* The workers only call the hash functions; main() has already picked
+   * the XXH3 code for this CPU, so nothing is written behind their backs */
+  prehashed = 0;
+  tcount = 0;
+  for (i = 0; i < qcount; i++) {
+    for (unsigned int t = 0; t < queues[i].threads; t++) {
+      pthread_mutex_lock(&done_lock);
+      running++;
+      pthread_mutex_unlock(&done_lock);
+      if (pthread_create(&threads[tcount], NULL, prehash_worker, &queues[i]) != 0) {
+        /* Anything left undone is hashed by the main scan */
+        pthread_mutex_lock(&done_lock);
+        running--;
+        pthread_mutex_unlock(&done_lock);
+        break;
+      }
+      tcount++;
+    }
+  }
+
+  /* Wait for all devices to finish, updating progress along the way */
+  pthread_mutex_lock(&done_lock);
+  while (running > 0) {
+    struct timespec ts;
+
+    if (jc_alarm_ring != 0 && !ISFLAG(flags, F_HIDEPROGRESS)) {
+      jc_alarm_ring = 0;
+      update_phase2_progress("prehash", (int)((prehashed * 100) / total));
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_nsec >= 900000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 900000000;
+    } else ts.tv_nsec += 100000000;
+    pthread_cond_timedwait(&done_cond, &done_lock, &ts);
+  }
+  pthread_mutex_unlock(&done_lock);
+  for (i = 0; i < tcount; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  LOUD(fprintf(stderr, "prehash_files: hashed %" PRIuMAX " of %" PRIuMAX " files on %" PRIuMAX " devices\n",
+        prehashed, (uintmax_t)total, (uintmax_t)qcount);)
+
+#ifndef NO_HASHDB
+  if (ISFLAG(flags, F_HASHDB)) {
+    for (i = 0; i < total; i++)
+      if (ISFLAG(todo[i]->flags, FF_HASH_PARTIAL)) add_hashdb_entry(NULL, 0, todo[i]);
+  }
+#endif
+
+cleanup_locks:
+  for (i = 0; i < qcount; i++) pthread_mutex_destroy(&queues[i].lock);
+cleanup:
+  free(todo);
+  free(queues);
+  return;
+}
+
+#endif /* NO_THREADS */
@@ -0,0 +1,34 @@
+/* jdupes per-device parallel partial hashing
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_PREHASH_H
+#define JDUPES_PREHASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NO_THREADS
+
+/* Default I/O threads per device; rotating disks want one stream so that
+ * the heads follow the scan order, while SSDs need many requests in flight */
+#ifndef PREHASH_THREADS_ROTATIONAL
+ #define PREHASH_THREADS_ROTATIONAL 1
+#endif
+#ifndef PREHASH_THREADS_SOLID
+ #define PREHASH_THREADS_SOLID 16
+#endif
+#define PREHASH_THREADS_MAX 256
+
+extern unsigned int io_threads_rotational, io_threads_solid;
+
+int set_io_threads(const char * const restrict arg);
+void prehash_files(file_t ** const restrict order);
+
+#endif /* NO_THREADS */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_PREHASH_H */
@@ -0,0 +1,470 @@
+/* jdupes raw file data reading
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#ifndef NO_THREADS
+ #include <pthread.h>
+#endif
+#ifdef ON_WINDOWS
+ #include <io.h>
+ #include <malloc.h>
+#endif
+
+#include <libjodycode.h>
+
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "rawio.h"
+#ifdef RAWIO_TUNE
+ #include <time.h>
+#endif
+
+/* All file data used for hashing and comparison is read with positioned
+ * reads on plain descriptors into a few aligned buffers that live for the
+ * whole run. This avoids the stdio buffer copy and the seek before every
+ * read, and every caller knows exactly which offset it is reading. */
+
+static void *buffers[RAWIO_BUFFERS];
+
+#ifdef RAWIO_TUNE
+/* Read size tuning state for one device */
+struct devtune {
+  dev_t device;
+  size_t size;          /* Size being timed, or the chosen size once settled */
+  int settled;
+  uint64_t bytes;       /* Data read and time taken at the current size */
+  uint64_t nsec;
+  size_t best_size;
+  double best_rate;
+};
+
+int rawio_tune_enabled = 1;
+static struct devtune *tunes = NULL;
+static unsigned int tune_count = 0, tune_alloc = 0;
+ #ifndef NO_THREADS
+static pthread_mutex_t tune_lock = PTHREAD_MUTEX_INITIALIZER;
+  #define TUNE_LOCK() pthread_mutex_lock(&tune_lock)
+  #define TUNE_UNLOCK() pthread_mutex_unlock(&tune_lock)
+ #else
+  #define TUNE_LOCK()
+  #define TUNE_UNLOCK()
+ #endif
+#endif /* RAWIO_TUNE */
+
+/* Sequential read stream (see rawio_stream_start()); only one at a time */
+static struct {
+  int fd;
+  dev_t device;
+  off_t offset;         /* Next offset to be read */
+  off_t end;
+  size_t chunk;         /* Read size, fixed for the whole stream */
+  void *buf[RAWIO_READAHEAD_DEPTH];
+  size_t len[RAWIO_READAHEAD_DEPTH];
+  unsigned int head;    /* Buffer the consumer is using or will use next */
+  unsigned int filled;  /* Buffers filled by the reader and not yet released */
+  int holding;          /* Consumer still holds buffer 'head' */
+  int done;             /* Reader reached the end or hit an error */
+  int error;
+#ifndef NO_THREADS
+  int threaded;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} stream;
+
+
+/* Open a file for reading; returns -1 with errno set on failure */
+int rawio_open(const char * const restrict path)
+{
+#ifdef ON_WINDOWS
+  /* Go through jc_fopen() so that Unicode path handling is the same as
+   * everywhere else, then keep only a descriptor for the data */
+  FILE *fp;
+  int fd;
+
+  fp = jc_fopen(path, JC_FILE_MODE_RDONLY_SEQ);
+  if (fp == NULL) return -1;
+  fd = _dup(_fileno(fp));
+  fclose(fp);
+  return fd;
+#else
+  int fd;
+
+  do fd = open(path, O_RDONLY);
+  while (fd == -1 && errno == EINTR);
+  return fd;
+#endif /* ON_WINDOWS */
+}
+
+
+/* Read 'count' bytes at 'offset' unless the end of the file is reached first
+ * Returns the number of bytes read or -1 on error */
+ssize_t rawio_read(const int fd, void * const restrict buf, const size_t count, const off_t offset)
+{
+  size_t done = 0;
+
+  while (done < count) {
+#ifdef ON_WINDOWS
+    const size_t want = ((count - done) > 0x40000000U) ? 0x40000000U : (count - done);
+    int result;
+
+    if (_lseeki64(fd, (__int64)offset + (__int64)done, SEEK_SET) == -1) return -1;
+    result = _read(fd, (char *)buf + done, (unsigned int)want);
+#else
+    const ssize_t result = pread(fd, (char *)buf + done, count - done, offset + (off_t)done);
+#endif /* ON_WINDOWS */
+
+    if (unlikely(result < 0)) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (result == 0) break;
+    done += (size_t)result;
+  }
+  return (ssize_t)done;
+}
+
+
+#ifdef RAWIO_TUNE
+/* Find or add the tuning state for a device; call with tune_lock held */
+static struct devtune *get_devtune(const dev_t device)
+{
+  for (unsigned int i = 0; i < tune_count; i++)
+    if (tunes[i].device == device) return &tunes[i];
+  if (tune_count == tune_alloc) {
+    struct devtune *newtunes;
+
+    tune_alloc = (tune_alloc == 0) ? 8 : tune_alloc * 2;
+    newtunes = (struct devtune *)realloc(tunes, sizeof(struct devtune) * tune_alloc);
+    if (unlikely(newtunes == NULL)) jc_oom("get_devtune()");
+    tunes = newtunes;
+  }
+  memset(&tunes[tune_count], 0, sizeof(struct devtune));
+  tunes[tune_count].device = device;
+  tunes[tune_count].size = RAWIO_TUNE_MIN;
+  return &tunes[tune_count++];
+}
+
+
+/* Account a full-size read to its device's tuning state; once enough data
+ * has been read at one size, move on to the next or settle on the best.
+ * A larger size must be clearly faster to be chosen since bigger reads
+ * use more memory and make progress and interrupts less responsive. */
+static void tune_sample(const dev_t device, const size_t count, const uint64_t nsec)
+{
+  struct devtune *t;
+
+  TUNE_LOCK();
+  t = get_devtune(device);
+  if (t->settled != 0 || count != t->size) goto done;
+  t->bytes += count;
+  t->nsec += nsec;
+  if (t->bytes >= RAWIO_TUNE_BYTES) {
+    const double rate = (double)t->bytes / (double)(t->nsec + 1);
+
+    if (t->best_size == 0 || rate > t->best_rate * 1.05) {
+      t->best_rate = rate;
+      t->best_size = t->size;
+    }
+    LOUD(fprintf(stderr, "tune_sample: device %" PRIuMAX ": %" PRIuMAX " KiB reads at %.0f MiB/s\n",
+          (uintmax_t)device, (uintmax_t)(t->size >> 10), rate * 1000000000.0 / 1048576.0);)
+    t->bytes = 0;
+    t->nsec = 0;
+    if (t->size >= RAWIO_TUNE_MAX) {
+      t->size = t->best_size;
+      t->settled = 1;
+    } else t->size <<= 1;
+  }
+done:
+  TUNE_UNLOCK();
+  return;
+}
+
+
+/* Will reading 'len' bytes from a device time reads at the size being
+ * measured? Shorter ranges are never read in full-size pieces */
+static int tuning(const dev_t device, const off_t len)
+{
+  const struct devtune *t;
+  int result;
+
+  if (rawio_tune_enabled == 0) return 0;
+  TUNE_LOCK();
+  t = get_devtune(device);
+  result = !t->settled && len >= (off_t)t->size;
+  TUNE_UNLOCK();
+  return result;
+}
+#endif /* RAWIO_TUNE */
+
+
+/* Read size to use for large sequential reads from a device. Callers get
+ * this once per file so that a new size only takes effect between files */
+size_t rawio_chunk_size(const dev_t device)
+{
+#ifdef RAWIO_TUNE
+  size_t size;
+
+  if (rawio_tune_enabled == 0) return auto_chunk_size;
+  TUNE_LOCK();
+  size = get_devtune(device)->size;
+  TUNE_UNLOCK();
+  return size;
+#else
+  (void)device;
+  return auto_chunk_size;
+#endif /* RAWIO_TUNE */
+}
+
+
+/* rawio_read() that also measures the throughput of the device */
+ssize_t rawio_read_dev(const dev_t device, const int fd, void * const restrict buf, const size_t count, const off_t offset)
+{
+#ifdef RAWIO_TUNE
+  struct timespec start, end;
+  ssize_t result;
+
+  if (rawio_tune_enabled == 0) return rawio_read(fd, buf, count, offset);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  result = rawio_read(fd, buf, count, offset);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (result == (ssize_t)count)
+    tune_sample(device, count, (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec);
+  return result;
+#else
+  (void)device;
+  return rawio_read(fd, buf, count, offset);
+#endif /* RAWIO_TUNE */
+}
+
+
+#if defined DEBUG && defined RAWIO_TUNE
+/* Show the read size chosen for each device (-D) */
+void rawio_print_tuning(void)
+{
+  if (rawio_tune_enabled == 0) return;
+  for (unsigned int i = 0; i < tune_count; i++)
+    fprintf(stderr, "I/O read size for device %" PRIuMAX ": %" PRIuMAX " KiB (%s)\n", (uintmax_t)tunes[i].device,
+        (uintmax_t)(tunes[i].size >> 10), tunes[i].settled ? "measured" : "still measuring");
+  return;
+}
+#endif
+
+
+/* Tell the kernel that a range of a file will be read sequentially soon.
+ * This is skipped for ranges whose reads are timed to measure a device's
+ * read size, so that they wait for the device rather than copy data the
+ * kernel already read ahead */
+void rawio_advise(const int fd, const dev_t device, const off_t offset, const off_t len)
+{
+#ifdef __linux__
+ #ifdef RAWIO_TUNE
+  if (tuning(device, len)) return;
+ #else
+  (void)device;
+ #endif
+  posix_fadvise(fd, offset, len, POSIX_FADV_SEQUENTIAL);
+  posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+  (void)fd; (void)device; (void)offset; (void)len;
+#endif /* __linux__ */
+  return;
+}
+
+
+void rawio_close(const int fd)
+{
+  if (fd >= 0) close(fd);
+  return;
+}
+
+
+/* Allocate an aligned buffer; these are never freed */
+static void *chunk_alloc(const size_t size)
+{
+  void *p;
+
+#ifdef ON_WINDOWS
+  p = _aligned_malloc(size, RAWIO_ALIGN);
+#else
+  if (posix_memalign(&p, RAWIO_ALIGN, size) != 0) p = NULL;
+#endif /* ON_WINDOWS */
+  if (unlikely(p == NULL)) jc_oom("rawio chunk_alloc()");
+  return p;
+}
+
+
+/* Size of all buffers: big enough for any read size rawio_chunk_size() gives */
+static size_t buffer_size(void)
+{
+#ifdef RAWIO_TUNE
+  if (rawio_tune_enabled != 0 && auto_chunk_size < RAWIO_TUNE_MAX) return RAWIO_TUNE_MAX;
+#endif
+  return auto_chunk_size;
+}
+
+
+/* Get one of the shared aligned read buffers, allocating it on first use.
+ * These are only used by the main thread and hold up to the size returned
+ * by rawio_chunk_size() for any device. */
+void *rawio_buffer(const unsigned int which)
+{
+  if (unlikely(which >= RAWIO_BUFFERS)) jc_nullptr("rawio_buffer()");
+  if (unlikely(buffers[which] == NULL)) buffers[which] = chunk_alloc(buffer_size());
+  return buffers[which];
+}
+
+
+/* Read the next chunk of the stream into a buffer; returns 0 on success,
+ * 1 at the end of the range or -1 if the file can't be read in full */
+static int stream_fill(const unsigned int slot)
+{
+  const off_t remain = stream.end - stream.offset;
+  const size_t want = (remain >= (off_t)stream.chunk) ? stream.chunk : (size_t)remain;
+
+  if (remain <= 0) return 1;
+  if (rawio_read_dev(stream.device, stream.fd, stream.buf[slot], want, stream.offset) != (ssize_t)want) return -1;
+  stream.len[slot] = want;
+  stream.offset += (off_t)want;
+  return 0;
+}
+
+
+#ifndef NO_THREADS
+/* Keep the buffers ahead of the consumer filled until the end of the range */
+static void *stream_reader(void *arg)
+{
+  unsigned int slot;
+  int result;
+
+  (void)arg;
+  pthread_mutex_lock(&stream.lock);
+  while (1) {
+    while (stream.filled == RAWIO_READAHEAD_DEPTH && stream.stop == 0)
+      pthread_cond_wait(&stream.cond, &stream.lock);
+    if (stream.stop != 0) break;
+    slot = (stream.head + stream.filled) % RAWIO_READAHEAD_DEPTH;
+    /* The slot is not visible to the consumer until 'filled' counts it */
+    pthread_mutex_unlock(&stream.lock);
+    result = stream_fill(slot);
+    pthread_mutex_lock(&stream.lock);
+    if (result != 0) {
+      if (result < 0) stream.error = 1;
+      break;
+    }
+    stream.filled++;
+    pthread_cond_signal(&stream.cond);
+  }
+  stream.done = 1;
+  pthread_cond_signal(&stream.cond);
+  pthread_mutex_unlock(&stream.lock);
+  return NULL;
+}
+#endif /* NO_THREADS */
+
+
+/* Start reading a file sequentially from 'offset' up to 'end'. Long ranges
+ * are read ahead by another thread so that the disk stays busy while the
+ * caller hashes the data; rawio_stream_stop() must be called when done. */
+void rawio_stream_start(const int fd, const dev_t device, const off_t offset, const off_t end)
+{
+  if (unlikely(stream.buf[0] == NULL))
+    for (unsigned int i = 0; i < RAWIO_READAHEAD_DEPTH; i++) stream.buf[i] = chunk_alloc(buffer_size());
+
+  stream.fd = fd;
+  stream.device = device;
+  stream.offset = offset;
+  stream.end = end;
+  stream.chunk = rawio_chunk_size(device);
+  stream.head = 0;
+  stream.filled = 0;
+  stream.holding = 0;
+  stream.done = 0;
+  stream.error = 0;
+  if (end > offset) rawio_advise(fd, device, offset, end - offset);
+#ifndef NO_THREADS
+  stream.stop = 0;
+  stream.threaded = 0;
+  if (end - offset >= (off_t)stream.chunk * RAWIO_READAHEAD_MIN_CHUNKS) {
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.cond, NULL);
+    if (pthread_create(&stream.thread, NULL, stream_reader, NULL) == 0) stream.threaded = 1;
+    else {
+      pthread_mutex_destroy(&stream.lock);
+      pthread_cond_destroy(&stream.cond);
+    }
+    LOUD(fprintf(stderr, "rawio_stream_start: read-ahead thread %s\n", stream.threaded ? "started" : "failed");)
+  }
+#endif
+  return;
+}
+
+
+/* Get the next chunk of the stream; the data stays valid until the next
+ * call. Returns 1 with data, 0 at the end of the range or -1 on error */
+int rawio_stream_next(const void ** const restrict data, size_t * const restrict len)
+{
+#ifndef NO_THREADS
+  if (stream.threaded != 0) {
+    pthread_mutex_lock(&stream.lock);
+    /* Hand the previous buffer back to the reader */
+    if (stream.holding != 0) {
+      stream.holding = 0;
+      stream.head = (stream.head + 1) % RAWIO_READAHEAD_DEPTH;
+      stream.filled--;
+      pthread_cond_signal(&stream.cond);
+    }
+    while (stream.filled == 0 && stream.done == 0)
+      pthread_cond_wait(&stream.cond, &stream.lock);
+    if (stream.filled == 0) {
+      const int result = (stream.error != 0) ? -1 : 0;
+      pthread_mutex_unlock(&stream.lock);
+      return result;
+    }
+    stream.holding = 1;
+    pthread_mutex_unlock(&stream.lock);
+    *data = stream.buf[stream.head];
+    *len = stream.len[stream.head];
+    return 1;
+  }
+#endif /* NO_THREADS */
+
+  switch (stream_fill(0)) {
+    case 0:
+      *data = stream.buf[0];
+      *len = stream.len[0];
+      return 1;
+    case 1:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+
+/* Finish a stream, stopping the read-ahead thread if there is one */
+void rawio_stream_stop(void)
+{
+#ifndef NO_THREADS
+  if (stream.threaded != 0) {
+    pthread_mutex_lock(&stream.lock);
+    stream.stop = 1;
+    pthread_cond_signal(&stream.cond);
+    pthread_mutex_unlock(&stream.lock);
+    pthread_join(stream.thread, NULL);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.cond);
+    stream.threaded = 0;
+  }
+#endif
+  return;
+}
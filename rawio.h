@@ -0,0 +1,77 @@
+/* jdupes raw file data reading
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_RAWIO_H
+#define JDUPES_RAWIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Data buffers are page aligned so the kernel can copy into them quickly
+ * and the SIMD compare and hash code never straddles a page boundary */
+#ifndef RAWIO_ALIGN
+ #define RAWIO_ALIGN 4096
+#endif
+
+/* Shared read buffers: hashing uses the first, comparison uses both */
+#define RAWIO_BUFFERS 2
+
+/* Sequential reads of at least RAWIO_READAHEAD_MIN_CHUNKS chunks are done
+ * by a read-ahead thread that keeps up to RAWIO_READAHEAD_DEPTH chunks
+ * filled in advance */
+#ifndef RAWIO_READAHEAD_MIN_CHUNKS
+ #define RAWIO_READAHEAD_MIN_CHUNKS 4
+#endif
+#ifndef RAWIO_READAHEAD_DEPTH
+ #define RAWIO_READAHEAD_DEPTH 3
+#endif
+
+/* Read size tuning: every power of two from RAWIO_TUNE_MIN to RAWIO_TUNE_MAX
+ * is timed over RAWIO_TUNE_BYTES of reads on each device and the fastest
+ * one is used for that device from then on. Reads that are being timed get
+ * no read-ahead advice. Without tuning (-C or NO_CHUNKSIZE) all reads use
+ * auto_chunk_size. */
+#if !defined NO_CHUNKSIZE && !defined ON_WINDOWS
+ #define RAWIO_TUNE 1
+#endif
+#ifndef RAWIO_TUNE_MIN
+ #define RAWIO_TUNE_MIN 131072
+#endif
+#ifndef RAWIO_TUNE_MAX
+ #ifdef LOW_MEMORY
+  #define RAWIO_TUNE_MAX 262144
+ #else
+  #define RAWIO_TUNE_MAX 4194304
+ #endif
+#endif
+#ifndef RAWIO_TUNE_BYTES
+ #define RAWIO_TUNE_BYTES 16777216
+#endif
+
+#ifdef RAWIO_TUNE
+extern int rawio_tune_enabled;
+#endif
+
+int rawio_open(const char * const restrict path);
+ssize_t rawio_read(const int fd, void * const restrict buf, const size_t count, const off_t offset);
+ssize_t rawio_read_dev(const dev_t device, const int fd, void * const restrict buf, const size_t count, const off_t offset);
+size_t rawio_chunk_size(const dev_t device);
+void rawio_advise(const int fd, const dev_t device, const off_t offset, const off_t len);
+void rawio_close(const int fd);
+void *rawio_buffer(const unsigned int which);
+void rawio_stream_start(const int fd, const dev_t device, const off_t offset, const off_t end);
+int rawio_stream_next(const void ** const restrict data, size_t * const restrict len);
+void rawio_stream_stop(void);
+#if defined DEBUG && defined RAWIO_TUNE
+void rawio_print_tuning(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_RAWIO_H */
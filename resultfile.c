@@ -0,0 +1,324 @@
+/* jdupes binary result files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "resultfile.h"
+
+#ifndef NO_RESULTFILE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "filehash.h"
+
+/* A result file holds the duplicate sets of a scan in a compact form that
+ * other tools can read without parsing text; 'jdupes -G file' turns it back
+ * into the usual text or JSON output. See resultfile.h for the layout. */
+
+
+static void put_u32(unsigned char * const restrict p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++, v >>= 8) p[i] = (unsigned char)v;
+  return;
+}
+
+
+static void put_u64(unsigned char * const restrict p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++, v >>= 8) p[i] = (unsigned char)v;
+  return;
+}
+
+
+static uint32_t get_u32(const unsigned char * const restrict p)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+
+static uint64_t get_u64(const unsigned char * const restrict p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+
+/* Write all duplicate sets to a result file
+ * Returns 0 on success or -1 on error */
+int write_results(const file_t * restrict files, const char * const restrict name)
+{
+  FILE *out;
+  unsigned char rec[RESULT_FILE_REC];
+  uint64_t file_count = 0, set_count = 0, strsize = 0, offset = 0;
+  uint32_t index = 0;
+  const file_t *head, *dupe;
+
+  if (unlikely(name == NULL)) jc_nullptr("write_results()");
+  LOUD(fprintf(stderr, "write_results('%s')\n", name);)
+
+  for (head = files; head != NULL; head = head->next) {
+    if (!ISFLAG(head->flags, FF_HAS_DUPES)) continue;
+    set_count++;
+    for (dupe = head; dupe != NULL; dupe = dupe->duplicates) {
+      file_count++;
+      strsize += strlen(dupe->d_name) + 1;
+    }
+  }
+  if (file_count > UINT32_MAX) goto error_too_big;
+
+  errno = 0;
+  out = jc_fopen(name, JC_FILE_MODE_RW_SEQ);
+  if (out == NULL) goto error_open;
+
+  memset(rec, 0, RESULT_HEADER);
+  memcpy(rec, RESULT_MAGIC, 8);
+  put_u32(rec + 8, RESULT_VER);
+  put_u32(rec + 12, (uint32_t)hash_algo);
+  put_u64(rec + 16, file_count);
+  put_u64(rec + 24, set_count);
+  put_u64(rec + 32, strsize);
+  fwrite(rec, 1, RESULT_HEADER, out);
+
+  /* String table */
+  for (head = files; head != NULL; head = head->next) {
+    if (!ISFLAG(head->flags, FF_HAS_DUPES)) continue;
+    for (dupe = head; dupe != NULL; dupe = dupe->duplicates)
+      fwrite(dupe->d_name, 1, strlen(dupe->d_name) + 1, out);
+  }
+
+  /* File records */
+  for (head = files; head != NULL; head = head->next) {
+    if (!ISFLAG(head->flags, FF_HAS_DUPES)) continue;
+    for (dupe = head; dupe != NULL; dupe = dupe->duplicates) {
+      memset(rec, 0, RESULT_FILE_REC);
+      put_u64(rec, offset);
+      put_u64(rec + 8, (uint64_t)dupe->size);
+      put_u64(rec + 16, (uint64_t)dupe->inode);
+      put_u64(rec + 24, (uint64_t)dupe->device);
+#ifndef NO_MTIME
+      put_u64(rec + 32, (uint64_t)dupe->mtime);
+#endif
+      put_u64(rec + 40, dupe->filehash_partial);
+      put_u64(rec + 48, dupe->filehash);
+      put_u64(rec + 56, dupe->filehash_hi);
+      put_u32(rec + 64, (uint32_t)dupe->mode);
+#ifndef NO_PERMS
+      put_u32(rec + 68, (uint32_t)dupe->uid);
+      put_u32(rec + 72, (uint32_t)dupe->gid);
+#endif
+#ifndef NO_HARDLINKS
+      put_u32(rec + 76, (uint32_t)dupe->nlink);
+#endif
+      put_u32(rec + 80, dupe->flags & RESULT_FLAGS);
+      fwrite(rec, 1, RESULT_FILE_REC, out);
+      offset += strlen(dupe->d_name) + 1;
+    }
+  }
+
+  /* Set records and their member lists */
+  for (head = files; head != NULL; head = head->next) {
+    uint32_t count = 0;
+
+    if (!ISFLAG(head->flags, FF_HAS_DUPES)) continue;
+    for (dupe = head; dupe != NULL; dupe = dupe->duplicates) count++;
+    memset(rec, 0, RESULT_SET_REC);
+    put_u64(rec, (uint64_t)head->size);
+    if (ISFLAG(head->flags, FF_HASH_FULL)) {
+      put_u64(rec + 8, head->filehash);
+      put_u64(rec + 16, head->filehash_hi);
+    }
+    put_u32(rec + 24, count);
+    fwrite(rec, 1, RESULT_SET_REC, out);
+    for (uint32_t i = 0; i < count; i++, index++) {
+      put_u32(rec, index);
+      fwrite(rec, 1, 4, out);
+    }
+  }
+
+  if (ferror(out) != 0) {
+    fclose(out);
+    goto error_write;
+  }
+  if (fclose(out) != 0) goto error_write;
+  LOUD(fprintf(stderr, "write_results: %" PRIu64 " sets, %" PRIu64 " files\n", set_count, file_count);)
+  return 0;
+
+error_too_big:
+  fprintf(stderr, "error: too many files for result file '%s'\n", name);
+  return -1;
+error_open:
+  fprintf(stderr, "error: cannot open result file '%s' for writing: %s\n", name, strerror(errno));
+  return -1;
+error_write:
+  fprintf(stderr, "error: writing failed to result file '%s': %s\n", name, strerror(errno));
+  return -1;
+}
+
+
+/* Load the duplicate sets from a result file into a new file list
+ * Returns 0 on success or -1 on error */
+int read_results(const char * const restrict name, file_t ** const restrict filelistp)
+{
+  FILE *in;
+  unsigned char rec[RESULT_FILE_REC];
+  uint64_t file_count, set_count, strsize;
+  uint32_t algo;
+  char *strings = NULL;
+  file_t *list = NULL;
+  unsigned char *used = NULL;
+  file_t **tail = filelistp;
+  const char *problem = "truncated";
+
+  if (unlikely(name == NULL || filelistp == NULL)) jc_nullptr("read_results()");
+  LOUD(fprintf(stderr, "read_results('%s')\n", name);)
+
+  errno = 0;
+  in = jc_fopen(name, JC_FILE_MODE_RDONLY_SEQ);
+  if (in == NULL) goto error_open;
+
+  if (fread(rec, 1, RESULT_HEADER, in) != RESULT_HEADER) goto error_format;
+  problem = "not a jdupes result file";
+  if (memcmp(rec, RESULT_MAGIC, 8) != 0) goto error_format;
+  problem = "unsupported version";
+  if (get_u32(rec + 8) != RESULT_VER) goto error_format;
+  algo = get_u32(rec + 12);
+  file_count = get_u64(rec + 16);
+  set_count = get_u64(rec + 24);
+  strsize = get_u64(rec + 32);
+  problem = "bad header";
+  if (algo >= HASH_ALGO_COUNT || file_count > UINT32_MAX || set_count > file_count / 2
+      || strsize > SIZE_MAX - 1 || strsize < file_count * 2) goto error_format;
+  *filelistp = NULL;
+  if (file_count == 0) goto done;
+
+  strings = (char *)malloc((size_t)strsize);
+  list = (file_t *)calloc((size_t)file_count, sizeof(file_t));
+  used = (unsigned char *)calloc((size_t)file_count, 1);
+  if (unlikely(strings == NULL || list == NULL || used == NULL)) jc_oom("read_results()");
+  problem = "truncated";
+  if (fread(strings, 1, (size_t)strsize, in) != strsize) goto error_format;
+  problem = "bad string table";
+  if (strings[strsize - 1] != '\0') goto error_format;
+
+  for (uint64_t i = 0; i < file_count; i++) {
+    file_t * const file = &list[i];
+    uint64_t offset;
+
+    problem = "truncated";
+    if (fread(rec, 1, RESULT_FILE_REC, in) != RESULT_FILE_REC) goto error_format;
+    offset = get_u64(rec);
+    problem = "bad file record";
+    if (offset >= strsize || (offset > 0 && strings[offset - 1] != '\0')) goto error_format;
+    file->d_name = strings + offset;
+    file->size = (off_t)get_u64(rec + 8);
+    file->inode = (jdupes_ino_t)get_u64(rec + 16);
+    file->device = (dev_t)get_u64(rec + 24);
+#ifndef NO_MTIME
+    file->mtime = (time_t)get_u64(rec + 32);
+#endif
+    file->filehash_partial = get_u64(rec + 40);
+    file->filehash = get_u64(rec + 48);
+    file->filehash_hi = get_u64(rec + 56);
+    file->mode = (jdupes_mode_t)get_u32(rec + 64);
+#ifndef NO_PERMS
+    file->uid = (uid_t)get_u32(rec + 68);
+    file->gid = (gid_t)get_u32(rec + 72);
+#endif
+#ifndef NO_HARDLINKS
+    file->nlink = get_u32(rec + 76);
+#endif
+    file->flags = (get_u32(rec + 80) & RESULT_FLAGS) | FF_VALID_STAT;
+  }
+
+  /* Rebuild the duplicate chains; each file belongs to exactly one set */
+  for (uint64_t i = 0; i < set_count; i++) {
+    file_t *prev = NULL;
+    uint32_t count;
+
+    problem = "truncated";
+    if (fread(rec, 1, RESULT_SET_REC, in) != RESULT_SET_REC) goto error_format;
+    count = get_u32(rec + 24);
+    problem = "bad set record";
+    if (count < 2 || count > file_count) goto error_format;
+    for (uint32_t j = 0; j < count; j++) {
+      unsigned char idx[4];
+      uint32_t index;
+
+      problem = "truncated";
+      if (fread(idx, 1, 4, in) != 4) goto error_format;
+      index = get_u32(idx);
+      problem = "bad set member";
+      if (index >= file_count || used[index] != 0) goto error_format;
+      if (list[index].size != (off_t)get_u64(rec)) goto error_format;
+      used[index] = 1;
+      if (prev == NULL) SETFLAG(list[index].flags, FF_HAS_DUPES);
+      else prev->duplicates = &list[index];
+      prev = &list[index];
+      *tail = prev;
+      tail = &prev->next;
+    }
+  }
+  problem = "file without a set";
+  for (uint64_t i = 0; i < file_count; i++) if (used[i] == 0) goto error_format;
+
+done:
+  fclose(in);
+  free(used);
+  /* Hashes in the file were made with this algorithm */
+  hash_algo = (int)algo;
+  LOUD(fprintf(stderr, "read_results: %" PRIu64 " sets, %" PRIu64 " files\n", set_count, file_count);)
+  return 0;
+
+error_open:
+  fprintf(stderr, "error: cannot open result file '%s': %s\n", name, strerror(errno));
+  return -1;
+error_format:
+  fprintf(stderr, "error: result file '%s' is invalid (%s)\n", name, problem);
+  fclose(in);
+  free(strings);
+  free(list);
+  free(used);
+  *filelistp = NULL;
+  return -1;
+}
+
+/* Before sets loaded from a result file are acted upon, drop every file
+ * that is gone or changed since it was scanned; sets left with fewer than
+ * two files are dropped entirely. Returns the number of files dropped */
+uintmax_t validate_results(file_t * restrict files)
+{
+  uintmax_t dropped = 0;
+
+  LOUD(fprintf(stderr, "validate_results(%p)\n", files);)
+  for (; files != NULL; files = files->next) {
+    file_t *head = NULL, *prev = NULL, *cur, *next;
+
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    CLEARFLAG(files->flags, FF_HAS_DUPES);
+    for (cur = files; cur != NULL; cur = next) {
+      next = cur->duplicates;
+      cur->duplicates = NULL;
+      if (file_has_changed(cur) != 0) {
+        fprintf(stderr, "skipping changed file: "); jc_fwprint(stderr, cur->d_name, 1);
+        dropped++;
+        continue;
+      }
+      if (prev == NULL) head = cur;
+      else prev->duplicates = cur;
+      prev = cur;
+    }
+    /* A new head comes later in the file list, so the walk still finds it */
+    if (head != NULL && head->duplicates != NULL) SETFLAG(head->flags, FF_HAS_DUPES);
+  }
+  return dropped;
+}
+
+#endif /* NO_RESULTFILE */
@@ -0,0 +1,68 @@
+/* jdupes binary result files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_RESULTFILE_H
+#define JDUPES_RESULTFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+#ifndef NO_RESULTFILE
+
+/* Result file layout; all numbers are little-endian
+ *
+ * Header (48 bytes):
+ *   char[8]  magic "JDRESULT"
+ *   u32      format version (RESULT_VER)
+ *   u32      hash algorithm (HASH_ALGO_* in filehash.h)
+ *   u64      number of files
+ *   u64      number of duplicate sets
+ *   u64      size of the string table in bytes
+ *   u64      reserved (0)
+ * String table: every path, each followed by a NUL byte
+ * File records (RESULT_FILE_REC bytes each), in set order:
+ *   u64      offset of the path in the string table
+ *   i64      size
+ *   u64      inode
+ *   u64      device
+ *   i64      mtime (0 without mtime support)
+ *   u64      partial hash (first PARTIAL_HASH_SIZE bytes)
+ *   u64      full hash
+ *   u64      upper half of a 128-bit full hash
+ *   u32      mode
+ *   u32      uid, u32 gid (0 without permission support)
+ *   u32      link count
+ *   u32      FF_* flags (RESULT_FLAGS)
+ *   u32      reserved (0)
+ * Set records, in output order:
+ *   i64      file size
+ *   u64      full hash (0 if not known)
+ *   u64      upper half of a 128-bit full hash
+ *   u32      number of members (2 or more)
+ *   u32      reserved (0)
+ *   u32[]    file record index of each member; the first is the set head */
+
+#define RESULT_MAGIC "JDRESULT"
+#define RESULT_VER 1
+#define RESULT_HEADER 48
+#define RESULT_FILE_REC 88
+#define RESULT_SET_REC 32
+
+/* Per-file flags that are saved */
+#define RESULT_FLAGS (FF_IS_SYMLINK | FF_HASH_PARTIAL | FF_HASH_FULL | FF_MATCH_BYTES \
+		| FF_MATCH_HASH | FF_MATCH_PARTIAL | FF_MATCH_LINK | FF_MATCH_EXTENTS)
+
+int write_results(const file_t * restrict files, const char * const restrict name);
+int read_results(const char * const restrict name, file_t ** const restrict filelistp);
+uintmax_t validate_results(file_t * restrict files);
+
+#endif /* NO_RESULTFILE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_RESULTFILE_H */
@@ -0,0 +1,208 @@
+/* jdupes file scan ordering
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_SCANORDER
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#ifdef __linux__
+ #include <fcntl.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <sys/ioctl.h>
+ #include <linux/fs.h>
+ #include <linux/fiemap.h>
+#endif
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "interrupt.h"
+#include "scanorder.h"
+
+/* The file list is built in reverse discovery order, which makes rotational
+ * disks seek back and forth while hashing. Files are instead scanned by
+ * device and then by where their data lives on that device. Only files that
+ * share a size with another file are ever read, so only those are located
+ * precisely; everything else is ordered by inode number, which most
+ * filesystems allocate near the data anyway. */
+
+struct scankey {
+  file_t *file;
+  uint64_t location;
+  size_t index;      /* Original list position to keep sorting stable */
+  int physical;      /* location is a physical byte offset, not an inode */
+};
+
+
+#ifdef __linux__
+/* Get the physical byte offset of the first extent of a file
+ * Returns 0 on success or -1 if the location is not known */
+static int get_physical_offset(const char * const restrict path, uint64_t * const restrict offset)
+{
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } req;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+  memset(&req, 0, sizeof(req));
+  req.map.fm_start = 0;
+  req.map.fm_length = FIEMAP_MAX_OFFSET;
+  req.map.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &req.map) != 0 || req.map.fm_mapped_extents == 0) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  /* Inline, delayed, or packed data has no useful physical location */
+  if (req.extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED)) return -1;
+  *offset = req.extent.fe_physical;
+  return 0;
+}
+#endif /* __linux__ */
+
+
+static int sort_keys_by_size(const void *p1, const void *p2)
+{
+  const struct scankey * const k1 = (const struct scankey *)p1;
+  const struct scankey * const k2 = (const struct scankey *)p2;
+
+  if (k1->file->size != k2->file->size) return (k1->file->size < k2->file->size) ? -1 : 1;
+  if (k1->index == k2->index) return 0;
+  return (k1->index < k2->index) ? -1 : 1;
+}
+
+
+/* Size first, then files without a partial hash, then by partial hash */
+static int sort_files_by_partial(const void *p1, const void *p2)
+{
+  const file_t * const f1 = *(const file_t * const *)p1;
+  const file_t * const f2 = *(const file_t * const *)p2;
+  const int h1 = ISFLAG(f1->flags, FF_HASH_PARTIAL) ? 1 : 0;
+  const int h2 = ISFLAG(f2->flags, FF_HASH_PARTIAL) ? 1 : 0;
+
+  if (f1->size != f2->size) return (f1->size < f2->size) ? -1 : 1;
+  if (h1 != h2) return h1 - h2;
+  if (h1 == 0 || f1->filehash_partial == f2->filehash_partial) return 0;
+  return (f1->filehash_partial < f2->filehash_partial) ? -1 : 1;
+}
+
+
+static int sort_keys_by_location(const void *p1, const void *p2)
+{
+  const struct scankey * const k1 = (const struct scankey *)p1;
+  const struct scankey * const k2 = (const struct scankey *)p2;
+
+  if (k1->file->device != k2->file->device) return (k1->file->device < k2->file->device) ? -1 : 1;
+  if (k1->physical != k2->physical) return k1->physical - k2->physical;
+  if (k1->location != k2->location) return (k1->location < k2->location) ? -1 : 1;
+  if (k1->index == k2->index) return 0;
+  return (k1->index < k2->index) ? -1 : 1;
+}
+
+
+/* Build a NULL-terminated array of files in the order they should be scanned
+ * Files that share their size with another file are flagged FF_SIZE_PEER.
+ * Returns NULL if the array can't be built; the caller should then use the
+ * file list as-is. The returned array must be freed by the caller. */
+file_t **build_scan_order(file_t *files)
+{
+  struct scankey *keys;
+  file_t **order;
+  size_t count = 0, i;
+
+  for (file_t *cur = files; cur != NULL; cur = cur->next) count++;
+  if (count < 2) return NULL;
+  LOUD(fprintf(stderr, "build_scan_order: %" PRIuMAX " files\n", (uintmax_t)count);)
+
+  keys = (struct scankey *)malloc(sizeof(struct scankey) * count);
+  if (keys == NULL) return NULL;
+  order = (file_t **)malloc(sizeof(file_t *) * (count + 1));
+  if (order == NULL) {
+    free(keys);
+    return NULL;
+  }
+
+  i = 0;
+  for (file_t *cur = files; cur != NULL; cur = cur->next, i++) {
+    keys[i].file = cur;
+    keys[i].location = (uint64_t)cur->inode;
+    keys[i].index = i;
+    keys[i].physical = 0;
+  }
+
+  /* Find and locate the files that will actually be read */
+  qsort(keys, count, sizeof(struct scankey), sort_keys_by_size);
+  for (i = 0; i < count; i++) {
+    if ((i > 0 && keys[i - 1].file->size == keys[i].file->size)
+        || (i + 1 < count && keys[i + 1].file->size == keys[i].file->size))
+      SETFLAG(keys[i].file->flags, FF_SIZE_PEER);
+#ifdef __linux__
+    if (unlikely(interrupt != 0)) continue;
+    /* Small files are read in one go so their location matters little */
+    if (keys[i].file->size <= SMALL_FILE_SIZE || !ISFLAG(keys[i].file->flags, FF_SIZE_PEER)) continue;
+    if (get_physical_offset(keys[i].file->d_name, &keys[i].location) == 0) keys[i].physical = 1;
+#endif /* __linux__ */
+  }
+
+  qsort(keys, count, sizeof(struct scankey), sort_keys_by_location);
+  for (i = 0; i < count; i++) order[i] = keys[i].file;
+  order[count] = NULL;
+  free(keys);
+  return order;
+}
+
+
+/* Flag files that can only ever match one other file with FF_HASH_PAIR so
+ * that checkmatch() can compare them directly instead of hashing them and
+ * reading them again for confirmation. That is the case when a size is
+ * shared by exactly two files, or when all partial hashes for a size are
+ * known and exactly two files share one. Call this after prehash_files()
+ * so that as many partial hashes as possible are known. */
+void mark_hash_pairs(file_t ** const restrict order)
+{
+  file_t **peers;
+  size_t count = 0, i, j, k;
+
+  if (unlikely(order == NULL)) jc_nullptr("mark_hash_pairs()");
+  for (i = 0; order[i] != NULL; i++)
+    if (ISFLAG(order[i]->flags, FF_SIZE_PEER) && order[i]->size > PARTIAL_HASH_SIZE) count++;
+  if (count < 2) return;
+  peers = (file_t **)malloc(sizeof(file_t *) * count);
+  if (peers == NULL) return;
+  count = 0;
+  for (i = 0; order[i] != NULL; i++)
+    if (ISFLAG(order[i]->flags, FF_SIZE_PEER) && order[i]->size > PARTIAL_HASH_SIZE) peers[count++] = order[i];
+  qsort(peers, count, sizeof(file_t *), sort_files_by_partial);
+
+  for (i = 0; i < count; i = j) {
+    /* Size group is [i, j) */
+    for (j = i + 1; j < count && peers[j]->size == peers[i]->size; j++);
+    if (j - i == 2) {
+      SETFLAG(peers[i]->flags, FF_HASH_PAIR);
+      SETFLAG(peers[i + 1]->flags, FF_HASH_PAIR);
+      continue;
+    }
+    /* A missing partial hash could match anything; those sort first */
+    if (!ISFLAG(peers[i]->flags, FF_HASH_PARTIAL)) continue;
+    for (k = i; k < j;) {
+      size_t end;
+
+      for (end = k + 1; end < j && peers[end]->filehash_partial == peers[k]->filehash_partial; end++);
+      if (end - k == 2) {
+        SETFLAG(peers[k]->flags, FF_HASH_PAIR);
+        SETFLAG(peers[k + 1]->flags, FF_HASH_PAIR);
+      }
+      k = end;
+    }
+  }
+  LOUD(for (i = 0; i < count; i++) if (ISFLAG(peers[i]->flags, FF_HASH_PAIR)) fprintf(stderr, "mark_hash_pairs: pair member '%s'\n", peers[i]->d_name);)
+  free(peers);
+  return;
+}
+
+#endif /* NO_SCANORDER */
@@ -0,0 +1,22 @@
+/* jdupes file scan ordering
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_SCANORDER_H
+#define JDUPES_SCANORDER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NO_SCANORDER
+
+file_t **build_scan_order(file_t *files);
+void mark_hash_pairs(file_t ** const restrict order);
+
+#endif /* NO_SCANORDER */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_SCANORDER_H */
@@ -0,0 +1,356 @@
+/* jdupes similar file detection with content-defined chunking
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "similar.h"
+
+#ifndef NO_SIMILARITY
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "chunkcmp.h"
+#include "filehash.h"
+#include "interrupt.h"
+#include "rawio.h"
+
+/* Files that are not duplicates can still share most of their data: disk
+ * images of the same system, logs that were appended to, archives with a
+ * few changed members. Every large file is cut into chunks at positions
+ * chosen by the data itself (a "gear" rolling hash as used by FastCDC), so
+ * an insertion or deletion only changes the chunks around it and the rest
+ * still line up with the other file. Each chunk's hash is looked up in an
+ * index of chunks from the files already read, and the bytes found in each
+ * other file are added up.
+ *
+ * The index has a fixed size. Once it is half full, the sampling rate is
+ * halved: only chunks whose hash has one more low bit clear are kept and
+ * looked up from then on. The share of a file found elsewhere is measured
+ * over the sampled chunks only, which estimates it well because chunk
+ * hashes are uniformly distributed. Files are read largest first so that
+ * the reported percentage is the part of the smaller file that is also
+ * in the larger one. Only the first file a chunk was seen in is indexed,
+ * so when several files share the same data, each of the smaller ones is
+ * reported against the largest of them rather than against each other. */
+
+unsigned int similar_percent = 0;
+struct similar_pair *similar_pairs = NULL;
+size_t similar_pair_count = 0;
+
+#define INDEX_SIZE ((size_t)1 << SIMILAR_INDEX_BITS)
+#define INDEX_SLOT(h) ((size_t)((h) >> (64 - SIMILAR_INDEX_BITS)))
+
+/* Harder cut condition below the average size, easier one above it */
+#define MASK_SMALL (((UINT64_C(1) << (SIMILAR_CHUNK_AVG_BITS + 2)) - 1) << (64 - SIMILAR_CHUNK_AVG_BITS - 2))
+#define MASK_LARGE (((UINT64_C(1) << (SIMILAR_CHUNK_AVG_BITS - 2)) - 1) << (64 - SIMILAR_CHUNK_AVG_BITS + 2))
+
+struct chunkref {
+  uint64_t hash;
+  uint32_t file;   /* Index into the candidate list plus one; 0 = unused */
+};
+
+struct peer {
+  uint32_t file;
+  uintmax_t bytes;
+};
+
+static uint64_t gear[256];
+static struct chunkref *table;
+static size_t table_used;
+static uint64_t sample_mask;
+static size_t pair_alloc;
+
+/* State of the file being read */
+static uint32_t cur;
+static uintmax_t cur_sampled;
+static struct peer peers[SIMILAR_MAX_PEERS];
+static unsigned int peer_count;
+static char *cbuf;
+static char *zero;
+static size_t clen;
+static uint64_t fp;
+
+
+/* Parse the --similar option; returns nonzero if invalid */
+int set_similar_percent(const char * const restrict arg)
+{
+  char *end;
+  unsigned long pct;
+
+  if (unlikely(arg == NULL)) jc_nullptr("set_similar_percent()");
+  pct = strtoul(arg, &end, 10);
+  if (end == arg || *end != '\0' || pct < 1 || pct > 100) return 1;
+  similar_percent = (unsigned int)pct;
+  return 0;
+}
+
+
+/* Fixed pseudo-random table so that chunk boundaries never change */
+static void init_gear(void)
+{
+  uint64_t x = UINT64_C(0x6a09e667f3bcc908);
+
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (x += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    gear[i] = z ^ (z >> 31);
+  }
+  return;
+}
+
+
+static struct chunkref *find_chunk(struct chunkref * const restrict tbl, const uint64_t hash)
+{
+  size_t i = INDEX_SLOT(hash);
+
+  while (tbl[i].file != 0 && tbl[i].hash != hash) i = (i + 1) & (INDEX_SIZE - 1);
+  return &tbl[i];
+}
+
+
+/* Halve the sampling rate, dropping the chunks that are no longer sampled */
+static void thin_index(void)
+{
+  struct chunkref *newtable;
+
+  newtable = (struct chunkref *)calloc(INDEX_SIZE, sizeof(struct chunkref));
+  if (unlikely(newtable == NULL)) jc_oom("thin_index()");
+  sample_mask = (sample_mask << 1) | 1;
+  table_used = 0;
+  for (size_t i = 0; i < INDEX_SIZE; i++) {
+    if (table[i].file == 0 || (table[i].hash & sample_mask) != 0) continue;
+    *find_chunk(newtable, table[i].hash) = table[i];
+    table_used++;
+  }
+  free(table);
+  table = newtable;
+  LOUD(fprintf(stderr, "thin_index: sample mask 0x%" PRIx64 ", %" PRIuMAX " chunks kept\n", sample_mask, (uintmax_t)table_used);)
+  return;
+}
+
+
+/* Look up one chunk of the current file and add it to the index */
+static void add_chunk(const char * const restrict data, const size_t len)
+{
+  struct chunkref *ref;
+  uint64_t hash[2];
+
+  /* Runs of zeroes are usually holes or preallocated space */
+  if (chunk_equal(data, zero, len)) return;
+  if (hash_block(hash_algo, data, len, hash) != 0) return;
+  if ((hash[0] & sample_mask) != 0) return;
+  cur_sampled += len;
+
+  ref = find_chunk(table, hash[0]);
+  if (ref->file == 0) {
+    /* A single huge file may not overfill the index before it is thinned */
+    if (table_used >= INDEX_SIZE / 4 * 3) return;
+    ref->hash = hash[0];
+    ref->file = cur + 1;
+    table_used++;
+    return;
+  }
+  if (ref->file == cur + 1) return;
+
+  for (unsigned int i = 0; i < peer_count; i++) {
+    if (peers[i].file == ref->file - 1) {
+      peers[i].bytes += len;
+      return;
+    }
+  }
+  if (peer_count < SIMILAR_MAX_PEERS) {
+    peers[peer_count].file = ref->file - 1;
+    peers[peer_count].bytes = len;
+    peer_count++;
+  }
+  return;
+}
+
+
+/* Cut a stream of file data into chunks */
+static void chunk_data(const char *data, size_t len)
+{
+  while (len > 0) {
+    size_t i = 0;
+    int cut = 0;
+
+    /* No cut is possible within the minimum size, so skip hashing it */
+    if (clen < SIMILAR_CHUNK_MIN) {
+      i = SIMILAR_CHUNK_MIN - clen;
+      if (i > len) i = len;
+    }
+    for (; i < len; i++) {
+      const size_t pos = clen + i + 1;
+
+      fp = (fp << 1) + gear[(unsigned char)data[i]];
+      if ((fp & ((pos <= SIMILAR_CHUNK_AVG) ? MASK_SMALL : MASK_LARGE)) == 0 || pos == SIMILAR_CHUNK_MAX) {
+        i++;
+        cut = 1;
+        break;
+      }
+    }
+    memcpy(cbuf + clen, data, i);
+    clen += i;
+    data += i;
+    len -= i;
+    if (cut) {
+      add_chunk(cbuf, clen);
+      clen = 0;
+      fp = 0;
+    }
+  }
+  return;
+}
+
+
+/* Sort candidates with the largest first, keeping hard links together */
+static int sort_candidates(const void *p1, const void *p2)
+{
+  const file_t * const f1 = *(const file_t * const *)p1;
+  const file_t * const f2 = *(const file_t * const *)p2;
+
+  if (f1->size != f2->size) return (f1->size > f2->size) ? -1 : 1;
+  if (f1->device != f2->device) return (f1->device < f2->device) ? -1 : 1;
+  if (f1->inode != f2->inode) return (f1->inode < f2->inode) ? -1 : 1;
+  return 0;
+}
+
+
+static int sort_pointers(const void *p1, const void *p2)
+{
+  const uintptr_t a = (uintptr_t)*(const file_t * const *)p1;
+  const uintptr_t b = (uintptr_t)*(const file_t * const *)p2;
+
+  return (a > b) - (a < b);
+}
+
+
+static int sort_pairs(const void *p1, const void *p2)
+{
+  const struct similar_pair * const a = (const struct similar_pair *)p1;
+  const struct similar_pair * const b = (const struct similar_pair *)p2;
+
+  if (a->percent != b->percent) return (a->percent > b->percent) ? -1 : 1;
+  if (a->shared != b->shared) return (a->shared > b->shared) ? -1 : 1;
+  return 0;
+}
+
+
+/* Read one file and record the files it shares enough data with */
+static void read_file(file_t ** const restrict cand)
+{
+  file_t * const file = cand[cur];
+  const void *data;
+  size_t len;
+  int fd, result;
+
+  fd = rawio_open(file->d_name);
+  if (fd == -1) {
+    fprintf(stderr, "\nerror opening file "); jc_fwprint(stderr, file->d_name, 1);
+    exit_status = EXIT_FAILURE;
+    return;
+  }
+  cur_sampled = 0;
+  peer_count = 0;
+  clen = 0;
+  fp = 0;
+  rawio_advise(fd, file->device, 0, file->size);
+  rawio_stream_start(fd, file->device, 0, file->size);
+  while ((result = rawio_stream_next(&data, &len)) > 0 && interrupt == 0)
+    chunk_data((const char *)data, len);
+  rawio_stream_stop();
+  rawio_close(fd);
+  if (unlikely(result < 0)) {
+    fprintf(stderr, "\nerror reading from file "); jc_fwprint(stderr, file->d_name, 1);
+    exit_status = EXIT_FAILURE;
+    return;
+  }
+  if (clen != 0) add_chunk(cbuf, clen);
+  if (cur_sampled == 0) return;
+
+  for (unsigned int i = 0; i < peer_count; i++) {
+    struct similar_pair *pair;
+    const unsigned int pct = (unsigned int)((peers[i].bytes * 100) / cur_sampled);
+
+    if (pct < similar_percent) continue;
+    if (similar_pair_count == pair_alloc) {
+      pair_alloc = (pair_alloc == 0) ? 64 : pair_alloc * 2;
+      pair = (struct similar_pair *)realloc(similar_pairs, sizeof(struct similar_pair) * pair_alloc);
+      if (unlikely(pair == NULL)) jc_oom("read_file() pairs");
+      similar_pairs = pair;
+    }
+    pair = &similar_pairs[similar_pair_count++];
+    pair->file = file;
+    pair->similar = cand[peers[i].file];
+    pair->shared = (uintmax_t)(((double)peers[i].bytes / (double)cur_sampled) * (double)file->size);
+    pair->percent = pct;
+  }
+  return;
+}
+
+
+void find_similar(file_t * restrict files)
+{
+  file_t **cand = NULL, **dupes = NULL;
+  file_t *curfile;
+  size_t count = 0, membercount = 0, i, n;
+
+  LOUD(fprintf(stderr, "find_similar: %p\n", files);)
+
+  /* Only the first file of each duplicate set stands for the whole set */
+  for (curfile = files; curfile != NULL; curfile = curfile->next) {
+    if (curfile->size >= SIMILAR_MIN_FILE) count++;
+    if (ISFLAG(curfile->flags, FF_HAS_DUPES))
+      for (file_t *dupe = curfile->duplicates; dupe != NULL; dupe = dupe->duplicates) membercount++;
+  }
+  if (count < 2) return;
+  cand = (file_t **)malloc(sizeof(file_t *) * count);
+  dupes = (file_t **)malloc(sizeof(file_t *) * (membercount + 1));
+  table = (struct chunkref *)calloc(INDEX_SIZE, sizeof(struct chunkref));
+  cbuf = (char *)malloc(SIMILAR_CHUNK_MAX);
+  zero = (char *)calloc(1, SIMILAR_CHUNK_MAX);
+  if (unlikely(cand == NULL || dupes == NULL || table == NULL || cbuf == NULL || zero == NULL)) jc_oom("find_similar()");
+
+  membercount = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next)
+    if (ISFLAG(curfile->flags, FF_HAS_DUPES))
+      for (file_t *dupe = curfile->duplicates; dupe != NULL; dupe = dupe->duplicates) dupes[membercount++] = dupe;
+  qsort(dupes, membercount, sizeof(file_t *), sort_pointers);
+  count = 0;
+  for (curfile = files; curfile != NULL; curfile = curfile->next) {
+    if (curfile->size < SIMILAR_MIN_FILE) continue;
+    if (bsearch(&curfile, dupes, membercount, sizeof(file_t *), sort_pointers) != NULL) continue;
+    cand[count++] = curfile;
+  }
+  qsort(cand, count, sizeof(file_t *), sort_candidates);
+
+  init_gear();
+  sample_mask = 0;
+  table_used = 0;
+  for (i = 0, n = 0; i < count && interrupt == 0; i++) {
+    /* Hard links have the same data */
+    if (i > 0 && cand[i]->inode == cand[i - 1]->inode && cand[i]->device == cand[i - 1]->device) continue;
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\rFinding similar files: %" PRIuMAX "/%" PRIuMAX, (uintmax_t)++n, (uintmax_t)count);
+    cur = (uint32_t)i;
+    read_file(cand);
+    while (table_used >= INDEX_SIZE / 2) thin_index();
+  }
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+  qsort(similar_pairs, similar_pair_count, sizeof(struct similar_pair), sort_pairs);
+  LOUD(fprintf(stderr, "find_similar: %" PRIuMAX " pairs, sample mask 0x%" PRIx64 "\n", (uintmax_t)similar_pair_count, sample_mask);)
+
+  free(cand);
+  free(dupes);
+  free(table);
+  free(cbuf);
+  free(zero);
+  table = NULL;
+  return;
+}
+
+#endif /* NO_SIMILARITY */
@@ -0,0 +1,68 @@
+/* jdupes similar file detection with content-defined chunking
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_SIMILAR_H
+#define JDUPES_SIMILAR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Similarity results are only reported in JSON output */
+#if defined NO_JSON && !defined NO_SIMILARITY
+ #define NO_SIMILARITY
+#endif
+
+#ifndef NO_SIMILARITY
+
+/* Chunk size limits; chunks average about SIMILAR_CHUNK_AVG bytes */
+#ifndef SIMILAR_CHUNK_MIN
+ #define SIMILAR_CHUNK_MIN 16384
+#endif
+#ifndef SIMILAR_CHUNK_AVG_BITS
+ #define SIMILAR_CHUNK_AVG_BITS 16
+#endif
+#define SIMILAR_CHUNK_AVG (1 << SIMILAR_CHUNK_AVG_BITS)
+#ifndef SIMILAR_CHUNK_MAX
+ #define SIMILAR_CHUNK_MAX 262144
+#endif
+
+/* Smaller files are not examined */
+#ifndef SIMILAR_MIN_FILE
+ #define SIMILAR_MIN_FILE 1048576
+#endif
+
+/* The chunk index has 2^SIMILAR_INDEX_BITS slots of 16 bytes each; when it
+ * fills up, only a sample of chunks is kept so memory use never grows */
+#ifndef SIMILAR_INDEX_BITS
+ #define SIMILAR_INDEX_BITS 22
+#endif
+
+/* Most files that one file shares data with */
+#ifndef SIMILAR_MAX_PEERS
+ #define SIMILAR_MAX_PEERS 64
+#endif
+
+struct similar_pair {
+  file_t *file;
+  file_t *similar;     /* Larger or equal size file holding the shared data */
+  uintmax_t shared;    /* Estimated bytes of 'file' also found in 'similar' */
+  unsigned int percent;
+};
+
+extern unsigned int similar_percent;
+extern struct similar_pair *similar_pairs;
+extern size_t similar_pair_count;
+
+int set_similar_percent(const char * const restrict arg);
+void find_similar(file_t * restrict files);
+
+#endif /* NO_SIMILARITY */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_SIMILAR_H */
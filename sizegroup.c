@@ -0,0 +1,143 @@
+/* jdupes tracking of finished file size groups
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "sizegroup.h"
+
+/* Files can only match other files of the same size, so once every file of
+ * one size has been through the main scan loop, the duplicate sets of that
+ * size are final and nothing kept to find them is needed again. The scan
+ * loop reports each file it is done with; when the last file of a size is
+ * done, the callback gets all files of that size. */
+
+struct sizegroup_entry {
+  file_t *file;
+  size_t index;        /* Position in the file list, to keep groups in order */
+};
+
+struct sizegroup {
+  off_t size;
+  size_t start;        /* First file of this size in by_size */
+  size_t count;
+  size_t remaining;    /* Files of this size not scanned yet */
+};
+
+static file_t **by_size = NULL;
+static struct sizegroup *groups = NULL;
+static size_t group_count = 0;
+static sizegroup_done_t group_done = NULL;
+
+
+static int sort_entries_by_size(const void *a, const void *b)
+{
+  const struct sizegroup_entry * const ea = (const struct sizegroup_entry *)a;
+  const struct sizegroup_entry * const eb = (const struct sizegroup_entry *)b;
+
+  if (ea->file->size != eb->file->size) return (ea->file->size > eb->file->size) ? 1 : -1;
+  return (ea->index > eb->index) ? 1 : ((ea->index < eb->index) ? -1 : 0);
+}
+
+
+static int find_group(const void *key, const void *member)
+{
+  const off_t size = *(const off_t *)key;
+  const struct sizegroup * const group = (const struct sizegroup *)member;
+
+  return (size > group->size) ? 1 : ((size < group->size) ? -1 : 0);
+}
+
+
+static void finish_group(struct sizegroup * const restrict group)
+{
+  LOUD(fprintf(stderr, "sizegroup: size %" PRIdMAX " finished (%" PRIuMAX " files)\n", (intmax_t)group->size, (uintmax_t)group->count);)
+  group->remaining = 0;
+  group_done(by_size + group->start, group->count);
+  return;
+}
+
+
+/* Group all files that share a size with another file; call this before
+ * the main scan loop. Returns 0 on success or -1 if there is nothing to do */
+int sizegroup_start(file_t * restrict files, sizegroup_done_t done)
+{
+  struct sizegroup_entry *entries;
+  size_t count = 0, kept = 0, i, j;
+
+  if (unlikely(files == NULL || done == NULL)) jc_nullptr("sizegroup_start()");
+  for (file_t *cur = files; cur != NULL; cur = cur->next) count++;
+  if (count < 2) return -1;
+
+  entries = (struct sizegroup_entry *)malloc(sizeof(struct sizegroup_entry) * count);
+  if (unlikely(entries == NULL)) jc_oom("sizegroup_start() entries");
+  i = 0;
+  for (file_t *cur = files; cur != NULL; cur = cur->next, i++) {
+    entries[i].file = cur;
+    entries[i].index = i;
+  }
+  qsort(entries, count, sizeof(struct sizegroup_entry), sort_entries_by_size);
+
+  /* Sizes with only one file never have sets; keep the rest at the front */
+  for (i = 0; i < count; i = j) {
+    for (j = i + 1; j < count && entries[j].file->size == entries[i].file->size; j++);
+    if (j - i < 2) continue;
+    group_count++;
+    for (size_t k = i; k < j; k++) entries[kept++] = entries[k];
+  }
+  if (group_count == 0) {
+    free(entries);
+    return -1;
+  }
+
+  by_size = (file_t **)malloc(sizeof(file_t *) * kept);
+  groups = (struct sizegroup *)malloc(sizeof(struct sizegroup) * group_count);
+  if (unlikely(by_size == NULL || groups == NULL)) jc_oom("sizegroup_start() groups");
+  group_count = 0;
+  for (i = 0; i < kept; i = j) {
+    for (j = i + 1; j < kept && entries[j].file->size == entries[i].file->size; j++);
+    groups[group_count].size = entries[i].file->size;
+    groups[group_count].start = i;
+    groups[group_count].count = j - i;
+    groups[group_count].remaining = j - i;
+    group_count++;
+  }
+  for (i = 0; i < kept; i++) by_size[i] = entries[i].file;
+  free(entries);
+  group_done = done;
+  LOUD(fprintf(stderr, "sizegroup_start: %" PRIuMAX " files in %" PRIuMAX " size groups\n", (uintmax_t)kept, (uintmax_t)group_count);)
+  return 0;
+}
+
+
+/* Call for each file after the main scan loop is done with it */
+void sizegroup_file_done(const file_t * const restrict file)
+{
+  struct sizegroup *group;
+
+  if (groups == NULL) return;
+  group = (struct sizegroup *)bsearch(&file->size, groups, group_count, sizeof(struct sizegroup), find_group);
+  if (group == NULL || group->remaining == 0) return;
+  group->remaining--;
+  if (group->remaining == 0) finish_group(group);
+  return;
+}
+
+
+/* Finish groups left over from an aborted scan and clean up */
+void sizegroup_finish(void)
+{
+  for (size_t i = 0; i < group_count; i++)
+    if (groups[i].remaining != 0) finish_group(&groups[i]);
+  free(by_size);
+  free(groups);
+  by_size = NULL;
+  groups = NULL;
+  group_count = 0;
+  group_done = NULL;
+  return;
+}
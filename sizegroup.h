@@ -0,0 +1,24 @@
+/* jdupes tracking of finished file size groups
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_SIZEGROUP_H
+#define JDUPES_SIZEGROUP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Called with every file of one size, in file list order */
+typedef void (*sizegroup_done_t)(file_t ** const restrict group, const size_t count);
+
+int sizegroup_start(file_t * restrict files, sizegroup_done_t done);
+void sizegroup_file_done(const file_t * const restrict file);
+void sizegroup_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_SIZEGROUP_H */
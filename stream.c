@@ -0,0 +1,87 @@
+/* jdupes streaming actions on finished duplicate sets
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "stream.h"
+
+#ifndef NO_STREAM
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "act_deletefiles.h"
+#include "act_linkfiles.h"
+#include "act_printmatches.h"
+#ifndef NO_JSON
+ #include "act_printjson.h"
+#endif
+
+/* Files can only match other files of the same size, so the duplicate sets
+ * of one size are final once every file of that size has been through the
+ * main scan loop (see sizegroup.c). With --stream they are acted upon right
+ * away instead of after the whole scan so that output starts early. */
+
+static int acted = 0;
+
+
+/* Run the selected action on one duplicate set */
+static void act_on_set(file_t * const restrict head)
+{
+  file_t * const next = head->next;
+
+  LOUD(fprintf(stderr, "stream: acting on set of '%s'\n", head->d_name);)
+  /* The actions walk a file list; make this set the whole list */
+  head->next = NULL;
+#ifndef NO_DELETE
+  if (ISFLAG(a_flags, FA_DELETEFILES)) deletefiles(head, 0, 0);
+#endif
+#ifndef NO_SYMLINKS
+  if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(head, 0, 1);
+#endif
+#ifndef NO_HARDLINKS
+  if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(head, 1, 1);
+#endif
+#ifndef NO_JSON
+  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson_set(head);
+#endif
+  if (ISFLAG(a_flags, FA_PRINTMATCHES)) {
+    if (acted) jc_fwprint(stdout, "", ISFLAG(a_flags, FA_PRINTNULL) ? 2 : 1);
+    printmatches(head);
+  }
+  head->next = next;
+  CLEARFLAG(head->flags, FF_HAS_DUPES);
+  acted = 1;
+  return;
+}
+
+
+/* Act on all sets of a finished size */
+void stream_sets(file_t ** const restrict group, const size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (!ISFLAG(group[i]->flags, FF_HAS_DUPES)) continue;
+    if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+    act_on_set(group[i]);
+  }
+#ifndef NO_JSON
+  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson_flush();
+#endif
+  fflush(stdout);
+  return;
+}
+
+
+/* Finish the output after the last set */
+void stream_finish(void)
+{
+  if (acted == 0 && (ISFLAG(a_flags, FA_PRINTMATCHES) || ISFLAG(a_flags, FA_MAKESYMLINKS)
+        || ISFLAG(a_flags, FA_HARDLINKFILES)))
+    printf("%s", s_no_dupes);
+#ifndef NO_JSON
+  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson_end();
+#endif
+  return;
+}
+
+#endif /* NO_STREAM */
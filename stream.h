@@ -0,0 +1,24 @@
+/* jdupes streaming actions on finished duplicate sets
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_STREAM_H
+#define JDUPES_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+#ifndef NO_STREAM
+
+void stream_sets(file_t ** const restrict group, const size_t count);
+void stream_finish(void);
+
+#endif /* NO_STREAM */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_STREAM_H */
@@ -1,4 +1,278 @@
 #!/bin/sh
 
-# This is a dummy test script meant for automated builds to succeed.
+# Behavior tests for jdupes; run from the source directory after building.
+# Every test works on scratch copies so that testdir is never modified.
+# Set JDUPES to test a binary other than ./jdupes
+
+JDUPES="${JDUPES:-./jdupes}"
+PASS=0; FAIL=0; SKIP=0
+
+[ ! -x "$JDUPES" ] && echo "error: $JDUPES not found; build it first" && exit 1
+T="$(mktemp -d "${TMPDIR:-/tmp}/jdupes-test.XXXXXX")" || exit 1
+trap 'rm -rf "$T"' EXIT
+HELP="$("$JDUPES" -h 2>&1)"
+
+pass () { PASS=$((PASS + 1)); echo "PASS: $1"; }
+fail () { FAIL=$((FAIL + 1)); echo "FAIL: $1"; }
+skip () { SKIP=$((SKIP + 1)); echo "SKIP: $1 (${2:-not in this build})"; }
+# Is an option listed in the help text of this build?
+has_opt () { echo "$HELP" | grep -q -- "--$1"; }
+links () { ls -l "$1" | awk '{ print $2 }'; }
+# Fresh copy of a small tree: three sets in two directories and a unique file
+mktree () {
+	rm -rf "$T/$1"; mkdir -p "$T/$1/d1" "$T/$1/d2"
+	for f in a b c; do
+		echo "contents of $f" > "$T/$1/d1/$f"
+		echo "contents of $f" > "$T/$1/d2/$f"
+	done
+	echo "contents of a" > "$T/$1/d2/a2"
+	echo "unique" > "$T/$1/d1/u"
+}
+# Random-looking data: mkdata file seed lines (9 bytes per line)
+mkdata () {
+	awk -v seed="$2" -v n="$3" 'BEGIN { srand(seed); for (i = 0; i < n; i++) printf "%08x\n", int(rand() * 4294967295) }' > "$1"
+}
+# Every file in a duplicate set, sorted, on one line
+sets () { "$JDUPES" -q "$@" 2>/dev/null | grep -v '^$' | sort | tr '\n' ' '; }
+
+# Plain scan of the bundled test files
+"$JDUPES" -q -r testdir > "$T/plain.out" 2>&1
+if [ $? -eq 0 ] && [ -s "$T/plain.out" ]; then pass "recursive scan"; else fail "recursive scan"; fi
+
+# Large files of one size that differ past the first block, early or at the
+# very end, are told apart by the hashing tiers
+mkdir "$T/tier"
+mkdata "$T/tier/a" 1 250000
+cp "$T/tier/a" "$T/tier/b"
+sed '$s/.*/xxxxxxxx/' "$T/tier/a" > "$T/tier/c"
+sed '20000s/.*/xxxxxxxx/' "$T/tier/a" > "$T/tier/d"
+if [ "$(sets "$T/tier")" = "$T/tier/a $T/tier/b " ]; then pass "hash tiers"; else fail "hash tiers"; fi
+
+# Small files are compared by their contents
+mkdir "$T/small"
+for f in a1 a2 a3; do echo "aaaa" > "$T/small/$f"; done
+for f in b1 b2; do echo "bbbb" > "$T/small/$f"; done
+echo "cccc" > "$T/small/c1"
+"$JDUPES" -q "$T/small" > "$T/small.out" 2>&1
+if [ "$(sets "$T/small")" = "$T/small/a1 $T/small/a2 $T/small/a3 $T/small/b1 $T/small/b2 " ] \
+		&& [ "$(awk 'BEGIN { RS = "" } END { print NR }' "$T/small.out")" -eq 2 ]; then
+	pass "small files"
+else
+	fail "small files"
+fi
+
+# Matching on 128-bit hashes finds the same sets
+if has_opt hash-verify; then
+	rm -f "$T/tier/d"
+	if [ "$(sets -k "$T/tier")" = "$T/tier/a $T/tier/b " ] && [ "$(sets -k "$T/small")" = "$(sets "$T/small")" ]; then
+		pass "hash verify (-k)"
+	else
+		fail "hash verify (-k)"
+	fi
+else
+	skip "hash verify (-k)"
+fi
+
+# Two files that can only match each other are compared directly
+mkdir "$T/pair"
+mkdata "$T/pair/a" 2 100000
+cp "$T/pair/a" "$T/pair/b"
+mkdata "$T/pair/c" 3 100001
+sed '$s/.*/xxxxxxxx/' "$T/pair/c" > "$T/pair/d"
+if [ "$(sets "$T/pair")" = "$T/pair/a $T/pair/b " ]; then pass "pair compare"; else fail "pair compare"; fi
+
+# Reflinked copies share their data on disk and are still duplicates
+mkdir "$T/ext"
+mkdata "$T/ext/a" 4 100000
+if cp --reflink=always "$T/ext/a" "$T/ext/b" 2>/dev/null; then
+	if [ "$(sets "$T/ext")" = "$T/ext/a $T/ext/b " ]; then pass "shared extents"; else fail "shared extents"; fi
+else
+	skip "shared extents" "no reflink support here"
+fi
+
+# Block dedupe pairs up large files that are not complete duplicates and
+# never changes what they contain
+if has_opt dedupe-blocks; then
+	mkdir "$T/blk"
+	mkdata "$T/blk/a" 5 300000
+	sed '150000s/.*/xxxxxxxx/' "$T/blk/a" > "$T/blk/b"
+	cp "$T/blk/a" "$T/blk.a"; cp "$T/blk/b" "$T/blk.b"
+	"$JDUPES" -q -b "$T/blk" > "$T/b.out" 2>&1
+	if grep -q "$T/blk/b" "$T/b.out" && cmp -s "$T/blk/a" "$T/blk.a" && cmp -s "$T/blk/b" "$T/blk.b"; then
+		pass "block dedupe (-b)"
+	else
+		fail "block dedupe (-b)"
+	fi
+else
+	skip "block dedupe (-b)"
+fi
+
+# Large files that differ in a few bytes are listed as similar
+if has_opt similar; then
+	mkdir "$T/sim"
+	mkdata "$T/sim/a" 1 200000
+	sed '100000s/.*/xxxxxxxx/' "$T/sim/a" > "$T/sim/b"
+	"$JDUPES" -q -j -c 50 "$T/sim" > "$T/c.out" 2>&1
+	if [ $? -eq 0 ] && grep -q '"similarPath"' "$T/c.out"; then pass "similar files (-c)"; else fail "similar files (-c)"; fi
+else
+	skip "similar files (-c)"
+fi
+
+# Many sets are linked at once; every duplicate gets linked
+if has_opt link-hard; then
+	mkdir "$T/many"
+	for i in $(seq 1 40); do
+		for f in a b c; do echo "set $i" > "$T/many/$f$i"; done
+	done
+	"$JDUPES" -q -L "$T/many" > /dev/null 2>&1
+	R=$?
+	N=0
+	for i in $(seq 1 40); do [ "$(links "$T/many/c$i")" = 3 ] && N=$((N + 1)); done
+	if [ $R -eq 0 ] && [ $N -eq 40 ]; then pass "hard link many sets (-L)"; else fail "hard link many sets (-L)"; fi
+else
+	skip "hard link many sets (-L)"
+fi
+
+# Hard links replace each duplicate in one rename and leave no temporary names
+if has_opt link-hard; then
+	mktree hl
+	"$JDUPES" -q -r -L "$T/hl" > /dev/null 2>&1
+	R=$?
+	if [ $R -eq 0 ] && [ "$(links "$T/hl/d1/a")" = 3 ] && [ "$(links "$T/hl/d2/a2")" = 3 ] \
+			&& [ "$(links "$T/hl/d2/c")" = 2 ] && [ "$(links "$T/hl/d1/u")" = 1 ] \
+			&& [ "$(cat "$T/hl/d2/a2")" = "contents of a" ] \
+			&& [ -z "$(find "$T/hl" -name '*.__jdupes__.tmp')" ]; then
+		pass "hard link (-L)"
+	else
+		fail "hard link (-L)"
+	fi
+	# A second run finds the files already linked and changes nothing
+	"$JDUPES" -q -r -L "$T/hl" > /dev/null 2>&1
+	if [ $? -eq 0 ] && [ "$(links "$T/hl/d1/a")" = 3 ]; then pass "hard link again (-L)"; else fail "hard link again (-L)"; fi
+else
+	skip "hard link (-L)"
+fi
+
+# Symlinks point at the source and keep the duplicates' names and contents
+if has_opt link-soft; then
+	mktree sl
+	"$JDUPES" -q -r -l "$T/sl" > /dev/null 2>&1
+	R=$?
+	N="$(find "$T/sl" -type l | wc -l)"
+	if [ $R -eq 0 ] && [ "$N" -eq 4 ] && [ ! -L "$T/sl/d1/u" ] \
+			&& [ "$(cat "$T/sl/d1/a")" = "contents of a" ] && [ "$(cat "$T/sl/d2/a")" = "contents of a" ] \
+			&& [ "$(cat "$T/sl/d2/a2")" = "contents of a" ] \
+			&& [ -z "$(find "$T/sl" -name '*.__jdupes__.tmp')" ]; then
+		pass "symlink (-l)"
+	else
+		fail "symlink (-l)"
+	fi
+else
+	skip "symlink (-l)"
+fi
+
+# Streaming finds the same sets as a normal scan
+if has_opt stream; then
+	"$JDUPES" -q -r -x testdir > "$T/x.out" 2>&1
+	if [ $? -eq 0 ] && [ "$(grep -v '^$' "$T/x.out" | sort)" = "$(grep -v '^$' "$T/plain.out" | sort)" ]; then pass "streaming (-x)"; else fail "streaming (-x)"; fi
+else
+	skip "streaming (-x)"
+fi
+
+# NDJSON has a header line and then one line per set
+if has_opt ndjson; then
+	SETS="$(grep -c '^$' "$T/plain.out")"
+	"$JDUPES" -q -r -J testdir > "$T/j.out" 2>&1
+	if [ $? -eq 0 ] && [ "$(wc -l < "$T/j.out")" -eq $((SETS + 1)) ] && grep -q '"fileList"' "$T/j.out"; then
+		pass "NDJSON (-J)"
+	else
+		fail "NDJSON (-J)"
+	fi
+else
+	skip "NDJSON (-J)"
+fi
+
+# Extra JSON fields, and how each match was confirmed: small files and pairs
+# are compared byte for byte even with -k, in builds that have either one
+if has_opt json-fields; then
+	"$JDUPES" -q -r -j -F testdir > "$T/jf.out" 2>&1
+	if [ $? -eq 0 ] && grep -q '"inode":' "$T/jf.out" && grep -q '"fullHash":' "$T/jf.out" && grep -q '"matchedBy":' "$T/jf.out"; then
+		pass "JSON fields (-F)"
+	else
+		fail "JSON fields (-F)"
+	fi
+	if has_opt hash-verify; then
+		"$JDUPES" -q -k -j -F "$T/small" "$T/pair" > "$T/jk.out" 2>&1
+		"$JDUPES" -q -k -j -F "$T/tier" > "$T/jt.out" 2>&1
+		if grep -q '"matchedBy": "bytes"' "$T/jk.out" && [ "$(grep -c '"matchedBy": "hash"' "$T/jt.out")" -eq 1 ]; then
+			pass "JSON match method (-F -k)"
+		else
+			fail "JSON match method (-F -k)"
+		fi
+	else
+		skip "JSON match method (-F -k)"
+	fi
+else
+	skip "JSON fields (-F)"
+fi
+
+# Result files load back to the same sets
+if has_opt write-results; then
+	"$JDUPES" -q -r -W "$T/results" testdir > "$T/w.out" 2>&1
+	"$JDUPES" -q -G "$T/results" > "$T/g.out" 2>&1
+	# $(...) drops trailing blank lines, which depend on the order of the sets
+	if [ $? -eq 0 ] && [ "$(cat "$T/w.out")" = "$(cat "$T/g.out")" ]; then pass "result file round trip (-W/-G)"; else fail "result file round trip (-W/-G)"; fi
+else
+	skip "result file round trip (-W/-G)"
+fi
+
+# Actions on loaded results leave files that changed since the scan alone
+if has_opt write-results && has_opt link-hard; then
+	mktree rf
+	"$JDUPES" -q -r -W "$T/results2" "$T/rf" > /dev/null 2>&1
+	echo "changed since the scan" > "$T/rf/d2/c"
+	"$JDUPES" -q -G "$T/results2" -L > /dev/null 2>&1
+	if [ "$(links "$T/rf/d2/a2")" = 3 ] && [ "$(cat "$T/rf/d2/c")" = "changed since the scan" ]; then
+		pass "actions on loaded results (-G -L)"
+	else
+		fail "actions on loaded results (-G -L)"
+	fi
+else
+	skip "actions on loaded results (-G -L)"
+fi
+
+# A tree snapshot gives the same results when it is created and when reused,
+# and still sees files that were added, removed, or rewritten in place
+if has_opt tree-snapshot; then
+	"$JDUPES" -q -r -Y "$T/snap" testdir > "$T/y1.out" 2>/dev/null
+	"$JDUPES" -q -r -Y "$T/snap" testdir > "$T/y2.out" 2>/dev/null
+	if [ -s "$T/snap" ] && cmp -s "$T/y1.out" "$T/plain.out" && cmp -s "$T/y2.out" "$T/plain.out"; then
+		pass "tree snapshot (-Y)"
+	else
+		fail "tree snapshot (-Y)"
+	fi
+	# Directories changed within the current second are never replayed
+	mktree ys
+	mkdata "$T/ys/d1/big" 6 10000
+	cp "$T/ys/d1/big" "$T/ys/d2/big"
+	sleep 1
+	HDB=""
+	has_opt hash-db && HDB="-y $T/hashdb"
+	"$JDUPES" -q -r -Y "$T/snap2" $HDB "$T/ys" > /dev/null 2>&1
+	echo "contents of b" > "$T/ys/d1/new"
+	rm "$T/ys/d1/u"
+	# d2 itself is unchanged and replayed; its file big is not
+	sed '$s/.*/xxxxxxxx/' "$T/ys/d1/big" > "$T/big"
+	cat "$T/big" > "$T/ys/d2/big"
+	if [ "$(sets -r -Q -Y "$T/snap2" $HDB "$T/ys")" = "$T/ys/d1/a $T/ys/d1/b $T/ys/d1/c $T/ys/d1/new $T/ys/d2/a $T/ys/d2/a2 $T/ys/d2/b $T/ys/d2/c " ]; then
+		pass "tree snapshot of a changed tree (-Y)"
+	else
+		fail "tree snapshot of a changed tree (-Y)"
+	fi
+else
+	skip "tree snapshot (-Y)"
+fi
+
+echo "$PASS passed, $FAIL failed, $SKIP skipped"
+[ $FAIL -eq 0 ] || exit 1
 echo "OK"
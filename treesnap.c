@@ -0,0 +1,473 @@
+/* jdupes directory tree snapshots
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "treesnap.h"
+
+#ifndef NO_TREESNAP
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "interrupt.h"
+
+/* A tree snapshot stores the listing of every directory read in a run, with
+ * the stat() information of each entry. Adding, removing, or renaming an
+ * entry changes the directory's mtime and ctime, so the next run can replay
+ * the listing of a directory where both are unchanged instead of reading it.
+ * Files can be rewritten in place without touching their directory, so each
+ * replayed entry is still stat()ed, relative to the open directory.
+ *
+ * Snapshot header format: jdupes treesnap:version,update_time
+ * Directory line: D,device,inode,mtime,ctime,entry_count,path
+ * Entry lines that follow it (entry_count of them):
+ *   F,size,inode,device,mtime,atime,mode,nlink,uid,gid,flags,name
+ *   N,name  (an entry that was not stat()ed or was rejected)
+ * All numbers are hex; flags bit 0 marks a symlink */
+
+#define TREESNAP_VER 1
+#define TREESNAP_HEADER "jdupes treesnap:"
+#define SNAP_SYMLINK 1U
+#define SNAP_F_FIELDS 10
+
+struct _snapentry {
+  struct _snapentry *next;  /* Hash chain */
+  const char *path;
+  const char *lines;        /* First entry line */
+  uint64_t device;
+  uint64_t inode;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t count;
+  int written;              /* Already in the new snapshot */
+};
+
+static char *snap_data = NULL;
+static struct _snapentry *snap_entries = NULL;
+static size_t snap_count = 0;
+static struct _snapentry **snap_table = NULL;
+static size_t snap_mask = 0;
+static FILE *snap_out = NULL;
+static char *snap_tmpname = NULL;
+static time_t snap_start;
+
+
+static uint64_t path_hash(const char *path)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (; *path != '\0'; path++) hash = (hash ^ (unsigned char)*path) * 0x100000001b3ULL;
+  return hash;
+}
+
+
+static struct _snapentry *find_entry(const char * const restrict path)
+{
+  struct _snapentry *cur;
+
+  if (snap_table == NULL) return NULL;
+  for (cur = snap_table[path_hash(path) & snap_mask]; cur != NULL; cur = cur->next)
+    if (strcmp(cur->path, path) == 0) return cur;
+  return NULL;
+}
+
+
+/* Read one comma-terminated hex number and step past it */
+static int get_field(const char ** const restrict p, uint64_t * const restrict value)
+{
+  char *end;
+
+  if (!isxdigit((unsigned char)**p)) return -1;
+  *value = strtoull(*p, &end, 16);
+  if (*end != ',') return -1;
+  *p = end + 1;
+  return 0;
+}
+
+
+/* Returns the name in an entry line or NULL if the line is bad */
+static const char *entry_name(const char *line)
+{
+  uint64_t value;
+
+  if (line[0] == 'N' && line[1] == ',') line += 2;
+  else if (line[0] == 'F' && line[1] == ',') {
+    line += 2;
+    for (int i = 0; i < SNAP_F_FIELDS; i++) if (get_field(&line, &value) != 0) return NULL;
+  } else return NULL;
+  if (*line == '\0' || strchr(line, '/') != NULL) return NULL;
+  return line;
+}
+
+
+static int write_dir(const struct _snapentry * const restrict entry, const char * const restrict path,
+    const char * const restrict lines, const size_t len)
+{
+  fprintf(snap_out, "D,%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx32 ",%s\n",
+      entry->device, entry->inode, (uint64_t)entry->mtime, (uint64_t)entry->ctime, entry->count, path);
+  if (len > 0) fwrite(lines, 1, len, snap_out);
+  return ferror(snap_out);
+}
+
+
+/* Cached lines are stored NUL-terminated; put the newlines back */
+static int write_cached_dir(struct _snapentry * const restrict entry)
+{
+  const char *line = entry->lines;
+
+  entry->written = 1;
+  write_dir(entry, entry->path, NULL, 0);
+  for (uint32_t i = 0; i < entry->count; i++) {
+    fputs(line, snap_out);
+    fputc('\n', snap_out);
+    line += strlen(line) + 1;
+  }
+  return ferror(snap_out);
+}
+
+
+static int load_snapshot(const char * const restrict name)
+{
+  FILE *in;
+  size_t size = 0, alloc = 0, entry_alloc = 0;
+  char *p, *end;
+  uint64_t linenum = 1;
+  size_t r;
+
+  errno = 0;
+  in = jc_fopen(name, JC_FILE_MODE_RDONLY_SEQ);
+  if (in == NULL) goto warn_snapshot_open;
+  do {
+    if (alloc - size < 65536) {
+      alloc = (alloc == 0) ? 1048576 : alloc * 2;
+      snap_data = (char *)realloc(snap_data, alloc);
+      if (unlikely(snap_data == NULL)) jc_oom("load_snapshot()");
+    }
+    r = fread(snap_data + size, 1, alloc - size, in);
+    size += r;
+  } while (r > 0);
+  if (ferror(in) != 0) {
+    fclose(in);
+    goto error_snapshot_read;
+  }
+  fclose(in);
+  if (size == 0) goto warn_snapshot_open;
+  if (snap_data[size - 1] != '\n') goto error_snapshot_line;
+  for (size_t i = 0; i < size; i++) if (snap_data[i] == '\n') snap_data[i] = '\0';
+  end = snap_data + size;
+
+  p = snap_data;
+  if (strncmp(p, TREESNAP_HEADER, strlen(TREESNAP_HEADER)) != 0) goto error_snapshot_header;
+  if (strtoul(p + strlen(TREESNAP_HEADER), NULL, 10) != TREESNAP_VER) goto error_snapshot_header;
+  p += strlen(p) + 1;
+
+  while (p < end) {
+    struct _snapentry *entry;
+    const char *field = p + 2;
+    uint64_t device, inode, mtime, ctime, count;
+
+    linenum++;
+    if (p[0] != 'D' || p[1] != ',' || get_field(&field, &device) != 0 || get_field(&field, &inode) != 0
+        || get_field(&field, &mtime) != 0 || get_field(&field, &ctime) != 0
+        || get_field(&field, &count) != 0 || count > UINT32_MAX || *field == '\0') goto error_snapshot_line;
+    if (snap_count == entry_alloc) {
+      entry_alloc = (entry_alloc == 0) ? 4096 : entry_alloc * 2;
+      snap_entries = (struct _snapentry *)realloc(snap_entries, sizeof(struct _snapentry) * entry_alloc);
+      if (unlikely(snap_entries == NULL)) jc_oom("load_snapshot() entries");
+    }
+    entry = &snap_entries[snap_count++];
+    memset(entry, 0, sizeof(struct _snapentry));
+    entry->path = field;
+    entry->device = device;
+    entry->inode = inode;
+    entry->mtime = (int64_t)mtime;
+    entry->ctime = (int64_t)ctime;
+    entry->count = (uint32_t)count;
+    p += strlen(p) + 1;
+    entry->lines = p;
+    for (uint32_t i = 0; i < entry->count; i++) {
+      linenum++;
+      if (p >= end || entry_name(p) == NULL) goto error_snapshot_line;
+      p += strlen(p) + 1;
+    }
+  }
+
+  /* Hash the paths; the first listing of a path wins */
+  for (snap_mask = 16; snap_mask < snap_count * 2; snap_mask <<= 1);
+  snap_table = (struct _snapentry **)calloc(snap_mask, sizeof(struct _snapentry *));
+  if (unlikely(snap_table == NULL)) jc_oom("load_snapshot() table");
+  snap_mask--;
+  for (size_t i = snap_count; i > 0; i--) {
+    struct _snapentry * const entry = &snap_entries[i - 1];
+    const uint64_t bucket = path_hash(entry->path) & snap_mask;
+
+    entry->next = snap_table[bucket];
+    snap_table[bucket] = entry;
+  }
+  LOUD(fprintf(stderr, "load_snapshot: %" PRIuMAX " directories from '%s'\n", (uintmax_t)snap_count, name);)
+  return 0;
+
+warn_snapshot_open:
+  fprintf(stderr, "Creating a new tree snapshot '%s'\n", name);
+  return 0;
+error_snapshot_read:
+  fprintf(stderr, "error reading tree snapshot '%s': %s\n", name, strerror(errno));
+  return -1;
+error_snapshot_header:
+  fprintf(stderr, "error in header of tree snapshot '%s'\n", name);
+  return -1;
+error_snapshot_line:
+  fprintf(stderr, "error: bad line %" PRIu64 " in tree snapshot '%s'\n", linenum, name);
+  return -1;
+}
+
+
+/* Load a snapshot and start writing the new one next to it
+ * Returns 0 on success or -1 on error */
+int treesnap_open(const char * const restrict name)
+{
+  if (unlikely(name == NULL)) jc_nullptr("treesnap_open()");
+  LOUD(fprintf(stderr, "treesnap_open('%s')\n", name);)
+
+  /* Directories changed during this second can change again unnoticed */
+  snap_start = time(NULL);
+  if (load_snapshot(name) != 0) goto error;
+
+  snap_tmpname = (char *)malloc(strlen(name) + 5);
+  if (unlikely(snap_tmpname == NULL)) jc_oom("treesnap_open()");
+  strcpy(snap_tmpname, name);
+  strcat(snap_tmpname, ".tmp");
+  errno = 0;
+  snap_out = jc_fopen(snap_tmpname, JC_FILE_MODE_RW_SEQ);
+  if (snap_out == NULL) goto error_snapshot_open;
+  fprintf(snap_out, "%s%d,%08lx\n", TREESNAP_HEADER, TREESNAP_VER, (unsigned long)snap_start);
+  return 0;
+
+error_snapshot_open:
+  fprintf(stderr, "error: cannot open tree snapshot '%s' for writing: %s\n", snap_tmpname, strerror(errno));
+error:
+  treesnap_close(name, 0);
+  return -1;
+}
+
+
+/* Finish the new snapshot and replace the old one with it, or throw it away
+ * if save is 0. Listings not used in this run are kept.
+ * Returns 0 on success or -1 on error */
+int treesnap_close(const char * const restrict name, const int save)
+{
+  int err = 0;
+
+  LOUD(fprintf(stderr, "treesnap_close('%s', %d)\n", name, save);)
+  if (snap_out != NULL) {
+    if (save != 0)
+      for (size_t i = 0; i < snap_count; i++)
+        if (snap_entries[i].written == 0 && find_entry(snap_entries[i].path) == &snap_entries[i]) write_cached_dir(&snap_entries[i]);
+    err = ferror(snap_out);
+    if (fclose(snap_out) != 0) err = 1;
+    snap_out = NULL;
+    if (save != 0 && err != 0) fprintf(stderr, "error: writing failed to tree snapshot '%s'\n", snap_tmpname);
+    if (save != 0 && err == 0 && jc_rename(snap_tmpname, name) != 0) {
+      fprintf(stderr, "error: cannot replace tree snapshot '%s': %s\n", name, strerror(errno));
+      err = 1;
+    }
+    if (save == 0 || err != 0) jc_remove(snap_tmpname);
+  }
+  free(snap_tmpname);
+  free(snap_table);
+  free(snap_entries);
+  free(snap_data);
+  snap_tmpname = NULL;
+  snap_table = NULL;
+  snap_entries = NULL;
+  snap_data = NULL;
+  snap_count = 0;
+  return (err != 0) ? -1 : 0;
+}
+
+
+/* Start on a directory that stat() returned st for
+ * Returns 1 if its listing can be replayed or 0 if it must be read */
+int treesnap_dir_begin(snapdir_t * const restrict sd, const char * const restrict dir, const struct stat * const restrict st)
+{
+  struct _snapentry *entry;
+
+  if (unlikely(sd == NULL || dir == NULL || st == NULL)) jc_nullptr("treesnap_dir_begin()");
+  memset(sd, 0, sizeof(snapdir_t));
+  sd->dirfd = -1;
+  if (snap_out == NULL) return 0;
+  sd->device = (uint64_t)st->st_dev;
+  sd->inode = (uint64_t)st->st_ino;
+  sd->mtime = (int64_t)st->st_mtime;
+  sd->ctime = (int64_t)st->st_ctime;
+
+  entry = find_entry(dir);
+  sd->entry = entry;
+  if (st->st_mtime < snap_start && st->st_ctime < snap_start && strchr(dir, '\n') == NULL) {
+    sd->alloc = 4096;
+    sd->buf = (char *)malloc(sd->alloc);
+    if (unlikely(sd->buf == NULL)) jc_oom("treesnap_dir_begin()");
+  }
+  if (entry != NULL && entry->device == sd->device && entry->inode == sd->inode
+      && entry->mtime == sd->mtime && entry->ctime == sd->ctime) {
+    sd->dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (sd->dirfd == -1) return 0;
+    LOUD(fprintf(stderr, "treesnap: replaying %" PRIu32 " entries of '%s'\n", entry->count, dir);)
+    sd->pos = entry->lines;
+    sd->left = entry->count;
+    return 1;
+  }
+  return 0;
+}
+
+
+/* Get the next name of a replayed listing and its entry line for
+ * treesnap_dir_apply(); returns NULL at the end */
+const char *treesnap_dir_next(snapdir_t * const restrict sd, const char ** const restrict line)
+{
+  const char *name;
+
+  if (sd->pos == NULL || sd->left == 0) return NULL;
+  *line = sd->pos;
+  name = entry_name(sd->pos);
+  sd->pos += strlen(sd->pos) + 1;
+  sd->left--;
+  return name;
+}
+
+
+/* Get a replayed entry's stat() information like getfilestats() does; if
+ * this fails, the file is left for check_singlefile() to stat() and reject */
+void treesnap_dir_apply(const snapdir_t * const restrict sd, const char * const restrict line,
+    const char * const restrict name, file_t * const restrict file)
+{
+  struct stat st;
+
+  /* Entries that were rejected when the listing was read are checked again */
+  if (line[0] != 'F') return;
+#ifndef NO_SYMLINKS
+  if (fstatat(sd->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+  if (S_ISLNK(st.st_mode)) {
+    SETFLAG(file->flags, FF_IS_SYMLINK);
+    if (fstatat(sd->dirfd, name, &st, 0) != 0) return;
+  }
+#else
+  if (fstatat(sd->dirfd, name, &st, 0) != 0) return;
+#endif
+  file->size = st.st_size;
+  file->inode = st.st_ino;
+  file->device = st.st_dev;
+#ifndef NO_MTIME
+  file->mtime = st.st_mtime;
+#endif
+#ifndef NO_ATIME
+  file->atime = st.st_atime;
+#endif
+  file->mode = st.st_mode;
+#ifndef NO_HARDLINKS
+  file->nlink = st.st_nlink;
+#endif
+#ifndef NO_PERMS
+  file->uid = st.st_uid;
+  file->gid = st.st_gid;
+#endif
+  SETFLAG(file->flags, FF_VALID_STAT);
+  return;
+}
+
+
+/* Record an entry of a directory being read; file is NULL for an entry
+ * without valid stat() information */
+void treesnap_dir_add(snapdir_t * const restrict sd, const char * const restrict name, const file_t * const restrict file)
+{
+  char line[256];
+  size_t len, namelen;
+
+  if (sd->buf == NULL) return;
+  /* Newlines can't be stored; never replay this directory */
+  if (strchr(name, '\n') != NULL || sd->count == UINT32_MAX) {
+    free(sd->buf);
+    sd->buf = NULL;
+    return;
+  }
+
+  if (file != NULL) {
+    uint64_t atime = 0, nlink = 0, uid = 0, gid = 0, mtime = 0;
+
+#ifndef NO_MTIME
+    mtime = (uint64_t)file->mtime;
+#endif
+#ifndef NO_ATIME
+    atime = (uint64_t)file->atime;
+#endif
+#ifndef NO_HARDLINKS
+    nlink = (uint64_t)file->nlink;
+#endif
+#ifndef NO_PERMS
+    uid = (uint64_t)file->uid;
+    gid = (uint64_t)file->gid;
+#endif
+    len = (size_t)snprintf(line, sizeof(line), "F,%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx64
+        ",%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%x,", (uint64_t)file->size, (uint64_t)file->inode, (uint64_t)file->device,
+        mtime, atime, (uint64_t)file->mode, nlink, uid, gid, ISFLAG(file->flags, FF_IS_SYMLINK) ? SNAP_SYMLINK : 0);
+  } else {
+    strcpy(line, "N,");
+    len = 2;
+  }
+
+  namelen = strlen(name);
+  while (sd->len + len + namelen + 1 > sd->alloc) {
+    sd->alloc *= 2;
+    sd->buf = (char *)realloc(sd->buf, sd->alloc);
+    if (unlikely(sd->buf == NULL)) jc_oom("treesnap_dir_add()");
+  }
+  memcpy(sd->buf + sd->len, line, len);
+  memcpy(sd->buf + sd->len + len, name, namelen);
+  sd->len += len + namelen;
+  sd->buf[sd->len++] = '\n';
+  sd->count++;
+  return;
+}
+
+
+/* Write out a directory once all of it has been loaded */
+void treesnap_dir_end(snapdir_t * const restrict sd, const char * const restrict dir)
+{
+  if (snap_out == NULL || interrupt != 0) goto done;
+
+  /* A replayed listing is saved with the fresh stat() information */
+  if (sd->pos != NULL && sd->buf == NULL) write_cached_dir(sd->entry);
+  else {
+    struct _snapentry entry;
+
+    /* The old listing of this path is out of date */
+    if (sd->entry != NULL) sd->entry->written = 1;
+    if (sd->buf == NULL) goto done;
+
+    entry.device = sd->device;
+    entry.inode = sd->inode;
+    entry.mtime = sd->mtime;
+    entry.ctime = sd->ctime;
+    entry.count = sd->count;
+    write_dir(&entry, dir, sd->buf, sd->len);
+  }
+
+done:
+  if (sd->dirfd != -1) close(sd->dirfd);
+  sd->dirfd = -1;
+  free(sd->buf);
+  sd->buf = NULL;
+  return;
+}
+
+#endif /* NO_TREESNAP */
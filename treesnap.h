@@ -0,0 +1,51 @@
+/* jdupes directory tree snapshots
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_TREESNAP_H
+#define JDUPES_TREESNAP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+#ifndef NO_TREESNAP
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct _snapentry;
+
+/* Directory listing state kept by loaddir() for each directory it reads */
+typedef struct _snapdir {
+  struct _snapentry *entry;  /* Snapshot entry for this path, if any */
+  const char *pos;           /* Next line of a replayed listing; NULL if reading */
+  uint32_t left;             /* Lines left to replay */
+  int dirfd;                 /* Replayed directory, to stat() its entries */
+  char *buf;                 /* New listing being recorded; NULL if not saved */
+  size_t len;
+  size_t alloc;
+  uint32_t count;
+  uint64_t device;
+  uint64_t inode;
+  int64_t mtime;
+  int64_t ctime;
+} snapdir_t;
+
+int treesnap_open(const char * const restrict name);
+int treesnap_close(const char * const restrict name, const int save);
+int treesnap_dir_begin(snapdir_t * const restrict sd, const char * const restrict dir, const struct stat * const restrict st);
+const char *treesnap_dir_next(snapdir_t * const restrict sd, const char ** const restrict line);
+void treesnap_dir_apply(const snapdir_t * const restrict sd, const char * const restrict line,
+    const char * const restrict name, file_t * const restrict file);
+void treesnap_dir_add(snapdir_t * const restrict sd, const char * const restrict name, const file_t * const restrict file);
+void treesnap_dir_end(snapdir_t * const restrict sd, const char * const restrict dir);
+
+#endif /* NO_TREESNAP */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_TREESNAP_H */
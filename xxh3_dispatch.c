@@ -0,0 +1,99 @@
+/* jdupes XXH3 hashing with run-time SIMD selection
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_XXHASH3
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __GNUC__
+ #pragma GCC diagnostic ignored "-Waggregate-return"
+#endif
+
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+#include "xxh3_dispatch.h"
+
+/* The generic build of xxHash uses the best SIMD instructions that every
+ * CPU of the target architecture has (SSE2 on x86-64, NEON on AArch64).
+ * On x86-64 the Makefile also builds AVX2 and AVX-512 copies of the XXH3
+ * core (see xxh3_simd.c) and xxh3_dispatch_init() picks the fastest one the
+ * CPU supports. All copies produce identical hashes. */
+
+static int xxh3_update_generic(void * const state, const void * const data, const size_t len);
+static uint64_t xxh3_digest_generic(const void * const state);
+static uint64_t xxh3_64_generic(const void * const data, const size_t len);
+static uint64_t xxh3_128_digest_generic(const void * const state, uint64_t * const hi);
+static uint64_t xxh3_128_generic(const void * const data, const size_t len, uint64_t * const hi);
+
+int (*xxh3_update)(void * const state, const void * const data, const size_t len) = xxh3_update_generic;
+uint64_t (*xxh3_digest)(const void * const state) = xxh3_digest_generic;
+uint64_t (*xxh3_64)(const void * const data, const size_t len) = xxh3_64_generic;
+uint64_t (*xxh3_128_digest)(const void * const state, uint64_t * const hi) = xxh3_128_digest_generic;
+uint64_t (*xxh3_128)(const void * const data, const size_t len, uint64_t * const hi) = xxh3_128_generic;
+#if defined __x86_64__ || defined _M_X64
+const char *xxh3_simd_name = "sse2";
+#elif defined __aarch64__ || defined _M_ARM64
+const char *xxh3_simd_name = "neon";
+#else
+const char *xxh3_simd_name = "generic";
+#endif
+
+
+static int xxh3_update_generic(void * const state, const void * const data, const size_t len)
+{
+  return (XXH3_64bits_update((XXH3_state_t *)state, data, len) == XXH_OK) ? 0 : -1;
+}
+
+static uint64_t xxh3_digest_generic(const void * const state)
+{
+  return XXH3_64bits_digest((const XXH3_state_t *)state);
+}
+
+static uint64_t xxh3_64_generic(const void * const data, const size_t len)
+{
+  return XXH3_64bits(data, len);
+}
+
+static uint64_t xxh3_128_digest_generic(const void * const state, uint64_t * const hi)
+{
+  const XXH128_hash_t hash = XXH3_128bits_digest((const XXH3_state_t *)state);
+  *hi = hash.high64;
+  return hash.low64;
+}
+
+static uint64_t xxh3_128_generic(const void * const data, const size_t len, uint64_t * const hi)
+{
+  const XXH128_hash_t hash = XXH3_128bits(data, len);
+  *hi = hash.high64;
+  return hash.low64;
+}
+
+
+/* Point the hash functions at the fastest code for this CPU. This must be
+ * called before any hashing threads are started; until it is called the
+ * generic code is used */
+void xxh3_dispatch_init(void)
+{
+#ifdef XXH3_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    xxh3_update = xxh3_update_avx512;
+    xxh3_digest = xxh3_digest_avx512;
+    xxh3_64 = xxh3_64_avx512;
+    xxh3_128_digest = xxh3_128_digest_avx512;
+    xxh3_128 = xxh3_128_avx512;
+    xxh3_simd_name = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    xxh3_update = xxh3_update_avx2;
+    xxh3_digest = xxh3_digest_avx2;
+    xxh3_64 = xxh3_64_avx2;
+    xxh3_128_digest = xxh3_128_digest_avx2;
+    xxh3_128 = xxh3_128_avx2;
+    xxh3_simd_name = "avx2";
+  }
+#endif /* XXH3_X86_DISPATCH */
+  return;
+}
+
+#endif /* NO_XXHASH3 */
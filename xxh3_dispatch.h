@@ -0,0 +1,48 @@
+/* jdupes XXH3 hashing with run-time SIMD selection
+ * See jdupes.c for license information */
+
+#ifndef JDUPES_XXH3_DISPATCH_H
+#define JDUPES_XXH3_DISPATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NO_XXHASH3
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* States are XXH3_state_t objects from XXH3_createState() and reset with
+ * XXH3_64bits_reset(); only the data-crunching calls are dispatched. The
+ * 64-bit and 128-bit variants share the state and the update function.
+ * 128-bit hashes return the low half and store the high half in *hi. */
+extern int (*xxh3_update)(void * const state, const void * const data, const size_t len);
+extern uint64_t (*xxh3_digest)(const void * const state);
+extern uint64_t (*xxh3_64)(const void * const data, const size_t len);
+extern uint64_t (*xxh3_128_digest)(const void * const state, uint64_t * const hi);
+extern uint64_t (*xxh3_128)(const void * const data, const size_t len, uint64_t * const hi);
+extern const char *xxh3_simd_name;
+
+void xxh3_dispatch_init(void);
+
+#ifdef XXH3_X86_DISPATCH
+int xxh3_update_avx2(void * const state, const void * const data, const size_t len);
+uint64_t xxh3_digest_avx2(const void * const state);
+uint64_t xxh3_64_avx2(const void * const data, const size_t len);
+uint64_t xxh3_128_digest_avx2(const void * const state, uint64_t * const hi);
+uint64_t xxh3_128_avx2(const void * const data, const size_t len, uint64_t * const hi);
+int xxh3_update_avx512(void * const state, const void * const data, const size_t len);
+uint64_t xxh3_digest_avx512(const void * const state);
+uint64_t xxh3_64_avx512(const void * const data, const size_t len);
+uint64_t xxh3_128_digest_avx512(const void * const state, uint64_t * const hi);
+uint64_t xxh3_128_avx512(const void * const data, const size_t len, uint64_t * const hi);
+#endif /* XXH3_X86_DISPATCH */
+
+#endif /* NO_XXHASH3 */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_XXH3_DISPATCH_H */
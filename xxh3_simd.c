@@ -0,0 +1,58 @@
+/* jdupes XXH3 hashing built for one x86 SIMD instruction set
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * The Makefile compiles this file once per instruction set with the
+ * matching compiler flags (-mavx2, -mavx512f) and XXH3_SIMD_NAME set to
+ * the suffix for the function names; xxh3_dispatch.c picks one at run
+ * time. xxHash is inlined so that every copy is private to its object. */
+
+#ifndef XXH3_SIMD_NAME
+ #error XXH3_SIMD_NAME must be defined when building this file
+#endif
+
+#ifdef __GNUC__
+ #pragma GCC diagnostic ignored "-Waggregate-return"
+ #pragma GCC diagnostic ignored "-Wswitch-default"
+#endif
+/* GCC 12's AVX-512 intrinsic headers trip over -Winit-self (GCC bug 105593) */
+#if defined __GNUC__ && !defined __clang__
+ #pragma GCC diagnostic ignored "-Wuninitialized"
+ #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+#define XXH_INLINE_ALL
+#include "xxhash.h"
+#include "xxh3_dispatch.h"
+
+#define XXH3_SIMD_CAT2(a,b) a ## _ ## b
+#define XXH3_SIMD_CAT(a,b) XXH3_SIMD_CAT2(a,b)
+#define XXH3_SIMD_FN(fn) XXH3_SIMD_CAT(fn, XXH3_SIMD_NAME)
+
+int XXH3_SIMD_FN(xxh3_update)(void * const state, const void * const data, const size_t len)
+{
+  return (XXH3_64bits_update((XXH3_state_t *)state, data, len) == XXH_OK) ? 0 : -1;
+}
+
+uint64_t XXH3_SIMD_FN(xxh3_digest)(const void * const state)
+{
+  return XXH3_64bits_digest((const XXH3_state_t *)state);
+}
+
+uint64_t XXH3_SIMD_FN(xxh3_64)(const void * const data, const size_t len)
+{
+  return XXH3_64bits(data, len);
+}
+
+uint64_t XXH3_SIMD_FN(xxh3_128_digest)(const void * const state, uint64_t * const hi)
+{
+  const XXH128_hash_t hash = XXH3_128bits_digest((const XXH3_state_t *)state);
+  *hi = hash.high64;
+  return hash.low64;
+}
+
+uint64_t XXH3_SIMD_FN(xxh3_128)(const void * const data, const size_t len, uint64_t * const hi)
+{
+  const XXH128_hash_t hash = XXH3_128bits(data, len);
+  *hi = hash.high64;
+  return hash.low64;
+}